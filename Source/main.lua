@@ -1,6 +1,8 @@
 import "CoreLibs/graphics"
 import "CoreLibs/sprites"
 import "CoreLibs/animation"
+import "CoreLibs/timer"
+import "CoreLibs/keyboard"
 
 local gfx = playdate.graphics
 local geo = playdate.geometry
@@ -18,9 +20,26 @@ local SCREEN_WIDTH, SCREEN_HEIGHT = playdate.display.getSize()
 local CURSOR_SIZE = 25
 local CURSOR_COLLISION_RECT = {x = 8, y = 8, w = 9, h = 9}
 local CURSOR_ZINDEX = 32767
+local CURSOR_ANGLE_STEPS = 72  -- crank positions the cursor's moon is drawn at
 
 local PAGE_PADDING = 10
 
+-- Cached pages younger than this are shown without asking the server
+local CACHE_FRESH_SECONDS = 10 * 60
+
+-- Compressed bodies are inflated in C as they arrive
+local ACCEPT_ENCODING = "gzip, deflate"
+
+-- Milliseconds per frame spent parsing and laying out a loading page
+local RENDER_BUDGET_MS = 12
+
+-- Inline images: the formats decoded in C, and milliseconds per frame spent decoding
+local IMAGE_ACCEPT = "image/png, image/jpeg, image/gif"
+local IMAGE_BUDGET_MS = 8
+
+-- Draw load timings, heap use and frame times over the page (see orbit.stats)
+local STATS_OVERLAY = false
+
 -- D-pad scrolling
 local scroll = {
 	animator = nil,
@@ -34,8 +53,10 @@ local nav = {
 	history = {},
 	currentURL = nil,
 	pending = false,
-	buffer = "",
+	previewShown = false,
+	loading = nil,  -- {renderer =, url =} while a page is laid out in the background
 	initialPageLoaded = false,
+	offline = false,  -- serve only cached pages
 }
 
 -- Favorites
@@ -126,6 +147,10 @@ function menu:updateOptions()
 end
 
 function menu:init()
+	self.handle:addCheckmarkMenuItem("offline", false, function(checked)
+		nav.offline = checked
+	end)
+
 	self.checkmark = self.handle:addCheckmarkMenuItem("Save", false, function(checked)
 		if nav.currentURL then
 			if checked then
@@ -154,11 +179,14 @@ local viewport = {
 }
 
 -- Page initialization
+-- The page sprite covers the screen; its content, link underlines included,
+-- is drawn from C-side tiles, so it is the only layer below the cursor
 function initializePage()
 	local page = gfx.sprite.new()
-	page:setSize(100, 100)
+	page:setSize(SCREEN_WIDTH, SCREEN_HEIGHT)
 	page:setCenter(0, 0)
 	page:moveTo(0, 0)
+	page:setOpaque(true)
 	page:add()
 
 	page.height = 0
@@ -174,20 +202,90 @@ local page = initializePage()
 -- Initialize C renderer (font cache only)
 cmark.initRenderer("fonts/cuniform")
 
--- Links array (populated by render())
-local links = {}
+-- C link table for the shown page, and the index of the link under the cursor
+local linkTable = nil
+local hoveredLink = nil
+
+-- Find in page: the last query, where its matches are on the page, and the
+-- one scrolled to
+local find = {
+	query = nil,
+	matches = {},  -- array of {x=, y=, width=, height=}
+	current = 0,
+}
+
+-- Tiles are rasterized on demand as they scroll near the screen; the hovered
+-- link's thicker underline is drawn over them, then the find matches inverted
+function page:draw(x, y, width, height)
+	orbit.drawPage(viewport.top, y, height, hoveredLink)
+
+	if #find.matches > 0 then
+		gfx.setColor(gfx.kColorXOR)
+		for _, match in ipairs(find.matches) do
+			local top = match.y - viewport.top
+			if top < y + height and top + match.height > y then
+				gfx.fillRect(match.x, top, match.width, match.height)
+			end
+		end
+		gfx.setColor(gfx.kColorBlack)
+	end
+end
 
+-- Scrolling only changes the offset the page is drawn at
 function viewport:moveTo(newTop)
 	newTop = math.floor(newTop + 0.5)
 	if newTop == self.top then return end
-	local dy = self.top - newTop
 	self.top = newTop
+	page:markDirty()
+end
+
+-- Scroll a match into the upper part of the screen
+function find:show(i)
+	self.current = i
+	local match = self.matches[i]
+	local maxTop = math.max(page.height - SCREEN_HEIGHT, 0)
+	scroll.animator = nil
+	viewport:moveTo(math.max(0, math.min(maxTop, match.y - SCREEN_HEIGHT // 3)))
+end
+
+-- Look the query up in the C word index and show the first match
+function find:search(query)
+	self.query = query
+	self.matches = {}
+	self.current = 0
+
+	local count = query and orbit.find(query) or 0
+	for i = 1, count do
+		local x, y, width, height = orbit.findMatch(i)
+		self.matches[i] = {x = x, y = y, width = width, height = height}
+	end
+	if count > 0 then
+		self:show(1)
+	end
+	page:markDirty()
+end
+
+-- Returns: false once the last match has been shown
+function find:next()
+	if self.current >= #self.matches then return false end
+	self:show(self.current + 1)
+	return true
+end
 
-	-- Move page and all link sprites
-	page:moveBy(0, dy)
-	for _, link in ipairs(links) do
-		link:moveBy(0, dy)
+-- Matches update as the query is typed; cancelling clears them
+function playdate.keyboard.textChangedCallback()
+	find:search(playdate.keyboard.text)
+end
+
+function playdate.keyboard.keyboardWillHideCallback(confirmed)
+	if not confirmed then
+		find:search(nil)
 	end
+	page:markDirty()
+end
+
+function playdate.keyboard.keyboardAnimatingCallback()
+	page:markDirty()
 end
 
 -- Cursor initialization
@@ -204,12 +302,8 @@ function initializeCursor()
 	cursor:moveTo(cursorX, cursorY)
 	cursor:setSize(CURSOR_SIZE, CURSOR_SIZE)
 	cursor:setZIndex(CURSOR_ZINDEX)
-	cursor:setCollideRect(CURSOR_COLLISION_RECT.x, CURSOR_COLLISION_RECT.y,
-	                      CURSOR_COLLISION_RECT.w, CURSOR_COLLISION_RECT.h)
-	cursor:setGroups({1})
 	cursor:add()
 
-	cursor.collisionResponse = gfx.sprite.kCollisionTypeOverlap
 	cursor.speed = 0
 	cursor.thrust = 0.5
 	cursor.maxSpeed = 8
@@ -223,26 +317,20 @@ end
 
 local cursor = initializeCursor()
 
-function cursor:updateImage()
-	local w, h = self:getSize()
-	local centerX, centerY = math.floor(w / 2) + 1, math.floor(h / 2) + 1
-	local moon = geo.point.new(centerX, h - 3)
+-- One cursor image with the moon at the crank angle, or with it blinked off
+local function drawCursorFrame(angle, moonOn)
+	local centerX, centerY = math.floor(CURSOR_SIZE / 2) + 1, math.floor(CURSOR_SIZE / 2) + 1
+	local moon = geo.point.new(centerX, CURSOR_SIZE - 3)
 	local transform = geo.affineTransform.new()
 
-	transform:rotate(playdate.getCrankPosition(), centerX, centerY)
+	transform:rotate(angle, centerX, centerY)
 	transform:transformPoint(moon)
 
 	local moonX, moonY = moon:unpack()
 
-	-- Create new image
 	local cursorImage = gfx.image.new(CURSOR_SIZE, CURSOR_SIZE, gfx.kColorClear)
 	gfx.pushContext(cursorImage)
 
-	-- Draw collision area (white, for alphaCollision)
-	gfx.setColor(gfx.kColorWhite)
-	gfx.fillRect(CURSOR_COLLISION_RECT.x, CURSOR_COLLISION_RECT.y,
-	             CURSOR_COLLISION_RECT.w, CURSOR_COLLISION_RECT.h)
-
 	-- Draw white outer squares (visible cursor design)
 	gfx.setColor(gfx.kColorWhite)
 	gfx.fillRect(moonX - 3, moonY - 3, 5, 5)
@@ -252,228 +340,584 @@ function cursor:updateImage()
 	gfx.setColor(gfx.kColorBlack)
 	gfx.fillRect(9, 9, 7, 7)
 
-	if not self.blinker.running or self.blinker.on then
+	if moonOn then
 		gfx.fillRect(moonX - 2, moonY - 2, 3, 3)
 	end
 
 	gfx.popContext()
+	return cursorImage
+end
+
+-- Every frame is drawn once here, so moving the crank or blinking only
+-- switches images: the first CURSOR_ANGLE_STEPS frames have the moon lit,
+-- the next CURSOR_ANGLE_STEPS the same angles with it blinked off
+cursor.frames = gfx.imagetable.new(CURSOR_ANGLE_STEPS * 2)
+for step = 0, CURSOR_ANGLE_STEPS - 1 do
+	local angle = step * 360 / CURSOR_ANGLE_STEPS
+	cursor.frames:setImage(step + 1, drawCursorFrame(angle, true))
+	cursor.frames:setImage(CURSOR_ANGLE_STEPS + step + 1, drawCursorFrame(angle, false))
+end
+cursor.frame = nil
 
-	self:setImage(cursorImage)
+function cursor:updateImage()
+	local step = math.floor(playdate.getCrankPosition() * CURSOR_ANGLE_STEPS / 360 + 0.5) % CURSOR_ANGLE_STEPS
+	local frame = step + 1
+	if self.blinker.running and not self.blinker.on then
+		frame = frame + CURSOR_ANGLE_STEPS
+	end
+
+	if frame == self.frame then return end
+	self.frame = frame
+	self:setImage(self.frames:getImage(frame))
 end
 
 cursor:updateImage()  -- Set initial cursor image
 
--- Link sprite class
-class('Link').extends(gfx.sprite)
+-- Index of the link under the cursor's collision box, looked up in the C link index
+local function linkUnderCursor()
+	if not linkTable then return nil end
+	local x, y = cursor:getPosition()
+	return linkTable:hitTest(x, y + viewport.top, CURSOR_COLLISION_RECT.w // 2)
+end
+
+function parseURL(url)
+	local secure = string.match(url, "^https://") ~= nil
+	local host = string.match(url, "^https?://([^/]+)")
+	local path = string.match(url, "^https?://[^/]+(/.*)") or "/"
+	local port = secure and 443 or 80
+	return host, port, secure, path
+end
+
+-- Markdown pages are rendered by cmark, everything else by a site renderer
+local function beginRender(url)
+	if url:match("%.md$") then
+		return cmark.beginStream(page.width, page.padding, fnt:getTracking(), url) and cmark
+	end
+	return html.beginStream(url, page.width, page.padding, fnt:getTracking()) and html
+end
+
+-- Header lookup that ignores the case the server used
+local function responseHeader(headers, name)
+	for key, value in pairs(headers or {}) do
+		if string.lower(key) == name then return value end
+	end
+	return nil
+end
+
+-- Idle prefetch
+-- While the reader sits still, the links nearest the cursor (and ahead of
+-- it) are downloaded one at a time and held in memory for fetchPage. Only
+-- the current page's host is fetched from, so no new server permission
+-- prompt can appear, and any real navigation cancels the download.
+local prefetch = {
+	conn = nil,
+	url = nil,
+	pages = {},  -- url -> {body =, etag =, lastModified =, encoding =}
+	order = {},  -- prefetched urls, oldest first
+	skipped = {},  -- urls that failed or were over budget
+	bytes = 0,
+	idleFrames = 0,
+	idleThreshold = 30,    -- frames without cursor or scroll movement
+	budget = 256 * 1024,   -- bytes held across prefetched pages
+	candidates = 2,
+}
+
+function prefetch:cancel()
+	if self.conn then
+		self.conn:close()
+		self.conn = nil
+		self.url = nil
+	end
+	self.idleFrames = 0
+end
+
+function prefetch:add(url, entry)
+	table.insert(self.order, url)
+	self.pages[url] = entry
+	self.bytes = self.bytes + #entry.body
+
+	while self.bytes > self.budget and #self.order > 0 do
+		self:take(self.order[1])
+	end
+end
+
+-- Returns: the prefetched page for url, removed from the prefetch cache
+function prefetch:take(url)
+	local entry = self.pages[url]
+	if not entry then return nil end
+
+	self.pages[url] = nil
+	self.bytes = self.bytes - #entry.body
+	for i, prefetched in ipairs(self.order) do
+		if prefetched == url then
+			table.remove(self.order, i)
+			break
+		end
+	end
+	return entry
+end
+
+local function canRender(url)
+	return url:match("%.md$") or html.canRender(url)
+end
+
+-- Returns: true if url is worth prefetching
+function prefetch:wants(url, host)
+	if self.pages[url] or self.skipped[url] or url == nav.currentURL then return false end
+	if not url:match("^https?://") or (parseURL(url)) ~= host then return false end
+	if not canRender(url) then return false end
+
+	local age = cache.lookup(url)
+	return not (age and age < CACHE_FRESH_SECONDS)
+end
+
+function prefetch:start(url)
+	local host, port, secure, path = parseURL(url)
+	local conn = net.http.new(host, port, secure)
+	if not conn then return end
 
-function Link:init(url, segments)
-	Link.super.init(self)
+	self.conn = conn
 	self.url = url
-	self.segments = segments  -- array of {x, y, w}
-	self.isHovered = false
+	conn:setConnectTimeout(10)
+
+	local chunks, size = {}, 0
+	local etag, lastModified, encoding, ok = nil, nil, nil, false
+	conn:setHeadersReadCallback(function()
+		ok = conn:getResponseStatus() == 200
+		local headers = conn:getResponseHeaders()
+		etag = responseHeader(headers, "etag")
+		lastModified = responseHeader(headers, "last-modified")
+		encoding = responseHeader(headers, "content-encoding")
+	end)
+
+	conn:setRequestCallback(function()
+		if self.conn ~= conn then return end
+		local bytes = conn:getBytesAvailable()
+		if bytes > 0 then
+			local chunk = conn:read(bytes)
+			if chunk then
+				table.insert(chunks, chunk)
+				size = size + #chunk
+				if size > self.budget then
+					self.skipped[url] = true
+					self:cancel()
+				end
+			end
+		end
+	end)
+
+	conn:setRequestCompleteCallback(function()
+		if self.conn ~= conn then return end
+		self.conn = nil
+		self.url = nil
+
+		local err = conn:getError()
+		if ok and (not err or err == "Connection closed") then
+			self:add(url, {body = table.concat(chunks), etag = etag,
+				lastModified = lastModified, encoding = encoding})
+		else
+			self.skipped[url] = true
+		end
+	end)
+
+	conn:get(path, {["Accept-Encoding"] = ACCEPT_ENCODING})
+end
+
+-- Inline images
+-- The shown page's images are downloaded one at a time, those on and below
+-- the screen first, and decoded to their boxes a slice per frame. Images
+-- that fail are remembered in C and not tried again; navigation cancels the
+-- download.
+local images = {
+	conn = nil,
+	url = nil,
+	budget = 512 * 1024,  -- largest image downloaded
+}
+
+function images:cancel()
+	if self.conn then
+		self.conn:close()
+		self.conn = nil
+	end
+	if self.url then
+		orbit.cancelImage()
+		self.url = nil
+	end
+end
 
-	-- Calculate bounding box
-	local minX, minY = math.huge, math.huge
-	local maxX, maxY = -math.huge, -math.huge
-	local h = fnt:getHeight()
+function images:start(url)
+	if not orbit.beginImage(url) then return end
+	self.url = url
 
-	for _, seg in ipairs(segments) do
-		minX = math.min(minX, seg.x)
-		minY = math.min(minY, seg.y)
-		maxX = math.max(maxX, seg.x + seg.w)
-		maxY = math.max(maxY, seg.y + h)
+	local host, port, secure, path = parseURL(url)
+	local conn = host and net.http.new(host, port, secure)
+	if not conn then
+		orbit.endImageInput(false)
+		return
 	end
 
-	self.offsetX = minX
-	self.offsetY = minY
-	self.width = maxX - minX
-	self.height = maxY - minY
+	self.conn = conn
+	conn:setConnectTimeout(10)
+
+	local ok, size = false, 0
+	conn:setHeadersReadCallback(function()
+		ok = conn:getResponseStatus() == 200
+	end)
+
+	conn:setRequestCallback(function()
+		if self.conn ~= conn then return end
+		local bytes = conn:getBytesAvailable()
+		if bytes > 0 then
+			local chunk = conn:read(bytes)
+			if chunk and ok then
+				size = size + #chunk
+				if size > self.budget then
+					self.conn = nil
+					conn:close()
+					orbit.endImageInput(false)
+				else
+					orbit.feedImage(chunk)
+				end
+			end
+		end
+	end)
 
-	self:setSize(self.width, self.height)
-	self:setCenter(0, 0)
-	self:moveTo(PAGE_PADDING + minX, PAGE_PADDING + minY)
-	self:setZIndex(-1)  -- Behind page
-	self:setCollideRect(0, 0, self.width, self.height)
+	conn:setRequestCompleteCallback(function()
+		if self.conn ~= conn then return end
+		self.conn = nil
+		local err = conn:getError()
+		orbit.endImageInput(ok and (not err or err == "Connection closed"))
+	end)
 
-	self:updateImage()
-	self:add()
+	conn:get(path, {["Accept"] = IMAGE_ACCEPT})
 end
 
-function Link:updateImage()
-	local img = gfx.image.new(self.width, self.height, gfx.kColorClear)
-	gfx.pushContext(img)
+-- Called every frame; decodes what has arrived, or starts the next image
+function images:update()
+	if self.url then
+		local drawn = orbit.stepImage(IMAGE_BUDGET_MS)
+		if drawn ~= nil then
+			self.url = nil
+			if drawn then page:markDirty() end
+		end
+		return
+	end
+
+	if nav.pending or nav.offline or not nav.currentURL or prefetch.conn then return end
+	local url = orbit.nextImage(viewport.top)
+	if url then
+		self:start(url)
+	end
+end
 
-	local lineWidth = self.isHovered and 2 or 1
-	local h = fnt:getHeight()
+-- Called every frame; starts a download once the reader has been idle
+function prefetch:update(moving)
+	if nav.pending or nav.offline or not linkTable or not nav.currentURL or moving then
+		self.idleFrames = 0
+		return
+	end
 
-	for _, seg in ipairs(self.segments) do
-		local localX = seg.x - self.offsetX
-		local localY = seg.y - self.offsetY
+	self.idleFrames = self.idleFrames + 1
+	if self.conn or images.url or self.idleFrames < self.idleThreshold then return end
 
-		-- White fill for alpha collision
-		gfx.setColor(gfx.kColorWhite)
-		gfx.fillRect(localX, localY, seg.w, h)
+	local x, y = cursor:getPosition()
+	local heading = playdate.getCrankPosition() - 90
+	local host = parseURL(nav.currentURL)
+	local ranked = {linkTable:rank(x, y + viewport.top, heading,
+		viewport.top, viewport.top + SCREEN_HEIGHT, self.candidates)}
 
-		-- Underline (thicker when hovered)
-		gfx.setColor(gfx.kColorBlack)
-		gfx.drawLine(localX, localY + h - 2, localX + seg.w, localY + h - 2)
-		if lineWidth == 2 then
-			gfx.drawLine(localX, localY + h - 1, localX + seg.w, localY + h - 1)
+	for _, index in ipairs(ranked) do
+		local url = linkTable:url(index)
+		if url and self:wants(url, host) then
+			self:start(url)
+			return
 		end
 	end
+end
 
-	gfx.popContext()
-	self:setImage(img)
+-- Show the page returned by finish and make it the current page; a freshly
+-- laid-out page is saved so the next visit can skip layout
+local function finishNavigation(finish, url, saveLayout, top)
+	local success, rendered = pcall(render, finish, url, top)
+	nav.pending = false
+	cursor.blinker:stop()
+	cursor:updateImage()
+	if not (success and rendered) then return end
+
+	nav.currentURL = url
+	menu:updateCheckmark()
+	if saveLayout then
+		cache.saveLayout(url)
+	end
+	orbit.logStats(url)
 end
 
-function Link:update()
-	local wasHovered = self.isHovered
-	self.isHovered = cursor:alphaCollision(self)
-	if self.isHovered ~= wasHovered then
-		self:updateImage()
+-- Lay out a page a slice per frame from updateLoading; its chunks are fed
+-- in as they arrive, until renderer.endInput. A body that was cut short
+-- (complete = false) is shown but its layout isn't saved.
+-- Returns: the loading state
+local function beginLoading(renderer, url)
+	nav.loading = {renderer = renderer, url = url, complete = true}
+	return nav.loading
+end
+
+-- Called every frame; lays out as much of the loading page as fits in the
+-- frame budget, shows its top once a screenful is ready, and finishes it
+-- once all of it is laid out
+local function updateLoading()
+	local loading = nav.loading
+	if not loading then return end
+
+	local height, done = loading.renderer.step(RENDER_BUDGET_MS)
+	if done then
+		nav.loading = nil
+		finishNavigation(loading.renderer.finish, loading.url, loading.complete)
+	elseif nav.previewShown then
+		local pageHeight = math.max(height, SCREEN_HEIGHT)
+		if pageHeight ~= page.height then
+			page.height = pageHeight
+			page:markDirty()
+		end
+	elseif height >= SCREEN_HEIGHT then
+		showPreview(loading.renderer)
 	end
 end
 
-function parseURL(url)
-	local secure = string.match(url, "^https://") ~= nil
-	local host = string.match(url, "^https?://([^/]+)")
-	local path = string.match(url, "^https?://[^/]+(/.*)") or "/"
-	local port = secure and 443 or 80
-	return host, port, secure, path
+-- Load a page from the response cache, from its saved layout if it has one
+-- Returns: true if it was cached
+local function loadFromCache(url)
+	nav.previewShown = false
+	nav.loading = nil
+
+	local pageHeight, pageLinks = cache.showLayout(url, page.width, page.padding, fnt:getTracking())
+	if pageHeight then
+		finishNavigation(function() return pageHeight, pageLinks end, url, false)
+		return true
+	end
+
+	local renderer = beginRender(url)
+	if not renderer or not cache.load(url) then return false end
+	renderer.endInput()
+	beginLoading(renderer, url)
+	return true
 end
 
 -- url = nil means go back in history
 function fetchPage(url)
 	if nav.pending then return end
+	prefetch:cancel()
+	images:cancel()
 
-	if url then
-		if nav.currentURL then
-			table.insert(nav.history, nav.currentURL)
-		end
-	else
-		url = table.remove(nav.history)
+	local goingBack = url == nil
+	if goingBack then
+		url = nav.history[#nav.history]
 		if not url then return end
 	end
 
+	-- Back navigation, fresh pages and offline mode are served from flash
+	local age, etag, lastModified = cache.lookup(url)
+	local fromCache = age and (goingBack or nav.offline or age < CACHE_FRESH_SECONDS)
+	if not fromCache and nav.offline and not goingBack then
+		print("Not cached:", url)
+		return
+	end
+
+	if goingBack then
+		table.remove(nav.history)
+	elseif nav.currentURL then
+		table.insert(nav.history, nav.currentURL)
+	end
+
+	-- Keep the page being left in memory, where the reader left it
+	local remembered = nav.currentURL and orbit.rememberPage(nav.currentURL, viewport.top)
+
+	-- Nothing could be loaded: the reader stays on the current page, with
+	-- the history and page memory as they were and no stream left open
+	-- (cancel drops whichever stream is open, cmark or html)
+	local function stay()
+		cmark.cancel()
+		if goingBack then
+			table.insert(nav.history, url)
+		elseif nav.currentURL then
+			table.remove(nav.history)
+		end
+		if remembered then
+			orbit.forgetPage(nav.currentURL)
+		end
+		nav.pending = false
+		cursor.blinker:stop()
+	end
+
 	nav.pending = true
-	nav.buffer = ""
+	nav.previewShown = false
 	cursor.blinker:start()
 
+	-- Going back to a page still in memory redraws it straight away
+	if goingBack then
+		local pageHeight, pageLinks, top = orbit.recallPage(url)
+		if pageHeight then
+			finishNavigation(function() return pageHeight, pageLinks end, url, false, top)
+			return
+		end
+	end
+
+	-- A prefetched page is rendered from memory and cached like a download
+	local prefetched = not goingBack and prefetch:take(url)
+	if prefetched then
+		local renderer = beginRender(url)
+		if renderer then
+			cache.store(url, prefetched.etag, prefetched.lastModified)
+			if prefetched.encoding then
+				renderer.setEncoding(prefetched.encoding)
+			end
+			renderer.feed(prefetched.body)
+			local complete = renderer.endInput()
+			beginLoading(renderer, url).complete = complete
+			return
+		end
+	end
+
+	if fromCache and loadFromCache(url) then return end
+	if nav.offline then
+		print("Not cached:", url)
+		stay()
+		return
+	end
+
+	local renderer = beginRender(url)
+	if not renderer then
+		stay()
+		return
+	end
+
 	local host, port, secure, path = parseURL(url)
 	local conn = net.http.new(host, port, secure)
 	if not conn then
-		nav.pending = false
+		-- No network: fall back to a stale cached copy
+		if not (age and loadFromCache(url)) then
+			stay()
+		end
 		return
 	end
 
 	conn:setConnectTimeout(10)
 
+	-- Revalidate a cached copy instead of downloading it again
+	local headers = {["Accept-Encoding"] = ACCEPT_ENCODING}
+	if age then
+		headers["If-None-Match"] = etag
+		headers["If-Modified-Since"] = lastModified
+	end
+
+	local notModified = false
+	conn:setHeadersReadCallback(function()
+		local status = conn:getResponseStatus()
+		if status == 304 and age then
+			notModified = true
+		elseif status == 200 then
+			local responseHeaders = conn:getResponseHeaders()
+			cache.store(url, responseHeader(responseHeaders, "etag"),
+				responseHeader(responseHeaders, "last-modified"))
+
+			-- Compressed bodies are decoded before they are parsed or cached
+			local encoding = responseHeader(responseHeaders, "content-encoding")
+			if encoding then
+				renderer.setEncoding(encoding)
+			end
+		end
+	end)
+
+	-- Chunks are buffered as they arrive and laid out by updateLoading
+	local loading = beginLoading(renderer, url)
 	conn:setRequestCallback(function()
 		local bytes = conn:getBytesAvailable()
 		if bytes > 0 then
 			local chunk = conn:read(bytes)
-			if chunk then
-				nav.buffer = nav.buffer .. chunk
+			if chunk and not notModified then
+				renderer.feed(chunk)
 			end
 		end
 	end)
 
 	conn:setRequestCompleteCallback(function()
-		local err = conn:getError()
-		if err and err ~= "Connection closed" then
-			nav.pending = false
+		if notModified then
+			renderer.cancel()
+			cache.touch(url)
+			if not loadFromCache(url) then
+				nav.loading = nil
+				stay()
+			end
 			return
 		end
 
-		local success = pcall(render, nav.buffer, url)
-		if not success then
-			nav.pending = false
+		local err = conn:getError()
+		-- A page already partly on screen is finished with what arrived
+		if err and err ~= "Connection closed" and not nav.previewShown then
+			nav.loading = nil
+			renderer.cancel()
+			if not (age and loadFromCache(url)) then
+				stay()
+			end
 			return
 		end
 
-		nav.currentURL = url
-		menu:updateCheckmark()
-		nav.pending = false
-		cursor.blinker:stop()
-		cursor:updateImage()
+		loading.complete = renderer.endInput(not err or err == "Connection closed")
 	end)
 
-	conn:get(path)
+	conn:get(path, headers)
 end
 
-function render(text, url)
-	-- Remove old link sprites
-	for _, link in ipairs(links) do
-		link:remove()
-	end
-	links = {}
+-- Start drawing the new page from the top and drop the previous page's links
+function showPage(pageHeight)
+	linkTable = nil
+	hoveredLink = nil
+	find.matches = {}
+	find.current = 0
 	viewport.top = 0
 
-	local pageImage, pageHeight, linkData
-
-	if url and url:match("%.md$") then
-		-- Markdown path: use cmark
-		local linksJson
-		pageImage, pageHeight, linksJson = cmark.render(
-			text, page.width, page.padding, fnt:getTracking())
-		if not pageImage then return end
-
-		-- Decode JSON links from cmark
-		linkData = {}
-		local jsonData = json.decode(linksJson) or {}
-		for _, data in ipairs(jsonData) do
-			local segments = {}
-			for _, seg in ipairs(data.segments) do
-				table.insert(segments, {x = seg[1], y = seg[2], w = seg[3]})
-			end
-			table.insert(linkData, {url = data.url, segments = segments})
-		end
-	else
-		-- HTML path: use html.render (C implementation)
-		local linksJson
-		pageImage, pageHeight, linksJson = html.render(
-			text, url, page.width, page.padding, fnt:getTracking())
-
-		if not pageImage then
-			print("HTML render failed for:", url)
-			return
-		end
+	page.height = pageHeight
+	page:markDirty()
+end
 
-		-- Decode JSON links
-		linkData = {}
-		local jsonData = json.decode(linksJson) or {}
-		for _, data in ipairs(jsonData) do
-			local segments = {}
-			for _, seg in ipairs(data.segments) do
-				table.insert(segments, {x = seg[1], y = seg[2], w = seg[3]})
-			end
-			table.insert(linkData, {url = data.url, segments = segments})
-		end
+-- Show the top of a page that is still downloading
+function showPreview(renderer)
+	local pageHeight = renderer.preview()
+	if pageHeight then
+		showPage(pageHeight)
+		nav.previewShown = true
 	end
+end
 
-	if not pageImage then return end
+-- top: where to scroll to, by default where the reader scrolled to while
+-- the page was loading
+-- Returns: true if the page rendered
+function render(finish, url, top)
+	local pageHeight, pageLinks = finish()
+	if not pageHeight then
+		print("Render failed for:", url)
+		return false
+	end
 
-	page.height = pageHeight
-	page:setImage(pageImage)
-	page:moveTo(0, 0)
+	top = top or (nav.previewShown and viewport.top or 0)
+	showPage(pageHeight)
+	linkTable = pageLinks
 
-	-- Create Link sprites
-	for _, data in ipairs(linkData) do
-		table.insert(links, Link(data.url, data.segments))
-	end
+	viewport:moveTo(math.min(top, math.max(pageHeight - SCREEN_HEIGHT, 0)))
+	return true
 end
 
 menu:init()
 
 local function handleNavInput()
-	-- A/RIGHT to activate links
+	-- A/RIGHT to activate links; A away from links steps through the find
+	-- matches, then opens the keyboard for a new query
 	if playdate.buttonJustPressed(playdate.kButtonRight) or
 	   playdate.buttonJustPressed(playdate.kButtonA) then
-		for _, sprite in ipairs(cursor:overlappingSprites()) do
-			if cursor:alphaCollision(sprite) and sprite.url then
-				fetchPage(sprite.url)
-				break
-			end
+		local index = linkUnderCursor()
+		if index then
+			fetchPage(linkTable:url(index))
+		elseif playdate.buttonJustPressed(playdate.kButtonA) and not find:next() then
+			playdate.keyboard.show(find.query or "")
 		end
 	end
 
@@ -516,10 +960,17 @@ local function updateCursor()
 
 	-- Move cursor (clamped to screen)
 	local clampedY = math.max(0, math.min(SCREEN_HEIGHT, targetY))
-	local _, _, collisions = cursor:moveWithCollisions(targetX, clampedY)
-	for _, c in ipairs(collisions) do
-		c.other:markDirty()
-	end
+	cursor:moveTo(targetX, clampedY)
+end
+
+-- Hover follows the cursor through the link index; the page is redrawn
+-- only when the hovered link changes
+local function updateHover()
+	local index = linkUnderCursor()
+	if index == hoveredLink then return end
+
+	hoveredLink = index
+	page:markDirty()
 end
 
 local function updateScroll()
@@ -541,16 +992,50 @@ local function updateScroll()
 	end
 end
 
+-- Last page's phase times, heap use, and the share of frames on time at 30 fps
+function drawStatsOverlay()
+	local stats = json.decode(orbit.stats())
+	local frames = 0
+	for _, count in ipairs(stats.frames) do
+		frames = frames + count
+	end
+	local onTime = frames > 0 and stats.frames[1] * 100 // frames or 100
+
+	local text = string.format("net %d parse %d layout %d raster %d ms\nheap %dK peak %dK, %d%% on time",
+		stats.page.network, stats.page.parse, stats.page.layout, stats.page.raster,
+		stats.heap // 1024, stats.heapPeak // 1024, onTime)
+	local width, height = gfx.getTextSize(text)
+	gfx.setColor(gfx.kColorWhite)
+	gfx.fillRect(0, 0, width + 4, height + 4)
+	gfx.drawText(text, 2, 2)
+end
+
 function playdate.update()
 	if not nav.initialPageLoaded then
 		fetchPage(tutorial)
 		nav.initialPageLoaded = true
 	end
 
-	handleNavInput()
-	updateCursor()
-	updateScroll()
+	-- The keyboard takes the buttons and crank while it is up
+	local typing = playdate.keyboard.isVisible()
+	if not typing then
+		handleNavInput()
+	end
+	updateLoading()
+	if not typing then
+		updateCursor()
+		updateScroll()
+	end
+	updateHover()
+	prefetch:update(cursor.speed > 0.1 or scroll.animator ~= nil)
+	images:update()
 
-	gfx.sprite.update()  -- Calls Link:update() automatically
+	gfx.sprite.update()
 	gfx.animation.blinker.updateAll()
+	playdate.timer.updateTimers()
+
+	orbit.recordFrame()
+	if STATS_OVERLAY then
+		drawStatsOverlay()
+	end
 end
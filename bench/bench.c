@@ -0,0 +1,763 @@
+// Render pipeline benchmark
+//
+// Builds src/main.c into a host program against the stand-in PlaydateAPI in
+// host_api.c, then times each page of a corpus through the same code the
+// device runs: parse (cmark or lexbor), layout (text flow and site rules),
+// raster (link index and every tile of the page), and the whole render as
+// cmark.render/html.render see it, with the heap high-water mark of that
+// render. Layout is timed twice: with the cached advance and kerning tables
+// the renderer uses, and with each word measured by getTextWidth as it once
+// was. Find is timed as the word index build plus queries it looks up, and
+// separately as queries too short for its key, which scan every word. Each
+// figure is the median over the runs.
+//
+// With --inflate it checks and times the body inflater instead: every page
+// is compressed with zlib as gzip, zlib-wrapped and raw deflate at several
+// levels (0 gives stored blocks), fed back in chunks of 1 byte up to the
+// whole body, and must decode to the page; truncated and corrupt bodies
+// must never decode as complete. Then setEncoding and feed are timed on the
+// gzipped page in network-sized chunks, as a download would arrive.
+//
+// Usage: orbit-bench [-n runs] [-f fontRoot] [-d dataDir] [--json] [--inflate] corpus...
+// A corpus argument is a markdown or HTML file, or a manifest (.txt) with
+// one "path [url]" per line; HTML pages need the URL their site renderer
+// is chosen by.
+
+#include <time.h>
+#include <zlib.h>
+
+#include "host_api.h"
+#include "../src/main.c"
+
+#define MAX_RUNS 101
+#define BENCH_PAGE_WIDTH LCD_COLUMNS
+#define BENCH_PAGE_PADDING 10
+#define BENCH_NETWORK_CHUNK 1400  // about one TCP segment of a download
+#define BENCH_LONG_BODY (256 * 1024)  // the corpus repeated, to wrap the 32 KB window
+
+typedef struct {
+    const char* path;
+    const char* url;    // NULL for markdown
+    size_t bytes;
+    int height;
+    int segments;
+    int links;
+    double parse;
+    double layout;
+    double layoutFontAPI;  // the same layout, measuring words with getTextWidth
+    double raster;
+    double find;  // word index build and indexed queries
+    double scan;  // queries that check every word
+    double total;
+    size_t peakHeap;
+} PageReport;
+
+static double nowMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double* values, int count) {
+    qsort(values, count, sizeof(double), compareDoubles);
+    return values[count / 2];
+}
+
+static char* readFile(const char* path, size_t* length) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(size + 1);
+    if (data && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (!data) return NULL;
+
+    data[size] = '\0';
+    *length = size;
+    return data;
+}
+
+static int isMarkdown(const PageReport* report) {
+    return report->url == NULL;
+}
+
+// Parse the page: markdown into *doc, HTML into the engine's document
+// Returns: 0 if parsing failed
+static int parsePage(const PageReport* report, const char* source, cmark_node** doc) {
+    if (isMarkdown(report)) {
+        cmark_parser* parser = cmark_parser_new_with_mem(CMARK_OPT_DEFAULT, &arenaCmarkMem);
+        if (!parser) return 0;
+        cmark_parser_feed(parser, source, report->bytes);
+        *doc = cmark_parser_finish(parser);
+        cmark_parser_free(parser);
+        return *doc != NULL;
+    }
+
+    lxb_html_document_t* document = acquireHTMLDocument();
+    return document &&
+        lxb_html_document_parse_chunk_begin(document) == LXB_STATUS_OK &&
+        lxb_html_document_parse_chunk(document, (const lxb_char_t*)source,
+                                      report->bytes) == LXB_STATUS_OK &&
+        lxb_html_document_parse_chunk_end(document) == LXB_STATUS_OK &&
+        document->body != NULL;
+}
+
+static void layoutParsed(const PageReport* report, cmark_node* doc, Page* page) {
+    RenderContext ctx = {
+        .contentWidth = page->width - 2 * page->padding,
+        .tracking = page->tracking,
+        .firstParagraph = 1,
+        .layout = &page->layout,
+    };
+
+    if (isMarkdown(report)) {
+        MarkdownLayout markdown = { .doc = doc };
+        layoutMarkdown(&ctx, &markdown, 0);
+    } else {
+        const SiteRenderer* renderer = findRenderer(report->url);
+        if (renderer->title) {
+            renderPlainText(&ctx, renderer->title);
+            renderNewline(&ctx);
+            renderNewline(&ctx);
+        }
+        lxb_dom_node_t* cursor = NULL;
+        matchRules(htmlEngine.document, renderer->rules, renderer->ruleCount, &ctx, &cursor, 0);
+    }
+
+    page->height = ctx.y + fontCache.fontHeight + 2 * page->padding;
+    if (page->height < SCREEN_HEIGHT) page->height = SCREEN_HEIGHT;
+}
+
+// The old measurement: the breaks nextBreak finds, but each word measured by
+// the font instead of the cached advance and kerning tables
+static size_t nextBreakByFontAPI(const char* text, size_t len, size_t pos, int* width) {
+    size_t start = pos;
+    uint32_t prev = 0;
+    BreakClass prevClass = BREAK_AL;
+
+    while (pos < len && !isSpaceChar(text[pos])) {
+        int next = (int)pos;
+        uint32_t c = decodeUTF8(text, (int)len, &next);
+        BreakClass cls = breakClass(c);
+        if (prev && breakBetween(prevClass, cls)) break;
+        if (!prev && cls == BREAK_HY) cls = BREAK_AL;
+
+        prev = c;
+        prevClass = cls;
+        pos = (size_t)next;
+    }
+
+    *width = pd->graphics->getTextWidth(fontCache.font, text + start, pos - start, kUTF8Encoding, 0);
+    return pos;
+}
+
+// Lay the parsed page out again with words measured by the font
+// Returns: the page height
+static int layoutByFontAPI(const PageReport* report, cmark_node* doc, int tracking) {
+    Page* page = newPage(BENCH_PAGE_WIDTH, BENCH_PAGE_PADDING);
+    page->tracking = tracking;
+    breakMeasurer = nextBreakByFontAPI;
+    layoutParsed(report, doc, page);
+    breakMeasurer = nextBreak;
+
+    int height = page->height;
+    releasePage(page);
+    return height;
+}
+
+static void freeParsed(const PageReport* report, cmark_node* doc) {
+    if (isMarkdown(report)) {
+        cmark_node_free(doc);
+        resetParserArena();
+    } else {
+        releaseHTMLDocument();
+    }
+}
+
+// Draw every band of the page, as scrolling to the bottom would
+static void rasterizePage(Page* page) {
+    buildLinkIndex(page);
+    showPage(page);
+    for (int index = 0; index * TILE_HEIGHT < page->height; index++) {
+        getTile(page, index);
+    }
+    showPage(NULL);
+}
+
+// Queries find looks up in the word index, and ones too short for its key
+// (the first word decides), which scan every word of the page
+static const char* const indexedQueries[] = { "the", "page", "links to" };
+static const char* const scanQueries[] = { "in", "e", "of the" };
+#define QUERY_COUNT(queries) ((int)(sizeof(queries) / sizeof((queries)[0])))
+
+// Returns: the matches found for all the queries on the shown page
+static int runQueries(const char* const* queries, int count) {
+    int matches = 0;
+    for (int i = 0; i < count; i++) {
+        if (hostCall("orbit.find", "s", queries[i]) >= 1) matches += hostResult(0).intValue;
+    }
+    return matches;
+}
+
+// The word index must find what a scan of every word finds
+static void checkWordIndex(const PageReport* report, Page* page, int indexedMatches) {
+    freeWordIndex(&page->wordIndex);
+    int scanned = runQueries(indexedQueries, QUERY_COUNT(indexedQueries));
+    if (scanned != indexedMatches) {
+        fprintf(stderr, "%s: the word index finds %d matches, a scan %d\n",
+                report->path, indexedMatches, scanned);
+    }
+}
+
+// The render Lua sees, end to end
+// Returns: the page height, or 0 if it failed
+static int renderWhole(const PageReport* report, const char* source, int tracking) {
+    int count = isMarkdown(report)
+        ? hostCall("cmark.render", "siii", source, BENCH_PAGE_WIDTH, BENCH_PAGE_PADDING, tracking)
+        : hostCall("html.render", "ssiii", source, report->url, BENCH_PAGE_WIDTH,
+                   BENCH_PAGE_PADDING, tracking);
+    if (count < 2 || hostResult(0).type != kTypeInt) return 0;
+
+    int height = hostResult(0).intValue;
+    void* links = hostResult(1).object;
+    hostCall(LINK_TABLE_CLASS ".__gc", "o", links);
+    showPage(NULL);
+    return height;
+}
+
+static int benchPage(PageReport* report, int runs, int tracking) {
+    size_t length;
+    char* source = readFile(report->path, &length);
+    if (!source) {
+        fprintf(stderr, "skipping %s: can't read it\n", report->path);
+        return 0;
+    }
+    report->bytes = length;
+
+    if (!isMarkdown(report) && !findRenderer(report->url)) {
+        fprintf(stderr, "skipping %s: no site renderer for %s\n", report->path, report->url);
+        free(source);
+        return 0;
+    }
+
+    double parse[MAX_RUNS], layout[MAX_RUNS], layoutFontAPI[MAX_RUNS];
+    double raster[MAX_RUNS], find[MAX_RUNS], scan[MAX_RUNS], total[MAX_RUNS];
+    report->peakHeap = 0;
+
+    // One extra run first, to compile selectors and warm caches
+    for (int run = -1; run < runs; run++) {
+        cmark_node* doc = NULL;
+        double start = nowMs();
+        if (!parsePage(report, source, &doc)) {
+            fprintf(stderr, "skipping %s: parse failed\n", report->path);
+            freeParsed(report, doc);
+            free(source);
+            return 0;
+        }
+        double parsed = nowMs();
+
+        Page* page = newPage(BENCH_PAGE_WIDTH, BENCH_PAGE_PADDING);
+        page->tracking = tracking;
+        layoutParsed(report, doc, page);
+        double laidOut = nowMs();
+
+        report->height = page->height;
+        report->segments = page->layout.segmentCount;
+        report->links = page->layout.linkCount;
+
+        double fontStart = nowMs();
+        int fontHeight = layoutByFontAPI(report, doc, tracking);
+        double fontEnd = nowMs();
+        if (run < 0 && fontHeight != page->height) {
+            fprintf(stderr, "%s: %d px tall measured by getTextWidth, %d by the glyph table\n",
+                    report->path, fontHeight, page->height);
+        }
+        freeParsed(report, doc);
+
+        double rasterStart = nowMs();
+        rasterizePage(page);
+        double rasterized = nowMs();
+
+        showPage(page);
+        double findStart = nowMs();
+        buildWordIndex(page);
+        int indexedMatches = runQueries(indexedQueries, QUERY_COUNT(indexedQueries));
+        double found = nowMs();
+        runQueries(scanQueries, QUERY_COUNT(scanQueries));
+        double scanned = nowMs();
+        if (run < 0) checkWordIndex(report, page, indexedMatches);
+        showPage(NULL);
+        releasePage(page);
+
+        size_t before = hostHeapInUse();
+        hostResetHeapPeak();
+        double wholeStart = nowMs();
+        int height = renderWhole(report, source, tracking);
+        double wholeEnd = nowMs();
+        if (!height) {
+            fprintf(stderr, "skipping %s: render failed\n", report->path);
+            free(source);
+            return 0;
+        }
+
+        if (run < 0) continue;
+        parse[run] = parsed - start;
+        layout[run] = laidOut - parsed;
+        layoutFontAPI[run] = fontEnd - fontStart;
+        raster[run] = rasterized - rasterStart;
+        find[run] = found - findStart;
+        scan[run] = scanned - found;
+        total[run] = wholeEnd - wholeStart;
+        if (hostHeapPeak() - before > report->peakHeap) {
+            report->peakHeap = hostHeapPeak() - before;
+        }
+    }
+
+    report->parse = median(parse, runs);
+    report->layout = median(layout, runs);
+    report->layoutFontAPI = median(layoutFontAPI, runs);
+    report->raster = median(raster, runs);
+    report->find = median(find, runs);
+    report->scan = median(scan, runs);
+    report->total = median(total, runs);
+    free(source);
+    return 1;
+}
+
+// Output of the inflater under test
+static char* inflated;
+static size_t inflatedLength;
+static size_t inflatedCapacity;
+
+static void collectInflated(const char* data, size_t len) {
+    if (inflatedLength + len > inflatedCapacity) {
+        inflatedCapacity = (inflatedLength + len) * 2;
+        inflated = realloc(inflated, inflatedCapacity);
+    }
+    memcpy(inflated + inflatedLength, data, len);
+    inflatedLength += len;
+}
+
+// Compress with zlib; windowBits picks the wrapper: 31 gzip, 15 zlib, -15 raw
+// Returns: a malloc'd body, or NULL
+static unsigned char* compressBody(const char* source, size_t length, int level,
+                                   int windowBits, size_t* outLength) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t capacity = deflateBound(&z, length);
+    unsigned char* body = malloc(capacity);
+    z.next_in = (Bytef*)source;
+    z.avail_in = (uInt)length;
+    z.next_out = body;
+    z.avail_out = (uInt)capacity;
+    int status = deflate(&z, Z_FINISH);
+    *outLength = z.total_out;
+    deflateEnd(&z);
+
+    if (status != Z_STREAM_END) {
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+// Decode a body through a fresh inflater, chunkSize bytes at a time
+// Returns: 1 if it ended cleanly, 0 if it stopped early, -1 if it failed
+static int inflateBody(const char* encoding, const unsigned char* body, size_t length,
+                       size_t chunkSize) {
+    Inflater inf;
+    memset(&inf, 0, sizeof(inf));
+    inflatedLength = 0;
+    if (!beginInflate(&inf, encoding, collectInflated)) return -1;
+
+    int ok = 1;
+    for (size_t pos = 0; pos < length && ok; pos += chunkSize) {
+        size_t len = length - pos < chunkSize ? length - pos : chunkSize;
+        ok = inflateChunk(&inf, (const char*)body + pos, len);
+    }
+    int result = !ok ? -1 : inflateComplete(&inf) ? 1 : 0;
+    endInflate(&inf);
+    return result;
+}
+
+static int inflatedIs(const char* expected, size_t length) {
+    return inflatedLength == length && memcmp(inflated, expected, length) == 0;
+}
+
+static int inflatedIsPrefixOf(const char* source, size_t length) {
+    return inflatedLength <= length && memcmp(inflated, source, inflatedLength) == 0;
+}
+
+typedef struct {
+    const char* name;
+    const char* encoding;  // Content-Encoding it is sent with
+    int windowBits;
+    int checksumFromEnd;   // where the trailer's checksum starts, 0 if there is none
+} InflateFormat;
+
+static const InflateFormat inflateFormats[] = {
+    { "gzip", "gzip", 31, 8 },
+    { "zlib", "deflate", 15, 4 },
+    { "raw", "deflate", -15, 0 },
+};
+
+static int inflateFailures;
+
+static void inflateFailure(const char* path, const InflateFormat* format, int level,
+                           const char* what) {
+    fprintf(stderr, "inflate: %s, %s level %d: %s\n", path, format->name, level, what);
+    inflateFailures++;
+}
+
+// Round-trip one page through every format, level and chunk size, then
+// check that cut-short and damaged bodies are caught
+// Returns: the number of checks run
+static int checkInflatePage(const char* path, const char* source, size_t length) {
+    static const int levels[] = { 0, 1, 6, 9 };
+    static const size_t chunkSizes[] = { 1, 2, 3, 7, 64, 1000, BENCH_NETWORK_CHUNK, 4096 };
+    int checks = 0;
+
+    for (size_t f = 0; f < sizeof(inflateFormats) / sizeof(inflateFormats[0]); f++) {
+        const InflateFormat* format = &inflateFormats[f];
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            size_t bodyLength;
+            unsigned char* body = compressBody(source, length, levels[l], format->windowBits,
+                                               &bodyLength);
+            if (!body) {
+                inflateFailure(path, format, levels[l], "zlib can't compress it");
+                continue;
+            }
+
+            for (size_t c = 0; c <= sizeof(chunkSizes) / sizeof(chunkSizes[0]); c++) {
+                size_t chunk = c < sizeof(chunkSizes) / sizeof(chunkSizes[0]) ? chunkSizes[c] : bodyLength;
+                checks++;
+                if (inflateBody(format->encoding, body, bodyLength, chunk) != 1 ||
+                    !inflatedIs(source, length)) {
+                    char what[64];
+                    snprintf(what, sizeof(what), "doesn't round-trip in %zu-byte chunks", chunk);
+                    inflateFailure(path, format, levels[l], what);
+                }
+            }
+
+            // Cut short anywhere, it decodes a prefix and never completes
+            size_t cuts[] = { 1, bodyLength / 2, bodyLength - 1 };
+            for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+                checks++;
+                if (inflateBody(format->encoding, body, cuts[i], 64) == 1 ||
+                    !inflatedIsPrefixOf(source, length)) {
+                    inflateFailure(path, format, levels[l], "a truncated body decodes as complete");
+                }
+            }
+
+            // A damaged checksum fails
+            if (format->checksumFromEnd) {
+                checks++;
+                body[bodyLength - format->checksumFromEnd] ^= 0x01;
+                if (inflateBody(format->encoding, body, bodyLength, bodyLength) != -1) {
+                    inflateFailure(path, format, levels[l], "a bad checksum isn't caught");
+                }
+                body[bodyLength - format->checksumFromEnd] ^= 0x01;
+            }
+
+            // So does damage to the data, which raw deflate can only catch
+            // when it breaks the code
+            checks++;
+            body[bodyLength / 2] ^= 0x10;
+            if (inflateBody(format->encoding, body, bodyLength, BENCH_NETWORK_CHUNK) == 1 &&
+                (format->checksumFromEnd || inflatedIs(source, length))) {
+                inflateFailure(path, format, levels[l], "a damaged body decodes as complete");
+            }
+            free(body);
+        }
+    }
+
+    // Back-to-back gzip members decode as one body
+    size_t memberLength;
+    unsigned char* member = compressBody(source, length, 6, 31, &memberLength);
+    if (member) {
+        unsigned char* body = malloc(memberLength * 2);
+        memcpy(body, member, memberLength);
+        memcpy(body + memberLength, member, memberLength);
+        checks++;
+        if (inflateBody("gzip", body, memberLength * 2, BENCH_NETWORK_CHUNK) != 1 ||
+            inflatedLength != length * 2 || memcmp(inflated, source, length) != 0 ||
+            memcmp(inflated + length, source, length) != 0) {
+            inflateFailure(path, &inflateFormats[0], 6, "two members don't decode as one body");
+        }
+
+        // Not a gzip body at all
+        checks++;
+        member[0] ^= 0xFF;
+        if (inflateBody("gzip", member, memberLength, memberLength) != -1) {
+            inflateFailure(path, &inflateFormats[0], 6, "a bad gzip magic isn't caught");
+        }
+        free(body);
+        free(member);
+    }
+    return checks;
+}
+
+// Time the gzipped page through setEncoding and feed, as a download is
+// decoded before it is parsed
+// Returns: median milliseconds over the runs, or a negative number if it failed
+static double timeInflatePage(const char* source, size_t length, int runs, int tracking,
+                              size_t* bodyLength) {
+    unsigned char* body = compressBody(source, length, 6, 31, bodyLength);
+    if (!body) return -1;
+
+    double times[MAX_RUNS];
+    for (int run = -1; run < runs; run++) {
+        double start = nowMs();
+        hostCall("cmark.beginStream", "iiin", BENCH_PAGE_WIDTH, BENCH_PAGE_PADDING, tracking);
+        hostCall("cmark.setEncoding", "s", "gzip");
+        for (size_t pos = 0; pos < *bodyLength; pos += BENCH_NETWORK_CHUNK) {
+            size_t len = *bodyLength - pos < BENCH_NETWORK_CHUNK ? *bodyLength - pos : BENCH_NETWORK_CHUNK;
+            hostCall("cmark.feed", "b", (const char*)body + pos, len);
+        }
+        hostCall("cmark.endInput", "");
+        int complete = hostResult(0).intValue;
+        double end = nowMs();
+        discardStream();
+
+        if (!complete) {
+            free(body);
+            return -1;
+        }
+        if (run >= 0) times[run] = end - start;
+    }
+
+    free(body);
+    return median(times, runs);
+}
+
+static void reportInflate(const char* name, const char* source, size_t length, int runs,
+                          int tracking) {
+    size_t bodyLength;
+    double ms = timeInflatePage(source, length, runs, tracking, &bodyLength);
+    if (ms < 0) {
+        fprintf(stderr, "inflate: %s doesn't decode through feed\n", name);
+        inflateFailures++;
+        return;
+    }
+    printf("%-32s %8zu %8zu %9.3f %8.1f\n", name, length, bodyLength, ms,
+           ms > 0 ? length / 1000.0 / ms : 0);
+}
+
+// Check and time the inflater on every page, then on the pages run together
+// into a body long enough for matches across the whole window
+// Returns: 0 if every check passed
+static int benchInflate(const PageReport* reports, int count, int runs, int tracking) {
+    char* all = NULL;
+    size_t allLength = 0;
+    int checks = 0;
+
+    printf("%-32s %8s %8s %9s %8s\n", "page", "bytes", "gzipped", "feed ms", "MB/s");
+    for (int i = 0; i < count; i++) {
+        size_t length;
+        char* source = readFile(reports[i].path, &length);
+        if (!source) {
+            fprintf(stderr, "skipping %s: can't read it\n", reports[i].path);
+            inflateFailures++;
+            continue;
+        }
+
+        checks += checkInflatePage(reports[i].path, source, length);
+        reportInflate(reports[i].path, source, length, runs, tracking);
+        all = realloc(all, allLength + length);
+        memcpy(all + allLength, source, length);
+        allLength += length;
+        free(source);
+    }
+
+    if (allLength > 0) {
+        size_t pageLength = allLength;
+        while (allLength < BENCH_LONG_BODY) {
+            size_t copy = allLength < BENCH_LONG_BODY - allLength ? allLength : BENCH_LONG_BODY - allLength;
+            all = realloc(all, allLength + copy);
+            memcpy(all + allLength, all, copy);
+            allLength += copy;
+        }
+        if (pageLength < allLength) {
+            checks += checkInflatePage("(all pages, repeated)", all, allLength);
+        }
+        reportInflate("(all pages, repeated)", all, allLength, runs, tracking);
+        free(all);
+    }
+
+    printf("%d inflate checks, %d failed\n", checks, inflateFailures);
+    free(inflated);
+    return inflateFailures > 0;
+}
+
+static void writeStdout(void* userdata, const char* str, int len) {
+    (void)userdata;
+    fwrite(str, 1, len, stdout);
+}
+
+static void addMember(json_encoder* encoder, const char* name) {
+    encoder->addTableMember(encoder, name, (int)strlen(name));
+}
+
+static void printJSON(PlaydateAPI* api, const PageReport* reports, int count) {
+    json_encoder encoder;
+    api->json->initEncoder(&encoder, writeStdout, NULL, 1);
+
+    encoder.startArray(&encoder);
+    for (int i = 0; i < count; i++) {
+        const PageReport* r = &reports[i];
+        encoder.addArrayMember(&encoder);
+        encoder.startTable(&encoder);
+        addMember(&encoder, "page");
+        encoder.writeString(&encoder, r->path, (int)strlen(r->path));
+        addMember(&encoder, "bytes");
+        encoder.writeInt(&encoder, (int)r->bytes);
+        addMember(&encoder, "height");
+        encoder.writeInt(&encoder, r->height);
+        addMember(&encoder, "segments");
+        encoder.writeInt(&encoder, r->segments);
+        addMember(&encoder, "links");
+        encoder.writeInt(&encoder, r->links);
+        addMember(&encoder, "parseMs");
+        encoder.writeDouble(&encoder, r->parse);
+        addMember(&encoder, "layoutMs");
+        encoder.writeDouble(&encoder, r->layout);
+        addMember(&encoder, "layoutFontAPIMs");
+        encoder.writeDouble(&encoder, r->layoutFontAPI);
+        addMember(&encoder, "rasterMs");
+        encoder.writeDouble(&encoder, r->raster);
+        addMember(&encoder, "findMs");
+        encoder.writeDouble(&encoder, r->find);
+        addMember(&encoder, "scanMs");
+        encoder.writeDouble(&encoder, r->scan);
+        addMember(&encoder, "totalMs");
+        encoder.writeDouble(&encoder, r->total);
+        addMember(&encoder, "peakHeap");
+        encoder.writeInt(&encoder, (int)r->peakHeap);
+        encoder.endTable(&encoder);
+    }
+    encoder.endArray(&encoder);
+    fputc('\n', stdout);
+}
+
+static void printTable(const PageReport* reports, int count) {
+    printf("%-32s %8s %6s %9s %9s %11s %9s %9s %9s %9s %10s\n",
+           "page", "bytes", "links", "parse ms", "layout ms", "font API ms", "raster ms",
+           "find ms", "scan ms", "total ms", "peak heap");
+    for (int i = 0; i < count; i++) {
+        const PageReport* r = &reports[i];
+        printf("%-32s %8zu %6d %9.3f %9.3f %11.3f %9.3f %9.3f %9.3f %9.3f %10zu\n",
+               r->path, r->bytes, r->links, r->parse, r->layout, r->layoutFontAPI, r->raster,
+               r->find, r->scan, r->total, r->peakHeap);
+    }
+}
+
+// Add the pages a manifest lists
+static int readManifest(const char* path, PageReport* reports, int count, int capacity) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "can't open %s\n", path);
+        return count;
+    }
+
+    char line[1024];
+    while (count < capacity && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        char* url = strchr(line, ' ');
+        if (url) {
+            *url++ = '\0';
+            while (*url == ' ') url++;
+        }
+        reports[count].path = strdup(line);
+        reports[count].url = url && *url ? strdup(url) : NULL;
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+static int hasSuffix(const char* s, const char* suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+int main(int argc, char** argv) {
+    int runs = 9;
+    int json = 0;
+    int inflate = 0;
+    const char* fontRoot = "Source";
+    const char* dataDir = "/tmp/orbit-bench";
+    PageReport reports[256];
+    int count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            fontRoot = argv[++i];
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            dataDir = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--inflate") == 0) {
+            inflate = 1;
+        } else if (hasSuffix(argv[i], ".txt")) {
+            count = readManifest(argv[i], reports, count, 256);
+        } else if (count < 256) {
+            reports[count].path = argv[i];
+            reports[count].url = NULL;
+            count++;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [-n runs] [-f fontRoot] [-d dataDir] [--json] [--inflate] corpus...\n",
+                argv[0]);
+        return 2;
+    }
+
+    PlaydateAPI* api = hostInit(fontRoot, dataDir);
+    hostSetQuiet(1);
+    eventHandler(api, kEventInitLua, 0);
+
+    if (hostCall("cmark.initRenderer", "s", "fonts/cuniform") < 1 || !hostResult(0).intValue) {
+        fprintf(stderr, "can't load fonts/cuniform from %s\n", fontRoot);
+        return 1;
+    }
+    int tracking = 1;  // cuniform.fnt's tracking, as main.lua passes it
+
+    if (inflate) {
+        return benchInflate(reports, count, runs, tracking);
+    }
+
+    int benched = 0;
+    for (int i = 0; i < count; i++) {
+        if (benchPage(&reports[i], runs, tracking)) {
+            reports[benched++] = reports[i];
+        }
+    }
+
+    if (json) {
+        printJSON(api, reports, benched);
+    } else {
+        printTable(reports, benched);
+    }
+    return benched == count ? 0 : 1;
+}
@@ -0,0 +1,955 @@
+// Host stand-in for the Playdate runtime
+//
+// Implements the parts of PlaydateAPI that src/main.c calls: a counting
+// allocator, stdio-backed files under a data directory, fonts read from the
+// .fnt metrics files in Source/fonts, 1-bit bitmaps in memory, a Lua
+// argument stack the driver calls registered functions through, and a JSON
+// encoder for reports. Glyph images are solid blocks of their advance, so
+// raster timings cover ORBIT's blitter over a comparable amount of ink.
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host_api.h"
+
+// ============================================================================
+// System
+// ============================================================================
+
+static struct {
+    size_t inUse;
+    size_t peak;
+} heap;
+
+static int quiet;
+
+// Each block is prefixed with its size so frees can be counted
+typedef union {
+    size_t size;
+    max_align_t align;
+} BlockHeader;
+
+static void* hostRealloc(void* ptr, size_t size) {
+    BlockHeader* block = ptr ? (BlockHeader*)ptr - 1 : NULL;
+    size_t oldSize = block ? block->size : 0;
+
+    if (size == 0) {
+        heap.inUse -= oldSize;
+        free(block);
+        return NULL;
+    }
+
+    BlockHeader* grown = realloc(block, sizeof(BlockHeader) + size);
+    if (!grown) return NULL;
+
+    grown->size = size;
+    heap.inUse += size - oldSize;
+    if (heap.inUse > heap.peak) heap.peak = heap.inUse;
+    return grown + 1;
+}
+
+static void hostLog(const char* fmt, ...) {
+    if (quiet) return;
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+static void hostError(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fputs("error: ", stderr);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+static unsigned int hostMilliseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned int)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static float hostElapsedTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (float)(now.tv_sec % 100000) + now.tv_nsec / 1e9f;
+}
+
+static unsigned int hostSecondsSinceEpoch(unsigned int* milliseconds) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (milliseconds) *milliseconds = (unsigned int)(now.tv_nsec / 1000000);
+    return (unsigned int)now.tv_sec;
+}
+
+size_t hostHeapInUse(void) {
+    return heap.inUse;
+}
+
+size_t hostHeapPeak(void) {
+    return heap.peak;
+}
+
+void hostResetHeapPeak(void) {
+    heap.peak = heap.inUse;
+}
+
+void hostSetQuiet(int value) {
+    quiet = value;
+}
+
+// ============================================================================
+// Files
+// ============================================================================
+
+static char dataRoot[512];
+static char fontRoot[512];
+
+static const char* dataPath(const char* path) {
+    static char full[1024];
+    snprintf(full, sizeof(full), "%s/%s", dataRoot, path);
+    return full;
+}
+
+static const char* hostFileError(void) {
+    return strerror(errno);
+}
+
+static int hostStat(const char* path, FileStat* result) {
+    struct stat st;
+    if (stat(dataPath(path), &st) != 0) return -1;
+
+    memset(result, 0, sizeof(*result));
+    result->isdir = S_ISDIR(st.st_mode);
+    result->size = (unsigned int)st.st_size;
+    return 0;
+}
+
+static int hostMkdir(const char* path) {
+    return mkdir(dataPath(path), 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+static int hostUnlink(const char* path, int recursive) {
+    (void)recursive;
+    const char* full = dataPath(path);
+    return unlink(full) == 0 || rmdir(full) == 0 ? 0 : -1;
+}
+
+static int hostRename(const char* from, const char* to) {
+    char source[1024];
+    snprintf(source, sizeof(source), "%s", dataPath(from));
+    return rename(source, dataPath(to)) == 0 ? 0 : -1;
+}
+
+static SDFile* hostOpen(const char* path, FileOptions mode) {
+    const char* fmode = (mode & kFileAppend) ? "ab" : (mode & kFileWrite) ? "wb" : "rb";
+    return (SDFile*)fopen(dataPath(path), fmode);
+}
+
+static int hostClose(SDFile* file) {
+    return fclose((FILE*)file) == 0 ? 0 : -1;
+}
+
+static int hostRead(SDFile* file, void* buf, unsigned int len) {
+    size_t n = fread(buf, 1, len, (FILE*)file);
+    return ferror((FILE*)file) ? -1 : (int)n;
+}
+
+static int hostWrite(SDFile* file, const void* buf, unsigned int len) {
+    size_t n = fwrite(buf, 1, len, (FILE*)file);
+    return n == len ? (int)n : -1;
+}
+
+static int hostFlush(SDFile* file) {
+    return fflush((FILE*)file) == 0 ? 0 : -1;
+}
+
+static int hostTell(SDFile* file) {
+    return (int)ftell((FILE*)file);
+}
+
+static int hostSeek(SDFile* file, int pos, int whence) {
+    return fseek((FILE*)file, pos, whence) == 0 ? 0 : -1;
+}
+
+// ============================================================================
+// Fonts
+// ============================================================================
+
+#define FONT_PAGE_COUNT 0x1100
+
+struct LCDFontGlyph {
+    LCDFont* font;
+    uint32_t code;
+    int advance;
+    LCDBitmap* bitmap;  // made on first request
+};
+
+struct LCDFontPage {
+    LCDFontGlyph* glyphs[256];
+};
+
+typedef struct {
+    uint32_t first;
+    uint32_t second;
+    int adjust;
+} KerningPair;
+
+struct LCDFont {
+    int height;
+    int tracking;
+    LCDFontPage* pages[FONT_PAGE_COUNT];
+    KerningPair* kerning;
+    int kerningCount;
+};
+
+static LCDFont* currentFont;
+
+static uint32_t hostDecodeUTF8(const char** text, const char* end) {
+    const unsigned char* s = (const unsigned char*)*text;
+    uint32_t c = *s++;
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+    if (extra) c &= 0x3F >> extra;
+    while (extra-- > 0 && (const char*)s < end) c = (c << 6) | (*s++ & 0x3F);
+    *text = (const char*)s;
+    return c;
+}
+
+// The glyph cell height is only in the image table's file name, e.g.
+// cuniform-table-10-14.png
+static int findFontHeight(const char* dir, const char* name) {
+    DIR* d = opendir(dir);
+    if (!d) return 0;
+
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "%s-table-", name);
+    int height = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        int w, h;
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0 &&
+            sscanf(entry->d_name + strlen(prefix), "%d-%d.png", &w, &h) == 2) {
+            height = h;
+            break;
+        }
+    }
+    closedir(d);
+    return height;
+}
+
+static void addGlyph(LCDFont* font, uint32_t code, int advance) {
+    if (code >= FONT_PAGE_COUNT * 256) return;
+
+    LCDFontPage** page = &font->pages[code >> 8];
+    if (!*page) *page = calloc(1, sizeof(LCDFontPage));
+    LCDFontGlyph** glyph = &(*page)->glyphs[code & 0xFF];
+    if (!*glyph) *glyph = calloc(1, sizeof(LCDFontGlyph));
+    (*glyph)->font = font;
+    (*glyph)->code = code;
+    (*glyph)->advance = advance;
+}
+
+// Read a .fnt metrics file: key=value settings, then one line per glyph
+// ("a<TAB>6") or kerning pair ("Te<TAB>-1")
+static LCDFont* hostLoadFont(const char* path, const char** outErr) {
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/%s.fnt", fontRoot, path);
+    FILE* f = fopen(file, "r");
+    if (!f) {
+        if (outErr) *outErr = "font file not found";
+        return NULL;
+    }
+
+    LCDFont* font = calloc(1, sizeof(LCDFont));
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "tracking=", 9) == 0) {
+            font->tracking = atoi(line + 9);
+            continue;
+        }
+
+        char* tab = strchr(line, '\t');
+        if (!tab || line[0] == '-') continue;
+        *tab = '\0';
+        int value = atoi(tab + 1);
+
+        if (strcmp(line, "space") == 0) {
+            addGlyph(font, ' ', value);
+            continue;
+        }
+
+        const char* s = line;
+        uint32_t first = hostDecodeUTF8(&s, tab);
+        if (s == tab) {
+            addGlyph(font, first, value);
+        } else {
+            uint32_t second = hostDecodeUTF8(&s, tab);
+            font->kerning = realloc(font->kerning, (font->kerningCount + 1) * sizeof(KerningPair));
+            font->kerning[font->kerningCount++] = (KerningPair){ first, second, value };
+        }
+    }
+    fclose(f);
+
+    // Fonts live in a directory; the table image sits next to the .fnt
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", file);
+    char* slash = strrchr(dir, '/');
+    const char* name = slash ? slash + 1 : dir;
+    char base[1024];
+    snprintf(base, sizeof(base), "%s", name);
+    base[strlen(base) - 4] = '\0';  // drop .fnt
+    if (slash) *slash = '\0';
+    font->height = findFontHeight(slash ? dir : ".", base);
+    if (!font->height) font->height = 14;
+
+    if (outErr) *outErr = NULL;
+    return font;
+}
+
+static uint8_t hostFontHeight(LCDFont* font) {
+    return (uint8_t)font->height;
+}
+
+static LCDFontPage* hostFontPage(LCDFont* font, uint32_t c) {
+    return c >> 8 < FONT_PAGE_COUNT ? font->pages[c >> 8] : NULL;
+}
+
+static LCDBitmap* glyphBitmap(LCDFontGlyph* glyph);
+
+static LCDFontGlyph* hostPageGlyph(LCDFontPage* page, uint32_t c, LCDBitmap** bitmap, int* advance) {
+    LCDFontGlyph* glyph = page->glyphs[c & 0xFF];
+    if (bitmap) *bitmap = glyph ? glyphBitmap(glyph) : NULL;
+    if (glyph && advance) *advance = glyph->advance;
+    return glyph;
+}
+
+static int hostGlyphKerning(LCDFontGlyph* glyph, uint32_t glyphcode, uint32_t nextcode) {
+    LCDFont* font = glyph->font;
+    for (int i = 0; i < font->kerningCount; i++) {
+        if (font->kerning[i].first == glyphcode && font->kerning[i].second == nextcode) {
+            return font->kerning[i].adjust;
+        }
+    }
+    return 0;
+}
+
+// ============================================================================
+// Graphics
+// ============================================================================
+
+// 1-bit, rows padded to 32 bits, set bits are white like on the device
+struct LCDBitmap {
+    int width;
+    int height;
+    int rowbytes;
+    uint8_t* data;
+};
+
+static LCDBitmap frame = { LCD_COLUMNS, LCD_ROWS, 52, NULL };
+static LCDBitmap* contextStack[16];
+static int contextDepth;
+
+static LCDBitmap* target(void) {
+    return contextDepth > 0 ? contextStack[contextDepth - 1] : &frame;
+}
+
+static LCDBitmap* hostNewBitmap(int width, int height, LCDColor bgcolor) {
+    LCDBitmap* bitmap = hostRealloc(NULL, sizeof(LCDBitmap));
+    if (!bitmap) return NULL;
+    bitmap->width = width;
+    bitmap->height = height;
+    bitmap->rowbytes = ((width + 31) / 32) * 4;
+    bitmap->data = hostRealloc(NULL, (size_t)bitmap->rowbytes * height);
+    if (!bitmap->data) {
+        hostRealloc(bitmap, 0);
+        return NULL;
+    }
+    memset(bitmap->data, bgcolor == kColorBlack ? 0x00 : 0xFF, (size_t)bitmap->rowbytes * height);
+    return bitmap;
+}
+
+// The block hostDrawText draws for the glyph; kept outside the counted heap
+// like the SDK's own font data
+static LCDBitmap* glyphBitmap(LCDFontGlyph* glyph) {
+    if (glyph->bitmap) return glyph->bitmap;
+
+    LCDBitmap* bitmap = malloc(sizeof(LCDBitmap));
+    bitmap->width = glyph->advance > 0 ? glyph->advance : 1;
+    bitmap->height = glyph->font->height;
+    bitmap->rowbytes = ((bitmap->width + 31) / 32) * 4;
+    bitmap->data = malloc((size_t)bitmap->rowbytes * bitmap->height);
+    memset(bitmap->data, 0xFF, (size_t)bitmap->rowbytes * bitmap->height);
+
+    if (glyph->code != ' ') {
+        for (int row = 2; row < bitmap->height - 2; row++) {
+            uint8_t* line = bitmap->data + row * bitmap->rowbytes;
+            for (int col = 0; col < glyph->advance - 1; col++) {
+                line[col >> 3] &= ~(0x80 >> (col & 7));
+            }
+        }
+    }
+    glyph->bitmap = bitmap;
+    return bitmap;
+}
+
+static void hostFreeBitmap(LCDBitmap* bitmap) {
+    if (!bitmap) return;
+    hostRealloc(bitmap->data, 0);
+    hostRealloc(bitmap, 0);
+}
+
+static void hostClearBitmap(LCDBitmap* bitmap, LCDColor bgcolor) {
+    memset(bitmap->data, bgcolor == kColorBlack ? 0x00 : 0xFF, (size_t)bitmap->rowbytes * bitmap->height);
+}
+
+static void hostBitmapData(LCDBitmap* bitmap, int* width, int* height, int* rowbytes,
+                           uint8_t** mask, uint8_t** data) {
+    if (width) *width = bitmap->width;
+    if (height) *height = bitmap->height;
+    if (rowbytes) *rowbytes = bitmap->rowbytes;
+    if (mask) *mask = NULL;
+    if (data) *data = bitmap->data;
+}
+
+static uint8_t* hostGetFrame(void) {
+    return frame.data;
+}
+
+static void hostPushContext(LCDBitmap* bitmap) {
+    if (contextDepth < 16) contextStack[contextDepth++] = bitmap ? bitmap : &frame;
+}
+
+static void hostPopContext(void) {
+    if (contextDepth > 0) contextDepth--;
+}
+
+static void hostSetFont(LCDFont* font) {
+    currentFont = font;
+}
+
+static void hostFillRect(int x, int y, int width, int height, LCDColor color) {
+    LCDBitmap* bitmap = target();
+    int x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+    int x1 = x + width > bitmap->width ? bitmap->width : x + width;
+    int y1 = y + height > bitmap->height ? bitmap->height : y + height;
+
+    for (int row = y0; row < y1; row++) {
+        uint8_t* line = bitmap->data + row * bitmap->rowbytes;
+        for (int col = x0; col < x1; col++) {
+            uint8_t bit = 0x80 >> (col & 7);
+            if (color == kColorBlack) line[col >> 3] &= ~bit;
+            else if (color == kColorWhite) line[col >> 3] |= bit;
+            else if (color == kColorXOR) line[col >> 3] ^= bit;
+        }
+    }
+}
+
+static int hostDrawText(const void* text, size_t len, PDStringEncoding encoding, int x, int y) {
+    (void)encoding;
+    if (!currentFont) return 0;
+
+    const char* s = text;
+    const char* end = s + len;
+    int pen = x;
+    while (s < end) {
+        uint32_t c = hostDecodeUTF8(&s, end);
+        LCDFontPage* page = hostFontPage(currentFont, c);
+        LCDFontGlyph* glyph = page ? page->glyphs[c & 0xFF] : NULL;
+        int advance = glyph ? glyph->advance : currentFont->height / 2;
+
+        if (c != ' ') {
+            hostFillRect(pen, y + 2, advance - 1, currentFont->height - 4, kColorBlack);
+        }
+        pen += advance + currentFont->tracking;
+    }
+    return pen - x;
+}
+
+static LCDFontGlyph* fontGlyph(LCDFont* font, uint32_t c) {
+    LCDFontPage* page = hostFontPage(font, c);
+    return page ? page->glyphs[c & 0xFF] : NULL;
+}
+
+// Advances plus kerning, with tracking between characters, as the SDK
+// measures; missing glyphs take the width of U+FFFD, which it draws instead.
+// The bench lays out with it to compare against the glyph table.
+static int hostGetTextWidth(LCDFont* font, const void* text, size_t len,
+                            PDStringEncoding encoding, int tracking) {
+    (void)encoding;
+    if (!font) return 0;
+
+    LCDFontGlyph* replacement = fontGlyph(font, 0xFFFD);
+    const char* s = text;
+    const char* end = s + len;
+    int width = 0;
+    LCDFontGlyph* prev = NULL;
+    uint32_t prevCode = 0;
+    while (s < end) {
+        if (s != text) width += tracking;
+        uint32_t c = hostDecodeUTF8(&s, end);
+        LCDFontGlyph* glyph = fontGlyph(font, c);
+
+        if (prev && glyph) width += hostGlyphKerning(prev, prevCode, c);
+        if (glyph) width += glyph->advance;
+        else if (replacement) width += replacement->advance;
+        prev = glyph;
+        prevCode = c;
+    }
+    return width;
+}
+
+static void hostDrawBitmap(LCDBitmap* bitmap, int x, int y, LCDBitmapFlip flip) {
+    (void)flip;
+    LCDBitmap* dest = target();
+
+    for (int row = 0; row < bitmap->height; row++) {
+        int dy = y + row;
+        if (dy < 0 || dy >= dest->height) continue;
+        const uint8_t* src = bitmap->data + row * bitmap->rowbytes;
+        uint8_t* line = dest->data + dy * dest->rowbytes;
+        for (int col = 0; col < bitmap->width; col++) {
+            int dx = x + col;
+            if (dx < 0 || dx >= dest->width) continue;
+            uint8_t bit = 0x80 >> (dx & 7);
+            if (src[col >> 3] & (0x80 >> (col & 7))) line[dx >> 3] |= bit;
+            else line[dx >> 3] &= ~bit;
+        }
+    }
+}
+
+static void hostMarkUpdatedRows(int start, int end) {
+    (void)start;
+    (void)end;
+}
+
+// ============================================================================
+// Lua
+// ============================================================================
+
+#define HOST_MAX_FUNCTIONS 128
+#define HOST_MAX_VALUES 16
+
+static struct {
+    char* name;
+    lua_CFunction func;
+} functions[HOST_MAX_FUNCTIONS];
+static int functionCount;
+
+static HostValue args[HOST_MAX_VALUES];
+static int argCount;
+static HostValue results[HOST_MAX_VALUES];
+static int resultCount;
+static char* resultStrings[HOST_MAX_VALUES];
+
+static int addNamedFunction(const char* name, lua_CFunction func) {
+    if (functionCount == HOST_MAX_FUNCTIONS) return 0;
+    functions[functionCount].name = strdup(name);
+    functions[functionCount].func = func;
+    functionCount++;
+    return 1;
+}
+
+static int hostAddFunction(lua_CFunction f, const char* name, const char** outErr) {
+    int ok = addNamedFunction(name, f);
+    if (outErr) *outErr = ok ? NULL : "too many functions";
+    return ok;
+}
+
+// Methods are registered as Class.method, e.g. LinkTable.count
+static int hostRegisterClass(const char* name, const lua_reg* reg, const lua_val* vals,
+                             int isstatic, const char** outErr) {
+    (void)vals;
+    (void)isstatic;
+    char full[256];
+    for (; reg && reg->name; reg++) {
+        snprintf(full, sizeof(full), "%s.%s", name, reg->name);
+        if (!addNamedFunction(full, reg->func)) {
+            if (outErr) *outErr = "too many functions";
+            return 0;
+        }
+    }
+    if (outErr) *outErr = NULL;
+    return 1;
+}
+
+static HostValue* arg(int pos) {
+    static HostValue nil = { kTypeNil, 0, 0, NULL, 0, NULL };
+    return pos >= 1 && pos <= argCount ? &args[pos - 1] : &nil;
+}
+
+static int hostArgCount(void) {
+    return argCount;
+}
+
+static enum LuaType hostArgType(int pos, const char** outClass) {
+    if (outClass) *outClass = NULL;
+    return arg(pos)->type;
+}
+
+static int hostArgIsNil(int pos) {
+    return arg(pos)->type == kTypeNil;
+}
+
+static int hostArgBool(int pos) {
+    return arg(pos)->intValue != 0;
+}
+
+static int hostArgInt(int pos) {
+    HostValue* value = arg(pos);
+    return value->type == kTypeFloat ? (int)value->floatValue : value->intValue;
+}
+
+static float hostArgFloat(int pos) {
+    HostValue* value = arg(pos);
+    return value->type == kTypeInt ? (float)value->intValue : value->floatValue;
+}
+
+static const char* hostArgString(int pos) {
+    return arg(pos)->type == kTypeString ? arg(pos)->string : NULL;
+}
+
+static const char* hostArgBytes(int pos, size_t* outlen) {
+    HostValue* value = arg(pos);
+    if (value->type != kTypeString) return NULL;
+    if (outlen) *outlen = value->length;
+    return value->string;
+}
+
+static void* hostArgObject(int pos, char* type, LuaUDObject** outud) {
+    (void)type;
+    HostValue* value = arg(pos);
+    if (value->type != kTypeObject) return NULL;
+    if (outud) *outud = (LuaUDObject*)value->object;
+    return value->object;
+}
+
+static HostValue* pushResult(enum LuaType type) {
+    if (resultCount == HOST_MAX_VALUES) {
+        hostError("too many results");
+        exit(1);
+    }
+    HostValue* value = &results[resultCount++];
+    memset(value, 0, sizeof(*value));
+    value->type = type;
+    return value;
+}
+
+static void hostPushNil(void) {
+    pushResult(kTypeNil);
+}
+
+static void hostPushBool(int val) {
+    pushResult(kTypeBool)->intValue = val != 0;
+}
+
+static void hostPushInt(int val) {
+    pushResult(kTypeInt)->intValue = val;
+}
+
+static void hostPushFloat(float val) {
+    pushResult(kTypeFloat)->floatValue = val;
+}
+
+static void hostPushBytes(const char* str, size_t len) {
+    HostValue* value = pushResult(kTypeString);
+    char* copy = malloc(len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    resultStrings[resultCount - 1] = copy;
+    value->string = copy;
+    value->length = len;
+}
+
+static void hostPushString(const char* str) {
+    hostPushBytes(str, strlen(str));
+}
+
+static LuaUDObject* hostPushObject(void* obj, char* type, int nValues) {
+    (void)type;
+    (void)nValues;
+    pushResult(kTypeObject)->object = obj;
+    return (LuaUDObject*)obj;
+}
+
+int hostCall(const char* name, const char* argTypes, ...) {
+    lua_CFunction func = NULL;
+    for (int i = 0; i < functionCount; i++) {
+        if (strcmp(functions[i].name, name) == 0) {
+            func = functions[i].func;
+            break;
+        }
+    }
+    if (!func) return -1;
+
+    va_list list;
+    va_start(list, argTypes);
+    argCount = 0;
+    for (const char* t = argTypes; *t && argCount < HOST_MAX_VALUES; t++) {
+        HostValue* value = &args[argCount++];
+        memset(value, 0, sizeof(*value));
+        switch (*t) {
+            case 's':
+                value->type = kTypeString;
+                value->string = va_arg(list, const char*);
+                value->length = strlen(value->string);
+                break;
+            case 'b':
+                value->type = kTypeString;
+                value->string = va_arg(list, const char*);
+                value->length = va_arg(list, size_t);
+                break;
+            case 'i':
+                value->type = kTypeInt;
+                value->intValue = va_arg(list, int);
+                break;
+            case 'f':
+                value->type = kTypeFloat;
+                value->floatValue = (float)va_arg(list, double);
+                break;
+            case 'o':
+                value->type = kTypeObject;
+                value->object = va_arg(list, void*);
+                break;
+            default:
+                value->type = kTypeNil;
+                break;
+        }
+    }
+    va_end(list);
+
+    for (int i = 0; i < resultCount; i++) {
+        free(resultStrings[i]);
+        resultStrings[i] = NULL;
+    }
+    resultCount = 0;
+
+    func(NULL);
+    return resultCount;
+}
+
+HostValue hostResult(int index) {
+    static const HostValue nil = { kTypeNil, 0, 0, NULL, 0, NULL };
+    return index >= 0 && index < resultCount ? results[index] : nil;
+}
+
+// ============================================================================
+// JSON
+// ============================================================================
+
+// Whether the array or table open at each depth has a member yet
+static uint64_t hasMember;
+
+static void jsonWrite(json_encoder* encoder, const char* text) {
+    encoder->writeStringFunc(encoder->userdata, text, (int)strlen(text));
+}
+
+static void jsonNewline(json_encoder* encoder) {
+    if (!encoder->pretty) return;
+    jsonWrite(encoder, "\n");
+    for (int i = 0; i < encoder->depth; i++) jsonWrite(encoder, "  ");
+}
+
+static void jsonOpen(json_encoder* encoder, const char* bracket) {
+    jsonWrite(encoder, bracket);
+    encoder->depth++;
+    hasMember &= ~(1ull << (encoder->depth & 63));
+}
+
+static void jsonClose(json_encoder* encoder, const char* bracket) {
+    int hadMembers = (hasMember >> (encoder->depth & 63)) & 1;
+    encoder->depth--;
+    if (hadMembers) jsonNewline(encoder);
+    jsonWrite(encoder, bracket);
+}
+
+static void jsonMember(json_encoder* encoder) {
+    uint64_t bit = 1ull << (encoder->depth & 63);
+    if (hasMember & bit) jsonWrite(encoder, ",");
+    hasMember |= bit;
+    jsonNewline(encoder);
+}
+
+static void jsonStartArray(json_encoder* encoder) {
+    jsonOpen(encoder, "[");
+}
+
+static void jsonEndArray(json_encoder* encoder) {
+    jsonClose(encoder, "]");
+}
+
+static void jsonStartTable(json_encoder* encoder) {
+    jsonOpen(encoder, "{");
+}
+
+static void jsonEndTable(json_encoder* encoder) {
+    jsonClose(encoder, "}");
+}
+
+static void jsonWriteString(json_encoder* encoder, const char* str, int len) {
+    jsonWrite(encoder, "\"");
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        char escaped[8];
+        if (c == '"' || c == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", c);
+        } else if (c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        } else {
+            encoder->writeStringFunc(encoder->userdata, (const char*)&str[i], 1);
+            continue;
+        }
+        jsonWrite(encoder, escaped);
+    }
+    jsonWrite(encoder, "\"");
+}
+
+static void jsonAddTableMember(json_encoder* encoder, const char* name, int len) {
+    jsonMember(encoder);
+    jsonWriteString(encoder, name, len);
+    jsonWrite(encoder, encoder->pretty ? ": " : ":");
+}
+
+static void jsonWriteNull(json_encoder* encoder) {
+    jsonWrite(encoder, "null");
+}
+
+static void jsonWriteFalse(json_encoder* encoder) {
+    jsonWrite(encoder, "false");
+}
+
+static void jsonWriteTrue(json_encoder* encoder) {
+    jsonWrite(encoder, "true");
+}
+
+static void jsonWriteInt(json_encoder* encoder, int num) {
+    char text[16];
+    snprintf(text, sizeof(text), "%d", num);
+    jsonWrite(encoder, text);
+}
+
+static void jsonWriteDouble(json_encoder* encoder, double num) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.3f", num);
+    jsonWrite(encoder, text);
+}
+
+static void hostInitEncoder(json_encoder* encoder, writeFunc* write, void* userdata, int pretty) {
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->writeStringFunc = write;
+    encoder->userdata = userdata;
+    encoder->pretty = pretty ? 1 : 0;
+    encoder->startArray = jsonStartArray;
+    encoder->addArrayMember = jsonMember;
+    encoder->endArray = jsonEndArray;
+    encoder->startTable = jsonStartTable;
+    encoder->addTableMember = jsonAddTableMember;
+    encoder->endTable = jsonEndTable;
+    encoder->writeNull = jsonWriteNull;
+    encoder->writeFalse = jsonWriteFalse;
+    encoder->writeTrue = jsonWriteTrue;
+    encoder->writeInt = jsonWriteInt;
+    encoder->writeDouble = jsonWriteDouble;
+    encoder->writeString = jsonWriteString;
+}
+
+// ============================================================================
+// API Table
+// ============================================================================
+
+static const struct playdate_sys hostSystem = {
+    .realloc = hostRealloc,
+    .logToConsole = hostLog,
+    .error = hostError,
+    .getCurrentTimeMilliseconds = hostMilliseconds,
+    .getSecondsSinceEpoch = hostSecondsSinceEpoch,
+    .getElapsedTime = hostElapsedTime,
+};
+
+static const struct playdate_file hostFile = {
+    .geterr = hostFileError,
+    .stat = hostStat,
+    .mkdir = hostMkdir,
+    .unlink = hostUnlink,
+    .rename = hostRename,
+    .open = hostOpen,
+    .close = hostClose,
+    .read = hostRead,
+    .write = hostWrite,
+    .flush = hostFlush,
+    .tell = hostTell,
+    .seek = hostSeek,
+};
+
+static const struct playdate_graphics hostGraphics = {
+    .setFont = hostSetFont,
+    .pushContext = hostPushContext,
+    .popContext = hostPopContext,
+    .drawBitmap = hostDrawBitmap,
+    .fillRect = hostFillRect,
+    .drawText = hostDrawText,
+    .getTextWidth = hostGetTextWidth,
+    .newBitmap = hostNewBitmap,
+    .freeBitmap = hostFreeBitmap,
+    .getBitmapData = hostBitmapData,
+    .clearBitmap = hostClearBitmap,
+    .loadFont = hostLoadFont,
+    .getFontPage = hostFontPage,
+    .getPageGlyph = hostPageGlyph,
+    .getGlyphKerning = hostGlyphKerning,
+    .getFontHeight = hostFontHeight,
+    .markUpdatedRows = hostMarkUpdatedRows,
+    .getFrame = hostGetFrame,
+};
+
+static const struct playdate_lua hostLua = {
+    .addFunction = hostAddFunction,
+    .registerClass = hostRegisterClass,
+    .getArgCount = hostArgCount,
+    .getArgType = hostArgType,
+    .argIsNil = hostArgIsNil,
+    .getArgBool = hostArgBool,
+    .getArgInt = hostArgInt,
+    .getArgFloat = hostArgFloat,
+    .getArgString = hostArgString,
+    .getArgBytes = hostArgBytes,
+    .getArgObject = hostArgObject,
+    .pushNil = hostPushNil,
+    .pushBool = hostPushBool,
+    .pushInt = hostPushInt,
+    .pushFloat = hostPushFloat,
+    .pushString = hostPushString,
+    .pushBytes = hostPushBytes,
+    .pushObject = hostPushObject,
+};
+
+static const struct playdate_json hostJSON = {
+    .initEncoder = hostInitEncoder,
+};
+
+static PlaydateAPI hostAPI = {
+    .system = &hostSystem,
+    .file = &hostFile,
+    .graphics = &hostGraphics,
+    .lua = &hostLua,
+    .json = &hostJSON,
+};
+
+PlaydateAPI* hostInit(const char* fonts, const char* dataDir) {
+    snprintf(fontRoot, sizeof(fontRoot), "%s", fonts);
+    snprintf(dataRoot, sizeof(dataRoot), "%s", dataDir);
+    mkdir(dataRoot, 0755);
+
+    frame.data = calloc(frame.rowbytes, frame.height);
+    return &hostAPI;
+}
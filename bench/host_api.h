@@ -0,0 +1,38 @@
+// Host (Linux/macOS) stand-in for the Playdate runtime, so the renderer in
+// src/main.c can be built and measured without the simulator or a device
+
+#ifndef HOST_API_H
+#define HOST_API_H
+
+#include <stddef.h>
+#include "pd_api.h"
+
+typedef struct {
+    enum LuaType type;
+    int intValue;
+    float floatValue;
+    const char* string;  // strings and bytes
+    size_t length;
+    void* object;
+} HostValue;
+
+// Build the API; fonts are loaded from fontRoot (e.g. Source), and files
+// the renderer writes go under dataDir
+PlaydateAPI* hostInit(const char* fontRoot, const char* dataDir);
+
+// Call a function the renderer registered with addFunction, as Lua would.
+// argTypes has one letter per argument: s (const char*), b (const char*,
+// size_t), i (int), f (double) or n (nil).
+// Returns: the number of results, or -1 if no such function is registered
+int hostCall(const char* name, const char* argTypes, ...);
+HostValue hostResult(int index);
+
+// Heap use through pd->system->realloc, in bytes
+size_t hostHeapInUse(void);
+size_t hostHeapPeak(void);
+void hostResetHeapPeak(void);
+
+// Silence logToConsole (it goes to stderr otherwise)
+void hostSetQuiet(int quiet);
+
+#endif
@@ -3,12 +3,15 @@
 //  ORBIT - cmark markdown parser and lexbor HTML parser for Playdate
 //
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "pd_api.h"
 #include "cmark.h"
+#include "lexbor/core/lexbor.h"
 #include "lexbor/html/html.h"
 #include "lexbor/dom/interfaces/character_data.h"
 #include "lexbor/core/str.h"
@@ -21,28 +24,133 @@ static PlaydateAPI* pd = NULL;
 // Page Rendering Data Structures
 // ============================================================================
 
-#define MAX_TEXT_SEGMENTS 1024
 #define SCREEN_HEIGHT 240
 
+// A laid-out run of text on one line; the text itself lives in the page arena
 typedef struct {
     int x, y;
-    char text[512];
     int width;
+    uint32_t offset;  // into PageLayout.text, NUL-terminated there
+    uint32_t length;  // in bytes
 } TextSegment;
 
+// A link: its URL in the page arena and the contiguous segments of its text
+typedef struct {
+    uint32_t urlOffset;
+    uint32_t urlLength;
+    int firstSegment;
+    int segmentCount;
+} PageLink;
+
+// A box reserved for an inline image, drawn once the image is decoded
+typedef struct {
+    int x, y;
+    int width, height;
+    uint32_t urlOffset;  // into PageLayout.text, NUL-terminated there
+    uint32_t urlLength;
+} PageImage;
+
+// Per-page segment store: segment text and link and image URLs are packed
+// into one growable arena and all arrays grow on demand, so long pages are
+// never truncated
+typedef struct {
+    char* text;
+    size_t textLength;
+    size_t textCapacity;
+
+    TextSegment* segments;
+    int segmentCount;
+    int segmentCapacity;
+
+    PageLink* links;
+    int linkCount;
+    int linkCapacity;
+
+    PageImage* images;
+    int imageCount;
+    int imageCapacity;
+
+    uint32_t* words;  // arena offsets where words start, in page order
+    int wordCount;
+    int wordCapacity;
+} PageLayout;
+
+// A link segment filed under the text line it sits on
+typedef struct {
+    int segment;
+    int link;
+} LinkIndexEntry;
+
+// Link segments bucketed by line y, so hit tests only look at the lines
+// around the query point however many links the page has
+typedef struct {
+    int lineCount;
+    int* lineStart;  // entries for line i are [lineStart[i], lineStart[i + 1])
+    LinkIndexEntry* entries;
+} LinkIndex;
+
+// Word starts bucketed by a hash of their first few case-folded letters, so
+// find only checks the words that could match
+typedef struct {
+    int bucketCount;    // a power of two
+    int* bucketStart;   // words in bucket b are [bucketStart[b], bucketStart[b + 1])
+    uint32_t* entries;  // arena offsets, in page order within each bucket
+} WordIndex;
+
+// A laid-out page and the geometry it was laid out for. Pages are shared
+// by the stream building them, the screen, and link tables held by Lua
+typedef struct {
+    int refCount;
+    PageLayout layout;
+    LinkIndex linkIndex;
+    WordIndex wordIndex;
+    int width;
+    int padding;
+    int tracking;
+    int height;  // padded to at least one screen
+} Page;
+
+// The page drawn on screen; tiles are rasterized from its segments
+static Page* shownPage = NULL;
+
+// Glyph advances for one 256-codepoint page of the font, mirroring LCDFontPage
+typedef struct {
+    uint8_t advance[256];
+    uint8_t present[256 / 8];
+    uint16_t image[256];  // 1 + index into fontCache.glyphImages, 0 for blank glyphs
+} GlyphPage;
+
+// Non-zero kerning adjustment between two BMP codepoints
+typedef struct {
+    uint32_t pair;  // (first << 16) | second
+    int adjust;
+} KerningPair;
+
+#define GLYPH_PAGE_COUNT 256  // Basic Multilingual Plane only
+
 // Font cache only - no other persistent state
+// Glyph metrics are read from the font once so layout never calls back into the font API
 static struct {
     LCDFont* font;
     int fontHeight;
+    GlyphPage* pages[GLYPH_PAGE_COUNT];
+    int missingAdvance;  // advance of U+FFFD, which the font draws for missing glyphs
+    uint8_t asciiAdvance[128];  // glyphAdvance for ASCII, for the line breaker's fast path
+    KerningPair* kerning;
+    int kerningCount;
+    uint32_t fontKey;  // identifies the metrics, for saved layouts
+
+    // Glyph ink, fontHeight rows per glyph, one word per row with the
+    // leftmost pixel in the top bit, so tiles are drawn without drawText
+    uint32_t* glyphImages;
+    int glyphImageCount;
+    uint16_t missingImage;  // U+FFFD's image
 } fontCache = {0};
 
 // ============================================================================
 // HTML Rendering Context
 // ============================================================================
 
-#define MAX_LINKS_JSON 16384
-#define MAX_SEGMENTS_PER_LINK 8
-
 typedef struct {
     // Layout state
     int x, y;
@@ -50,140 +158,673 @@ typedef struct {
     int tracking;
     int firstParagraph;
 
-    // Text segments for final drawing
-    TextSegment* segments;
-    int segmentCount;
-    int maxSegments;
+    // The last segment is still open for the words that follow it, and
+    // collapsed whitespace is waiting to go in front of the next word
+    int segmentOpen;
+    int pendingSpace;
 
-    // Link tracking
-    json_encoder* linkEncoder;
-    TextSegment linkSegments[MAX_SEGMENTS_PER_LINK];
-    int linkSegmentCount;
+    // Text segments and links for final drawing
+    PageLayout* layout;
+
+    // The page's URL, which image sources are relative to (may be NULL)
+    const char* baseURL;
 } RenderContext;
 
-// JSON encoder buffer
-static char* jsonBuffer;
-static int jsonBufferPos;
-static int jsonBufferSize;
+// ============================================================================
+// Instrumentation
+// ============================================================================
 
-static void jsonWrite(void* userdata, const char* str, int len) {
-    (void)userdata;
-    if (jsonBufferPos + len < jsonBufferSize) {
-        memcpy(jsonBuffer + jsonBufferPos, str, len);
-        jsonBufferPos += len;
+// Where a page load's time goes, how much heap is in use, and how long
+// frames take; read from Lua with orbit.stats. Phase times come from
+// getElapsedTime, whose float seconds keep millisecond precision for hours.
+typedef enum {
+    PHASE_NETWORK,  // from starting the stream until the last chunk is fed
+    PHASE_PARSE,
+    PHASE_LAYOUT,
+    PHASE_RASTER,
+    PHASE_COUNT
+} Phase;
+
+static const char* const phaseNames[PHASE_COUNT] = { "network", "parse", "layout", "raster" };
+
+// Frame time histogram buckets, by upper limit in milliseconds; the last
+// bucket takes everything slower
+#define FRAME_BUCKET_COUNT 6
+static const unsigned int frameBucketLimits[FRAME_BUCKET_COUNT - 1] = { 34, 50, 67, 100, 200 };
+
+static struct {
+    size_t heapInUse;
+    size_t heapPeak;
+
+    float page[PHASE_COUNT];   // seconds, for the last page streamed and its tiles
+    float total[PHASE_COUNT];  // seconds, since launch
+    int pages;
+    float streamStart;
+
+    unsigned int frames[FRAME_BUCKET_COUNT];
+    unsigned int lastFrameTime;
+} stats = {0};
+
+// Each block carries its size in front so frees can be counted
+typedef union {
+    size_t size;
+    uint64_t align;
+} HeapHeader;
+
+// All of the renderer's allocations go through here
+static void* heapRealloc(void* ptr, size_t size) {
+    HeapHeader* block = ptr ? (HeapHeader*)ptr - 1 : NULL;
+    size_t oldSize = block ? block->size : 0;
+
+    if (size == 0) {
+        if (block) pd->system->realloc(block, 0);
+        stats.heapInUse -= oldSize;
+        return NULL;
     }
+
+    HeapHeader* result = pd->system->realloc(block, sizeof(HeapHeader) + size);
+    if (!result) return NULL;
+
+    result->size = size;
+    stats.heapInUse += size - oldSize;
+    if (stats.heapInUse > stats.heapPeak) {
+        stats.heapPeak = stats.heapInUse;
+    }
+    return result + 1;
+}
+
+static float beginPhase(void) {
+    return pd->system->getElapsedTime();
+}
+
+static void endPhase(Phase phase, float start) {
+    float elapsed = pd->system->getElapsedTime() - start;
+    stats.page[phase] += elapsed;
+    stats.total[phase] += elapsed;
 }
 
 // ============================================================================
-// HTML Text Extraction and Cleaning
+// Page Layout Store
 // ============================================================================
 
-// Extract and clean text from a DOM node using lexbor's built-in functions
-static void getNodeText(lxb_dom_node_t* node, char* buffer, size_t maxLen) {
-    buffer[0] = '\0';
-    if (!node) return;
+// Frees remembered pages until at most budget bytes remain (defined with the page cache)
+static void trimPageCache(size_t budget);
 
-    size_t len;
-    lxb_char_t* text = lxb_dom_node_text_content(node, &len);
-    if (!text || len == 0) return;
+// Allocations for building pages give up remembered pages before failing
+static void* pageRealloc(void* ptr, size_t size) {
+    void* result = heapRealloc(ptr, size);
+    if (!result && size > 0) {
+        trimPageCache(0);
+        result = heapRealloc(ptr, size);
+    }
+    return result;
+}
+
+// Forget the previous page's segments and links, keeping the allocations for reuse
+static void resetPageLayout(PageLayout* layout) {
+    layout->textLength = 0;
+    layout->segmentCount = 0;
+    layout->linkCount = 0;
+    layout->imageCount = 0;
+    layout->wordCount = 0;
+}
+
+// Copy a string into the arena, NUL-terminated
+// Returns: its offset, or -1 if memory ran out
+static long appendArenaText(PageLayout* layout, const char* text, size_t len) {
+    if (layout->textLength + len + 1 > layout->textCapacity) {
+        size_t capacity = layout->textCapacity ? layout->textCapacity : 8192;
+        while (layout->textLength + len + 1 > capacity) capacity *= 2;
+        char* arena = pageRealloc(layout->text, capacity);
+        if (!arena) return -1;
+        layout->text = arena;
+        layout->textCapacity = capacity;
+    }
+
+    long offset = (long)layout->textLength;
+    memcpy(layout->text + offset, text, len);
+    layout->text[offset + len] = '\0';
+    layout->textLength += len + 1;
+    return offset;
+}
+
+// Append a segment, copying its text into the arena
+// Returns: 0 if memory ran out (the segment is dropped), 1 otherwise
+static int appendSegment(PageLayout* layout, const char* text, size_t len,
+                         int x, int y, int width) {
+    if (layout->segmentCount == layout->segmentCapacity) {
+        int capacity = layout->segmentCapacity ? layout->segmentCapacity * 2 : 256;
+        TextSegment* segments = pageRealloc(layout->segments,
+                                            capacity * sizeof(TextSegment));
+        if (!segments) return 0;
+        layout->segments = segments;
+        layout->segmentCapacity = capacity;
+    }
+
+    long offset = appendArenaText(layout, text, len);
+    if (offset < 0) return 0;
+
+    TextSegment* seg = &layout->segments[layout->segmentCount++];
+    seg->x = x;
+    seg->y = y;
+    seg->width = width;
+    seg->offset = (uint32_t)offset;
+    seg->length = (uint32_t)len;
+    return 1;
+}
+
+// Append to the last segment, whose text must end the arena
+// Returns: 0 if memory ran out (the text is dropped), 1 otherwise
+static int extendLastSegment(PageLayout* layout, const char* text, size_t len, int width) {
+    TextSegment* seg = &layout->segments[layout->segmentCount - 1];
+
+    // Write over the segment's terminating NUL
+    layout->textLength--;
+    if (appendArenaText(layout, text, len) < 0) {
+        layout->textLength++;
+        return 0;
+    }
+
+    seg->length += (uint32_t)len;
+    seg->width += width;
+    return 1;
+}
+
+// Record a link over segments [firstSegment, segmentCount)
+// Returns: 0 if memory ran out (the link is dropped), 1 otherwise
+static int appendLink(PageLayout* layout, const char* url, int firstSegment) {
+    int segmentCount = layout->segmentCount - firstSegment;
+    if (segmentCount <= 0) return 1;
+
+    if (layout->linkCount == layout->linkCapacity) {
+        int capacity = layout->linkCapacity ? layout->linkCapacity * 2 : 64;
+        PageLink* links = pageRealloc(layout->links, capacity * sizeof(PageLink));
+        if (!links) return 0;
+        layout->links = links;
+        layout->linkCapacity = capacity;
+    }
+
+    if (!url) url = "";
+    size_t urlLength = strlen(url);
+    long offset = appendArenaText(layout, url, urlLength);
+    if (offset < 0) return 0;
+
+    PageLink* link = &layout->links[layout->linkCount++];
+    link->urlOffset = (uint32_t)offset;
+    link->urlLength = (uint32_t)urlLength;
+    link->firstSegment = firstSegment;
+    link->segmentCount = segmentCount;
+    return 1;
+}
+
+// Record an image box at (x, y) in content coordinates
+// Returns: 0 if memory ran out (the image is dropped), 1 otherwise
+static int appendImage(PageLayout* layout, const char* url, int x, int y, int width, int height) {
+    if (layout->imageCount == layout->imageCapacity) {
+        int capacity = layout->imageCapacity ? layout->imageCapacity * 2 : 16;
+        PageImage* images = pageRealloc(layout->images, capacity * sizeof(PageImage));
+        if (!images) return 0;
+        layout->images = images;
+        layout->imageCapacity = capacity;
+    }
+
+    size_t urlLength = strlen(url);
+    long offset = appendArenaText(layout, url, urlLength);
+    if (offset < 0) return 0;
+
+    PageImage* image = &layout->images[layout->imageCount++];
+    image->x = x;
+    image->y = y;
+    image->width = width;
+    image->height = height;
+    image->urlOffset = (uint32_t)offset;
+    image->urlLength = (uint32_t)urlLength;
+    return 1;
+}
+
+// Record a word starting at an arena offset
+// Returns: 0 if memory ran out (the word can't be found), 1 otherwise
+static int appendWord(PageLayout* layout, uint32_t offset) {
+    if (layout->wordCount == layout->wordCapacity) {
+        int capacity = layout->wordCapacity ? layout->wordCapacity * 2 : 1024;
+        uint32_t* words = pageRealloc(layout->words, capacity * sizeof(uint32_t));
+        if (!words) return 0;
+        layout->words = words;
+        layout->wordCapacity = capacity;
+    }
+    layout->words[layout->wordCount++] = offset;
+    return 1;
+}
+
+static const char* segmentText(const PageLayout* layout, const TextSegment* seg) {
+    return layout->text + seg->offset;
+}
+
+// Index of the first segment with y >= minY (segments are laid out top to bottom)
+static int findSegmentAtY(const PageLayout* layout, int minY) {
+    int lo = 0, hi = layout->segmentCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (layout->segments[mid].y < minY) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Returns: a page with one reference, owned by the caller
+static Page* newPage(int width, int padding) {
+    Page* page = pageRealloc(NULL, sizeof(Page));
+    if (!page) return NULL;
+
+    memset(page, 0, sizeof(Page));
+    page->refCount = 1;
+    page->width = width;
+    page->padding = padding;
+    page->height = SCREEN_HEIGHT;
+    return page;
+}
+
+static void retainPage(Page* page) {
+    if (page) page->refCount++;
+}
+
+static void freeWordIndex(WordIndex* index) {
+    if (index->bucketStart) heapRealloc(index->bucketStart, 0);
+    if (index->entries) heapRealloc(index->entries, 0);
+    memset(index, 0, sizeof(WordIndex));
+}
+
+static void freeLinkIndex(LinkIndex* index) {
+    if (index->lineStart) heapRealloc(index->lineStart, 0);
+    if (index->entries) heapRealloc(index->entries, 0);
+    memset(index, 0, sizeof(LinkIndex));
+}
 
-    // Clean in-place using lexbor's whitespace collapsing
-    lexbor_str_t str = {.data = text, .length = len};
-    lexbor_str_strip_collapse_whitespace(&str);
+// Bucket every link segment by the line it starts on
+static void buildLinkIndex(Page* page) {
+    PageLayout* layout = &page->layout;
+    LinkIndex* index = &page->linkIndex;
+    int h = fontCache.fontHeight;
+
+    freeLinkIndex(index);
+    if (layout->linkCount == 0 || layout->segmentCount == 0 || h <= 0) return;
+
+    int lineCount = layout->segments[layout->segmentCount - 1].y / h + 1;
+    int entryCount = 0;
+    for (int i = 0; i < layout->linkCount; i++) {
+        entryCount += layout->links[i].segmentCount;
+    }
+
+    index->lineStart = heapRealloc(NULL, (lineCount + 1) * sizeof(int));
+    index->entries = heapRealloc(NULL, entryCount * sizeof(LinkIndexEntry));
+    int* fill = heapRealloc(NULL, lineCount * sizeof(int));
+    if (!index->lineStart || !index->entries || !fill) {
+        if (fill) heapRealloc(fill, 0);
+        freeLinkIndex(index);
+        return;
+    }
+
+    // Count per line, then prefix-sum into start offsets
+    memset(index->lineStart, 0, (lineCount + 1) * sizeof(int));
+    for (int i = 0; i < layout->linkCount; i++) {
+        PageLink* link = &layout->links[i];
+        for (int j = 0; j < link->segmentCount; j++) {
+            index->lineStart[layout->segments[link->firstSegment + j].y / h + 1]++;
+        }
+    }
+    for (int line = 0; line < lineCount; line++) {
+        index->lineStart[line + 1] += index->lineStart[line];
+        fill[line] = index->lineStart[line];
+    }
+
+    for (int i = 0; i < layout->linkCount; i++) {
+        PageLink* link = &layout->links[i];
+        for (int j = 0; j < link->segmentCount; j++) {
+            int segment = link->firstSegment + j;
+            int line = layout->segments[segment].y / h;
+            index->entries[fill[line]].segment = segment;
+            index->entries[fill[line]].link = i;
+            fill[line]++;
+        }
+    }
+
+    index->lineCount = lineCount;
+    heapRealloc(fill, 0);
+}
+
+// Find the link under a point in content coordinates, allowing `radius`
+// pixels of slack around each segment
+// Returns: link index, or -1 if there is none
+static int hitTestLinks(const Page* page, int x, int y, int radius) {
+    const LinkIndex* index = &page->linkIndex;
+    const PageLayout* layout = &page->layout;
+    int h = fontCache.fontHeight;
+    if (index->lineCount == 0 || y + radius < 0) return -1;
+
+    // A segment on line n covers rows [n * h, n * h + h)
+    int firstLine = (y - radius < 0) ? 0 : (y - radius) / h;
+    int lastLine = (y + radius) / h;
+    if (lastLine >= index->lineCount) lastLine = index->lineCount - 1;
+
+    for (int line = firstLine; line <= lastLine; line++) {
+        for (int e = index->lineStart[line]; e < index->lineStart[line + 1]; e++) {
+            const TextSegment* seg = &layout->segments[index->entries[e].segment];
+            if (x + radius >= seg->x && x - radius < seg->x + seg->width &&
+                y + radius >= seg->y && y - radius < seg->y + h) {
+                return index->entries[e].link;
+            }
+        }
+    }
+    return -1;
+}
 
-    // Copy to output buffer
-    size_t copyLen = str.length < maxLen - 1 ? str.length : maxLen - 1;
-    memcpy(buffer, str.data, copyLen);
-    buffer[copyLen] = '\0';
+static void releasePage(Page* page) {
+    if (!page || --page->refCount > 0) return;
+
+    freeLinkIndex(&page->linkIndex);
+    freeWordIndex(&page->wordIndex);
+    if (page->layout.text) heapRealloc(page->layout.text, 0);
+    if (page->layout.segments) heapRealloc(page->layout.segments, 0);
+    if (page->layout.links) heapRealloc(page->layout.links, 0);
+    if (page->layout.images) heapRealloc(page->layout.images, 0);
+    if (page->layout.words) heapRealloc(page->layout.words, 0);
+    heapRealloc(page, 0);
 }
 
 // ============================================================================
-// HTML Rendering Primitives
+// Text Flow
 // ============================================================================
 
-// Forward declaration of layoutWords (defined later)
-static int layoutWords(const char* text, int startX, int startY,
-                       TextSegment* segments, int maxSegments,
-                       int* endX, int* endY,
-                       int contentWidth, int tracking);
+// Text goes into the layout a word at a time, straight from its source (a
+// DOM text node or a cmark literal) into the page arena. Whitespace runs
+// collapse to one space, which is dropped at the start of a line.
 
-// Render plain text to the context
-static void renderPlainText(RenderContext* ctx, const char* text) {
-    if (!text || !*text || !ctx->segments) return;
+// Forward declarations of the font metrics, line breaker and word index (defined later)
+static int glyphAdvance(uint32_t c);
+static int measureText(const char* text, int len);
+static size_t nextBreak(const char* text, size_t len, size_t pos, int* width);
+static size_t fitText(const char* text, size_t len, int maxWidth, int* width);
+static void indexWords(PageLayout* layout, uint32_t offset, size_t len, int continuing);
 
-    static TextSegment tempSegments[256];
-    int newX, newY;
-    int count = layoutWords(text, ctx->x, ctx->y, tempSegments, 256,
-                            &newX, &newY, ctx->contentWidth, ctx->tracking);
+// Finds and measures each word of a run; the host bench swaps in one that
+// measures through the font API, to compare with the glyph table
+static size_t (*breakMeasurer)(const char* text, size_t len, size_t pos, int* width) = nextBreak;
 
-    // Add segments to total list
-    for (int i = 0; i < count && ctx->segmentCount < ctx->maxSegments; i++) {
-        ctx->segments[ctx->segmentCount++] = tempSegments[i];
+static int isSpaceChar(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+// Add text at the pen, continuing the open segment when there is one, and
+// note where its words start
+static void flowText(RenderContext* ctx, const char* text, size_t len, int width) {
+    PageLayout* layout = ctx->layout;
+    if (ctx->segmentOpen) {
+        TextSegment* last = &layout->segments[layout->segmentCount - 1];
+        if (last->offset + last->length + 1 == layout->textLength) {
+            uint32_t offset = last->offset + last->length;
+            if (extendLastSegment(layout, text, len, width)) {
+                indexWords(layout, offset, len, 1);
+            }
+            return;
+        }
     }
+    ctx->segmentOpen = appendSegment(layout, text, len, ctx->x, ctx->y, width);
+    if (ctx->segmentOpen) {
+        indexWords(layout, layout->segments[layout->segmentCount - 1].offset, len, 0);
+    }
+}
 
-    ctx->x = newX;
-    ctx->y = newY;
+// A space that doesn't fit always precedes a wrap, so it is dropped
+static void flowSpace(RenderContext* ctx) {
+    int spaceWidth = glyphAdvance(' ');
+    if (ctx->x == 0 || ctx->x + spaceWidth > ctx->contentWidth) return;
+
+    flowText(ctx, " ", 1, spaceWidth);
+    ctx->x += spaceWidth + ctx->tracking;
 }
 
-// Render a link (text + record segments for JSON)
-static void renderLink(RenderContext* ctx, const char* text, const char* url) {
-    if (!text || !*text || !ctx->linkEncoder) return;
+static void wrapLine(RenderContext* ctx) {
+    ctx->segmentOpen = 0;
+    ctx->x = 0;
+    ctx->y += fontCache.fontHeight;
+}
 
-    // Render text normally
-    static TextSegment tempSegments[256];
-    int newX, newY;
-    int count = layoutWords(text, ctx->x, ctx->y, tempSegments, 256,
-                            &newX, &newY, ctx->contentWidth, ctx->tracking);
+// Lay out text that has no break opportunity inside, wordWidth wide without
+// tracking. A joined word continues the previous one with no space between
+// (e.g. after a hyphen or between ideographs), so no tracking goes in front.
+static void flowWord(RenderContext* ctx, const char* word, size_t len, int wordWidth, int joined) {
+    if (ctx->pendingSpace) {
+        ctx->pendingSpace = 0;
+        flowSpace(ctx);
+    } else if (joined) {
+        ctx->x -= ctx->tracking;
+    }
 
-    // Add segments to total list and link segments
-    ctx->linkSegmentCount = 0;
-    for (int i = 0; i < count && ctx->segmentCount < ctx->maxSegments; i++) {
-        ctx->segments[ctx->segmentCount++] = tempSegments[i];
-        if (ctx->linkSegmentCount < MAX_SEGMENTS_PER_LINK) {
-            ctx->linkSegments[ctx->linkSegmentCount++] = tempSegments[i];
-        }
+    // Wrap if needed
+    if (ctx->x > 0 && ctx->x + wordWidth > ctx->contentWidth) {
+        wrapLine(ctx);
     }
 
-    ctx->x = newX;
-    ctx->y = newY;
+    // A word wider than a whole line is broken wherever it reaches the edge
+    while (ctx->x == 0 && wordWidth > ctx->contentWidth) {
+        int fitWidth;
+        size_t fit = fitText(word, len, ctx->contentWidth, &fitWidth);
+        if (fit >= len) break;
+
+        flowText(ctx, word, fit, fitWidth);
+        wrapLine(ctx);
+        word += fit;
+        len -= fit;
+        wordWidth = measureText(word, (int)len);
+    }
 
-    // Record link to JSON
-    if (ctx->linkSegmentCount > 0) {
-        json_encoder* enc = ctx->linkEncoder;
-        enc->addArrayMember(enc);
-        enc->startTable(enc);
+    flowText(ctx, word, len, wordWidth);
+    ctx->x += wordWidth + ctx->tracking;
+}
 
-        // URL
-        enc->addTableMember(enc, "url", 3);
-        enc->writeString(enc, url ? url : "", url ? (int)strlen(url) : 0);
+// Lay out a run of text; whitespace at its end stays pending for the next run
+// Returns: 1 if any word was laid out
+static int flowRun(RenderContext* ctx, const char* text, size_t len) {
+    if (!ctx->layout || !fontCache.font) return 0;
 
-        // Segments array
-        enc->addTableMember(enc, "segments", 8);
-        enc->startArray(enc);
-        for (int i = 0; i < ctx->linkSegmentCount; i++) {
-            TextSegment* seg = &ctx->linkSegments[i];
-            enc->addArrayMember(enc);
-            enc->startArray(enc);
-            enc->addArrayMember(enc);
-            enc->writeInt(enc, seg->x);
-            enc->addArrayMember(enc);
-            enc->writeInt(enc, seg->y);
-            enc->addArrayMember(enc);
-            enc->writeInt(enc, seg->width);
-            enc->endArray(enc);
+    int laidOut = 0;
+    int joined = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        if (isSpaceChar(text[pos])) {
+            ctx->pendingSpace = 1;
+            joined = 0;
+            pos++;
+            continue;
         }
-        enc->endArray(enc);
 
-        enc->endTable(enc);
+        int width;
+        size_t end = breakMeasurer(text, len, pos, &width);
+        flowWord(ctx, text + pos, end - pos, width, joined);
+        laidOut = 1;
+        joined = 1;
+        pos = end;
     }
+    return laidOut;
+}
+
+// Close the open segment so the next word starts a new one. With keepSpace,
+// pending whitespace is laid out at the end of the closed segment first.
+static void breakSegment(RenderContext* ctx, int keepSpace) {
+    if (keepSpace && ctx->pendingSpace) flowSpace(ctx);
+    ctx->pendingSpace = 0;
+    ctx->segmentOpen = 0;
+}
+
+// Next node after node in document order without leaving root's subtree;
+// with descend = 0 the children of node are skipped
+static lxb_dom_node_t* nextNode(lxb_dom_node_t* node, lxb_dom_node_t* root, int descend) {
+    if (descend && node->first_child) return node->first_child;
+    while (node != root && !node->next) node = node->parent;
+    return node == root ? NULL : node->next;
+}
+
+// Lay out the descendant text nodes of node, reading their data in place;
+// whitespace collapses across node boundaries
+// Returns: 1 if any word was laid out
+static int flowNodeText(RenderContext* ctx, lxb_dom_node_t* node) {
+    int laidOut = 0;
+    for (lxb_dom_node_t* n = node; n; n = nextNode(n, node, 1)) {
+        if (n->type != LXB_DOM_NODE_TYPE_TEXT) continue;
+        lexbor_str_t* data = &lxb_dom_interface_character_data(n)->data;
+        laidOut |= flowRun(ctx, (const char*)data->data, data->length);
+    }
+    return laidOut;
+}
+
+// ============================================================================
+// HTML Rendering Primitives
+// ============================================================================
+
+// Render plain text to the context
+static void renderPlainText(RenderContext* ctx, const char* text) {
+    if (!text || !*text) return;
+    flowRun(ctx, text, strlen(text));
+}
+
+// Render an element's text to the context
+// Returns: 1 if it had any text
+static int renderNodeText(RenderContext* ctx, lxb_dom_node_t* node) {
+    return flowNodeText(ctx, node);
+}
+
+// Render a link (an element's text + record its segments in the link table)
+// Returns: 1 if it had any text
+static int renderLink(RenderContext* ctx, lxb_dom_node_t* node, const char* url) {
+    if (!ctx->layout) return 0;
+
+    // The link's segments are the ones appended now
+    breakSegment(ctx, 1);
+    int firstSegment = ctx->layout->segmentCount;
+    int laidOut = flowNodeText(ctx, node);
+    breakSegment(ctx, 0);
+
+    appendLink(ctx->layout, url, firstSegment);
+    return laidOut;
 }
 
 // Render a newline (paragraph break)
 static void renderNewline(RenderContext* ctx) {
+    breakSegment(ctx, 0);
     ctx->x = 0;
     ctx->y += fontCache.fontHeight;
 }
 
+#define IMAGE_URL_SIZE 512
+
+// Resolve href against the page URL base (absolute, protocol-relative,
+// root-relative or relative to base's directory)
+// Returns: 0 for data: URLs and for anything that doesn't fit in out
+static int resolveURL(const char* base, const char* href, size_t hrefLen, char* out, size_t outSize) {
+    while (hrefLen > 0 && isSpaceChar(*href)) {
+        href++;
+        hrefLen--;
+    }
+    if (hrefLen == 0 || strncasecmp(href, "data:", 5) == 0) return 0;
+
+    int n;
+    const char* scheme = base ? strstr(base, "://") : NULL;
+    if (strncasecmp(href, "http://", 7) == 0 || strncasecmp(href, "https://", 8) == 0 || !scheme) {
+        n = snprintf(out, outSize, "%.*s", (int)hrefLen, href);
+    } else if (href[0] == '/' && hrefLen > 1 && href[1] == '/') {
+        n = snprintf(out, outSize, "https:%.*s", (int)hrefLen, href);
+    } else {
+        // Root-relative paths keep base's scheme and host, others its directory
+        const char* host = scheme + 3;
+        const char* path = strchr(host, '/');
+        size_t keep = path ? (size_t)(path - base) : strlen(base);
+        if (href[0] != '/' && path) {
+            const char* end = path + strcspn(path, "?#");
+            while (end > path && end[-1] != '/') end--;
+            keep = (size_t)(end - base);
+        }
+        while (hrefLen >= 2 && strncmp(href, "./", 2) == 0) {
+            href += 2;
+            hrefLen -= 2;
+        }
+        n = snprintf(out, outSize, "%.*s%s%.*s", (int)keep, base,
+                     !path && href[0] != '/' ? "/" : "", (int)hrefLen, href);
+    }
+    return n > 0 && (size_t)n < outSize;
+}
+
+// Reserve a box for an inline image on lines of its own: its own size if
+// known, scaled down to fit, or else a 16:9 box as wide as the content. The
+// pen is left at the end of the box's last line, so the text after it
+// starts below the box, still on a whole line for the link index.
+static void renderImage(RenderContext* ctx, const char* url, int width, int height) {
+    if (!ctx->layout) return;
+
+    int h = fontCache.fontHeight;
+    breakSegment(ctx, 0);
+    ctx->pendingSpace = 0;
+    if (ctx->x > 0) {
+        ctx->x = 0;
+        ctx->y += h;
+    }
+
+    int maxWidth = ctx->contentWidth;
+    int maxHeight = SCREEN_HEIGHT - 2 * h;
+    if (width <= 0 || height <= 0) {
+        width = maxWidth;
+        height = maxWidth * 9 / 16;
+    }
+    if (width > maxWidth) {
+        height = height * maxWidth / width;
+        width = maxWidth;
+    }
+    if (height > maxHeight) {
+        width = width * maxHeight / height;
+        height = maxHeight;
+    }
+    if (width < 1) width = 1;
+    if (height < 1) height = 1;
+
+    if (!appendImage(ctx->layout, url, (maxWidth - width) / 2, ctx->y, width, height)) return;
+    ctx->y += (height + h - 1) / h * h - h;
+    ctx->x = ctx->contentWidth;
+    ctx->firstParagraph = 0;
+}
+
+static int getIntAttribute(lxb_dom_element_t* element, const char* name) {
+    size_t len;
+    const lxb_char_t* value = lxb_dom_element_get_attribute(
+        element, (const lxb_char_t*)name, strlen(name), &len);
+    return value && len > 0 ? atoi((const char*)value) : 0;
+}
+
+// Reserve boxes for the <img> elements in node's subtree (node included);
+// lazy-loaded images keep their real source in data-src
+// Returns: 1 if it had any images
+static int renderNodeImages(RenderContext* ctx, lxb_dom_node_t* node) {
+    int rendered = 0;
+    for (lxb_dom_node_t* n = node; n; n = nextNode(n, node, 1)) {
+        if (n->type != LXB_DOM_NODE_TYPE_ELEMENT) continue;
+        lxb_dom_element_t* element = lxb_dom_interface_element(n);
+        size_t nameLen;
+        const lxb_char_t* name = lxb_dom_element_local_name(element, &nameLen);
+        if (!name || nameLen != 3 || memcmp(name, "img", 3) != 0) continue;
+
+        char url[IMAGE_URL_SIZE];
+        size_t srcLen;
+        const lxb_char_t* src = lxb_dom_element_get_attribute(
+            element, (const lxb_char_t*)"data-src", 8, &srcLen);
+        if (!src || !resolveURL(ctx->baseURL, (const char*)src, srcLen, url, sizeof(url))) {
+            src = lxb_dom_element_get_attribute(element, (const lxb_char_t*)"src", 3, &srcLen);
+            if (!src || !resolveURL(ctx->baseURL, (const char*)src, srcLen, url, sizeof(url))) continue;
+        }
+
+        renderImage(ctx, url, getIntAttribute(element, "width"), getIntAttribute(element, "height"));
+        rendered = 1;
+    }
+    return rendered;
+}
+
 // Check if element is inside a tag with given name
 static int isInsideTag(lxb_dom_node_t* node, const char* tagName, size_t tagLen) {
     lxb_dom_node_t* parent = node->parent;
@@ -212,37 +853,120 @@ static int hasClass(lxb_dom_element_t* element, const char* className) {
     return 0;
 }
 
-// CSS selector query - calls callback for each matching element
+// CSS selector matching - handlers are called for each matching element
 typedef lxb_status_t (*SelectorCallback)(lxb_dom_node_t* node, void* ctx);
 
-static lxb_status_t selectorFindCallback(lxb_dom_node_t *node,
-    lxb_css_selector_specificity_t spec, void *ctx) {
-    (void)spec;
-    void** args = ctx;
-    SelectorCallback cb = args[0];
-    return cb(node, args[1]);
-}
+// A selector is compiled on first use and kept for the rest of the session
+typedef struct {
+    const char* source;
+    lxb_css_selector_list_t* list;
+    int failed;
+} Selector;
+
+// One parser and matching engine, shared by every query
+static struct {
+    lxb_css_parser_t* parser;
+    lxb_selectors_t* selectors;
+} selectorEngine;
+
+static int initSelectorEngine(void) {
+    if (selectorEngine.selectors) return 1;
 
-static void querySelectorAll(lxb_html_document_t* document, const char* selector,
-                             SelectorCallback callback, void* ctx) {
     lxb_css_parser_t* parser = lxb_css_parser_create();
-    lxb_css_parser_init(parser, NULL);
+    if (lxb_css_parser_init(parser, NULL) != LXB_STATUS_OK) {
+        lxb_css_parser_destroy(parser, true);
+        return 0;
+    }
 
     lxb_selectors_t* selectors = lxb_selectors_create();
-    lxb_selectors_init(selectors);
+    if (lxb_selectors_init(selectors) != LXB_STATUS_OK) {
+        lxb_selectors_destroy(selectors, true);
+        lxb_css_parser_destroy(parser, true);
+        return 0;
+    }
 
+    selectorEngine.parser = parser;
+    selectorEngine.selectors = selectors;
+    return 1;
+}
+
+static lxb_css_selector_list_t* compileSelector(Selector* selector) {
+    if (selector->list || selector->failed) return selector->list;
+    if (!initSelectorEngine()) return NULL;
+
+    lxb_css_parser_t* parser = selectorEngine.parser;
     lxb_css_selector_list_t* list = lxb_css_selectors_parse(parser,
-        (const lxb_char_t*)selector, strlen(selector));
+        (const lxb_char_t*)selector->source, strlen(selector->source));
+
+    if (parser->status != LXB_STATUS_OK) {
+        pd->system->logToConsole("Bad selector: %s", selector->source);
+        lxb_css_selector_list_destroy_memory(list);
+        selector->failed = 1;
+        return NULL;
+    }
+
+    selector->list = list;
+    return list;
+}
+
+// A renderer's selectors and the handler each one's matches are passed to
+typedef struct {
+    Selector selector;
+    SelectorCallback handler;
+} SelectorRule;
+
+static lxb_status_t selectorMatched(lxb_dom_node_t *node,
+    lxb_css_selector_specificity_t spec, void *ctx) {
+    (void)node;
+    (void)spec;
+    *(int*)ctx = 1;
+    return LXB_STATUS_OK;
+}
+
+// Long jobs run in slices that stop at a deadline from
+// getCurrentTimeMilliseconds; 0 means no deadline. The clock is only read
+// every STEP_CHECK_INTERVAL steps.
+#define STEP_CHECK_INTERVAL 32
 
-    if (parser->status == LXB_STATUS_OK) {
-        void* args[2] = { callback, ctx };
-        lxb_selectors_find(selectors, lxb_dom_interface_node(document),
-                           list, selectorFindCallback, args);
+static int pastDeadline(unsigned int deadline) {
+    return deadline && pd->system->getCurrentTimeMilliseconds() >= deadline;
+}
+
+// Match all rules in one document-order walk, starting at *cursor (NULL
+// for the top of the document) and stopping at the deadline. Each element
+// goes to the handler of the first rule it matches, and its subtree is left
+// to that handler rather than searched for further matches.
+// Returns: 1 once the walk has reached the end of the document
+static int matchRules(lxb_html_document_t* document, SelectorRule* rules, int ruleCount,
+                      void* ctx, lxb_dom_node_t** cursor, unsigned int deadline) {
+    for (int i = 0; i < ruleCount; i++) {
+        compileSelector(&rules[i].selector);
+    }
+    if (!selectorEngine.selectors) return 1;
+
+    lxb_dom_node_t* root = lxb_dom_interface_node(document);
+    lxb_dom_node_t* node = *cursor ? *cursor : nextNode(root, root, 1);
+    int steps = 0;
+    while (node) {
+        if (++steps % STEP_CHECK_INTERVAL == 0 && pastDeadline(deadline)) {
+            *cursor = node;
+            return 0;
+        }
+
+        int matched = 0;
+        if (node->type == LXB_DOM_NODE_TYPE_ELEMENT) {
+            for (int i = 0; i < ruleCount && !matched; i++) {
+                if (!rules[i].selector.list) continue;
+                lxb_selectors_match_node(selectorEngine.selectors, node,
+                                         rules[i].selector.list, selectorMatched, &matched);
+                if (matched) rules[i].handler(node, ctx);
+            }
+        }
+        node = nextNode(node, root, !matched);
     }
 
-    lxb_css_selector_list_destroy_memory(list);
-    lxb_selectors_destroy(selectors, true);
-    lxb_css_parser_destroy(parser, true);
+    *cursor = NULL;
+    return 1;
 }
 
 // ============================================================================
@@ -259,25 +983,19 @@ static lxb_status_t renderNPRHeadline(lxb_dom_node_t* node, void* ctx) {
         element, (const lxb_char_t*)"href", 4, &hrefLen);
     if (!href || hrefLen == 0) return LXB_STATUS_OK;
 
-    char text[512];
-    getNodeText(node, text, sizeof(text));
-    if (!text[0]) return LXB_STATUS_OK;
-
     char fullUrl[256];
     snprintf(fullUrl, sizeof(fullUrl), "https://text.npr.org%.*s", (int)hrefLen, href);
 
-    renderLink(rctx, text, fullUrl);
-    renderNewline(rctx);
-    renderNewline(rctx);
+    if (renderLink(rctx, node, fullUrl)) {
+        renderNewline(rctx);
+        renderNewline(rctx);
+    }
     return LXB_STATUS_OK;
 }
 
-static void renderNPRFrontpage(RenderContext* ctx, lxb_html_document_t* document) {
-    renderPlainText(ctx, "NPR News");
-    renderNewline(ctx);
-    renderNewline(ctx);
-    querySelectorAll(document, "a.topic-title", renderNPRHeadline, ctx);
-}
+static SelectorRule nprFrontpageRules[] = {
+    { { .source = "a.topic-title" }, renderNPRHeadline },
+};
 
 // NPR Article: Render story header (title, author, date)
 static lxb_status_t renderNPRStoryHead(lxb_dom_node_t* node, void* ctx) {
@@ -286,95 +1004,66 @@ static lxb_status_t renderNPRStoryHead(lxb_dom_node_t* node, void* ctx) {
     // Render children: h1.story-title, then <p> elements for author/date
     for (lxb_dom_node_t* child = node->first_child; child; child = child->next) {
         if (child->type != LXB_DOM_NODE_TYPE_ELEMENT) continue;
+        if (!renderNodeText(rctx, child)) continue;
 
-        char text[512];
-        getNodeText(child, text, sizeof(text));
-        if (!text[0]) continue;
-
-        renderPlainText(rctx, text);
         renderNewline(rctx);
         renderNewline(rctx);
     }
     return LXB_STATUS_OK;
 }
 
-// NPR Article: Render each content element
+// NPR Article: Render each content element, images first
 static lxb_status_t renderNPRContentElement(lxb_dom_node_t* node, void* ctx) {
     RenderContext* rctx = ctx;
 
-    char text[2048];
-    getNodeText(node, text, sizeof(text));
-    if (text[0]) {
-        renderPlainText(rctx, text);
+    int images = renderNodeImages(rctx, node);
+    if (renderNodeText(rctx, node) || images) {
         renderNewline(rctx);
         renderNewline(rctx);
     }
     return LXB_STATUS_OK;
 }
 
-static void renderNPRArticle(RenderContext* ctx, lxb_html_document_t* document) {
-    querySelectorAll(document, "div.story-head", renderNPRStoryHead, ctx);
-    querySelectorAll(document, "div.paragraphs-container > *", renderNPRContentElement, ctx);
+static SelectorRule nprArticleRules[] = {
+    { { .source = "div.story-head" }, renderNPRStoryHead },
+    { { .source = "div.paragraphs-container > *" }, renderNPRContentElement },
+};
+
+// Helper: check an element's data-field attribute
+static int hasDataField(lxb_dom_element_t* element, const char* fieldValue) {
+    size_t attrLen;
+    const lxb_char_t* attr = lxb_dom_element_get_attribute(
+        element, (const lxb_char_t*)"data-field", 10, &attrLen);
+    return attr && attrLen == strlen(fieldValue) && memcmp(attr, fieldValue, attrLen) == 0;
 }
 
-// Helper: recursively find element with data-field attribute
-static lxb_dom_node_t* findDataField(lxb_dom_node_t* node, const char* fieldValue) {
-    while (node) {
-        if (node->type == LXB_DOM_NODE_TYPE_ELEMENT) {
-            lxb_dom_element_t* elem = lxb_dom_interface_element(node);
-            size_t attrLen;
-            const lxb_char_t* attr = lxb_dom_element_get_attribute(
-                elem, (const lxb_char_t*)"data-field", 10, &attrLen);
-            if (attr && strncmp((const char*)attr, fieldValue, attrLen) == 0) {
-                return node;
-            }
-            // Search children
-            lxb_dom_node_t* found = findDataField(node->first_child, fieldValue);
-            if (found) return found;
-        }
-        node = node->next;
-    }
-    return NULL;
-}
+// CSMonitor Frontpage: Render each article item
+static lxb_status_t renderCSMArticleItem(lxb_dom_node_t* node, void* ctx) {
+    RenderContext* rctx = ctx;
 
-// Helper: find first <a> element in subtree
-static lxb_dom_element_t* findAnchor(lxb_dom_node_t* node) {
-    while (node) {
-        if (node->type == LXB_DOM_NODE_TYPE_ELEMENT) {
-            lxb_dom_element_t* elem = lxb_dom_interface_element(node);
+    // One walk: find the first <a>, then carry on inside it for the title
+    // and summary
+    lxb_dom_element_t* anchor = NULL;
+    lxb_dom_node_t* titleNode = NULL;
+    lxb_dom_node_t* summaryNode = NULL;
+    lxb_dom_node_t* root = node;
+    for (lxb_dom_node_t* n = nextNode(root, root, 1); n; n = nextNode(n, root, 1)) {
+        if (n->type != LXB_DOM_NODE_TYPE_ELEMENT) continue;
+        lxb_dom_element_t* elem = lxb_dom_interface_element(n);
+
+        if (!anchor) {
             const lxb_char_t* tagName = lxb_dom_element_local_name(elem, NULL);
             if (tagName && tagName[0] == 'a' && tagName[1] == '\0') {
-                return elem;
+                anchor = elem;
+                root = n;
             }
-            // Search children
-            lxb_dom_element_t* found = findAnchor(node->first_child);
-            if (found) return found;
+            continue;
         }
-        node = node->next;
-    }
-    return NULL;
-}
 
-// Helper: recursively find element with class
-static lxb_dom_node_t* findNodeWithClass(lxb_dom_node_t* node, const char* className) {
-    while (node) {
-        if (node->type == LXB_DOM_NODE_TYPE_ELEMENT) {
-            if (hasClass(lxb_dom_interface_element(node), className)) {
-                return node;
-            }
-            lxb_dom_node_t* found = findNodeWithClass(node->first_child, className);
-            if (found) return found;
-        }
-        node = node->next;
+        if (!titleNode && hasClass(elem, "content-title")) titleNode = n;
+        if (!summaryNode && hasDataField(elem, "summary")) summaryNode = n;
+        if (titleNode && summaryNode) break;
     }
-    return NULL;
-}
-
-// CSMonitor Frontpage: Render each article item
-static lxb_status_t renderCSMArticleItem(lxb_dom_node_t* node, void* ctx) {
-    RenderContext* rctx = ctx;
-
-    lxb_dom_element_t* anchor = findAnchor(node->first_child);
     if (!anchor) return LXB_STATUS_OK;
 
     size_t hrefLen;
@@ -389,25 +1078,9 @@ static lxb_status_t renderCSMArticleItem(lxb_dom_node_t* node, void* ctx) {
         snprintf(fullUrl, sizeof(fullUrl), "%.*s", (int)hrefLen, href);
     }
 
-    char headline[512] = "";
-    char summary[512] = "";
-
-    lxb_dom_node_t* anchorNode = lxb_dom_interface_node(anchor);
-    lxb_dom_node_t* titleNode = findNodeWithClass(anchorNode->first_child, "content-title");
-    if (titleNode) {
-        getNodeText(titleNode, headline, sizeof(headline));
-    }
-
-    lxb_dom_node_t* summaryNode = findDataField(anchorNode->first_child, "summary");
-    if (summaryNode) {
-        getNodeText(summaryNode, summary, sizeof(summary));
-    }
-
-    if (headline[0]) {
-        renderLink(rctx, headline, fullUrl);
+    if (titleNode && renderLink(rctx, titleNode, fullUrl)) {
         renderNewline(rctx);
-        if (summary[0]) {
-            renderPlainText(rctx, summary);
+        if (summaryNode && renderNodeText(rctx, summaryNode)) {
             renderNewline(rctx);
         }
         renderNewline(rctx);
@@ -415,12 +1088,9 @@ static lxb_status_t renderCSMArticleItem(lxb_dom_node_t* node, void* ctx) {
     return LXB_STATUS_OK;
 }
 
-static void renderCSMonitorFrontpage(RenderContext* ctx, lxb_html_document_t* document) {
-    renderPlainText(ctx, "Christian Science Monitor");
-    renderNewline(ctx);
-    renderNewline(ctx);
-    querySelectorAll(document, "li[data-type=csm_article]", renderCSMArticleItem, ctx);
-}
+static SelectorRule csmFrontpageRules[] = {
+    { { .source = "li[data-type=csm_article]" }, renderCSMArticleItem },
+};
 
 // CSMonitor Article: Render story header (title, summary, date, byline, location)
 static lxb_status_t renderCSMStoryHeader(lxb_dom_node_t* node, void* ctx) {
@@ -429,10 +1099,7 @@ static lxb_status_t renderCSMStoryHeader(lxb_dom_node_t* node, void* ctx) {
     for (lxb_dom_node_t* child = node->first_child; child; child = child->next) {
         if (child->type != LXB_DOM_NODE_TYPE_ELEMENT) continue;
 
-        char text[512];
-        getNodeText(child, text, sizeof(text));
-        if (text[0]) {
-            renderPlainText(rctx, text);
+        if (renderNodeText(rctx, child)) {
             renderNewline(rctx);
             renderNewline(rctx);
         }
@@ -440,48 +1107,57 @@ static lxb_status_t renderCSMStoryHeader(lxb_dom_node_t* node, void* ctx) {
     return LXB_STATUS_OK;
 }
 
-// CSMonitor Article: Render body content element
+// CSMonitor Article: Render body content element, images first
 static lxb_status_t renderCSMBodyElement(lxb_dom_node_t* node, void* ctx) {
     RenderContext* rctx = ctx;
 
-    char text[2048];
-    getNodeText(node, text, sizeof(text));
-    if (text[0]) {
-        renderPlainText(rctx, text);
+    int images = renderNodeImages(rctx, node);
+    if (renderNodeText(rctx, node) || images) {
         renderNewline(rctx);
         renderNewline(rctx);
     }
     return LXB_STATUS_OK;
 }
 
-static void renderCSMonitorArticle(RenderContext* ctx, lxb_html_document_t* document) {
-    querySelectorAll(document, "div.comp-story-header", renderCSMStoryHeader, ctx);
-    querySelectorAll(document, "div[data-field=body] > *", renderCSMBodyElement, ctx);
-}
+static SelectorRule csmArticleRules[] = {
+    { { .source = "div.comp-story-header" }, renderCSMStoryHeader },
+    { { .source = "div[data-field=body] > *" }, renderCSMBodyElement },
+};
+
+// A site renderer: an optional heading, then whatever its rules match
+typedef struct {
+    const char* title;
+    SelectorRule* rules;
+    int ruleCount;
+} SiteRenderer;
 
-// Site renderer function pointer type
-typedef void (*SiteRenderer)(RenderContext*, lxb_html_document_t*);
+#define SITE_RULES(rules) rules, (int)(sizeof(rules) / sizeof(rules[0]))
+
+static const SiteRenderer nprFrontpage = { "NPR News", SITE_RULES(nprFrontpageRules) };
+static const SiteRenderer nprArticle = { NULL, SITE_RULES(nprArticleRules) };
+static const SiteRenderer csmFrontpage = { "Christian Science Monitor", SITE_RULES(csmFrontpageRules) };
+static const SiteRenderer csmArticle = { NULL, SITE_RULES(csmArticleRules) };
 
 // Find appropriate renderer for URL
-static SiteRenderer findRenderer(const char* url) {
+static const SiteRenderer* findRenderer(const char* url) {
     if (!url) return NULL;
 
     // NPR
     if (strcmp(url, "https://text.npr.org/") == 0 ||
         strcmp(url, "https://text.npr.org") == 0) {
-        return renderNPRFrontpage;
+        return &nprFrontpage;
     }
     if (strstr(url, "text.npr.org/") != NULL) {
-        return renderNPRArticle;
+        return &nprArticle;
     }
 
     // CSMonitor
     if (strcmp(url, "https://www.csmonitor.com/text_edition/") == 0 ||
         strcmp(url, "https://www.csmonitor.com/text_edition") == 0) {
-        return renderCSMonitorFrontpage;
+        return &csmFrontpage;
     }
     if (strstr(url, "csmonitor.com/text_edition/") != NULL) {
-        return renderCSMonitorArticle;
+        return &csmArticle;
     }
 
     return NULL;
@@ -491,7 +1167,232 @@ static SiteRenderer findRenderer(const char* url) {
 // Page Rendering Functions
 // ============================================================================
 
-// Initialize renderer - just caches the font
+// Decode one UTF-8 codepoint at *pos, advancing *pos past it
+// Malformed bytes decode as U+FFFD, like the font's missing glyph
+static uint32_t decodeUTF8(const char* text, int len, int* pos) {
+    const unsigned char* s = (const unsigned char*)text;
+    int i = *pos;
+    uint32_t c = s[i++];
+    int extra = 0;
+
+    if (c >= 0xF0) { c &= 0x07; extra = 3; }
+    else if (c >= 0xE0) { c &= 0x0F; extra = 2; }
+    else if (c >= 0xC0) { c &= 0x1F; extra = 1; }
+    else if (c >= 0x80) { *pos = i; return 0xFFFD; }
+
+    while (extra-- > 0) {
+        if (i >= len || (s[i] & 0xC0) != 0x80) { *pos = i; return 0xFFFD; }
+        c = (c << 6) | (s[i++] & 0x3F);
+    }
+
+    *pos = i;
+    return c;
+}
+
+static int glyphPresent(uint32_t c) {
+    if (c >= GLYPH_PAGE_COUNT * 256) return 0;
+    GlyphPage* page = fontCache.pages[c >> 8];
+    return page && (page->present[(c & 0xFF) >> 3] & (1 << (c & 7)));
+}
+
+static int glyphAdvance(uint32_t c) {
+    if (!glyphPresent(c)) return fontCache.missingAdvance;
+    return fontCache.pages[c >> 8]->advance[c & 0xFF];
+}
+
+static int kerningAdjust(uint32_t first, uint32_t second) {
+    if (fontCache.kerningCount == 0 || first > 0xFFFF || second > 0xFFFF) return 0;
+
+    uint32_t key = (first << 16) | second;
+    int lo = 0, hi = fontCache.kerningCount - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (fontCache.kerning[mid].pair == key) return fontCache.kerning[mid].adjust;
+        if (fontCache.kerning[mid].pair < key) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return 0;
+}
+
+// Width of a UTF-8 run from the cached glyph table (tracking not included,
+// matching getTextWidth with tracking 0)
+static int measureText(const char* text, int len) {
+    int width = 0;
+    int pos = 0;
+    uint32_t prev = 0;
+
+    while (pos < len && text[pos]) {
+        uint32_t c = decodeUTF8(text, len, &pos);
+        width += glyphAdvance(c);
+        if (prev) width += kerningAdjust(prev, c);
+        prev = c;
+    }
+    return width;
+}
+
+#define GLYPH_MAX_WIDTH 32
+
+// Pixels a glyph bitmap sets black, as a row word; bits past its width are clear
+static uint32_t glyphRowInk(const uint8_t* data, const uint8_t* mask, int width) {
+    uint32_t ink = 0;
+    for (int i = 0; i < (width + 7) / 8; i++) {
+        uint8_t bits = (uint8_t)~data[i];
+        if (mask) bits &= mask[i];
+        ink |= (uint32_t)bits << (24 - 8 * i);
+    }
+    return width < 32 ? ink & ~(0xFFFFFFFFu >> width) : ink;
+}
+
+// Copy a glyph's ink into fontCache.glyphImages
+// Returns: its image number, or 0 if the glyph draws nothing
+static uint16_t cacheGlyphImage(LCDBitmap* bitmap, int* capacity) {
+    if (!bitmap) return 0;
+
+    int width = 0, height = 0, rowbytes = 0;
+    uint8_t* mask = NULL;
+    uint8_t* data = NULL;
+    pd->graphics->getBitmapData(bitmap, &width, &height, &rowbytes, &mask, &data);
+    if (!data || fontCache.glyphImageCount >= 0xFFFF) return 0;
+    if (width > GLYPH_MAX_WIDTH) width = GLYPH_MAX_WIDTH;
+    if (height > fontCache.fontHeight) height = fontCache.fontHeight;
+
+    if (fontCache.glyphImageCount == *capacity) {
+        int newCapacity = *capacity ? *capacity * 2 : 128;
+        uint32_t* images = heapRealloc(fontCache.glyphImages,
+                                       (size_t)newCapacity * fontCache.fontHeight * sizeof(uint32_t));
+        if (!images) return 0;
+        fontCache.glyphImages = images;
+        *capacity = newCapacity;
+    }
+
+    uint32_t* rows = fontCache.glyphImages + fontCache.glyphImageCount * fontCache.fontHeight;
+    uint32_t any = 0;
+    for (int y = 0; y < fontCache.fontHeight; y++) {
+        rows[y] = y < height ? glyphRowInk(data + y * rowbytes, mask ? mask + y * rowbytes : NULL, width) : 0;
+        any |= rows[y];
+    }
+    if (!any) return 0;
+
+    return (uint16_t)++fontCache.glyphImageCount;
+}
+
+// Read advances, kerning and glyph images for every glyph in the font into fontCache
+// Returns: number of glyphs cached
+static int cacheGlyphMetrics(void) {
+    for (int i = 0; i < GLYPH_PAGE_COUNT; i++) {
+        if (fontCache.pages[i]) heapRealloc(fontCache.pages[i], 0);
+        fontCache.pages[i] = NULL;
+    }
+    if (fontCache.kerning) heapRealloc(fontCache.kerning, 0);
+    fontCache.kerning = NULL;
+    fontCache.kerningCount = 0;
+    if (fontCache.glyphImages) heapRealloc(fontCache.glyphImages, 0);
+    fontCache.glyphImages = NULL;
+    fontCache.glyphImageCount = 0;
+    int imageCapacity = 0;
+
+    // Glyph handles are only needed while collecting kerning pairs; if they
+    // can't all be kept, the glyphs left out are drawn but never kerned
+    int cachedCount = 0;
+    int glyphCount = 0, glyphCapacity = 0;
+    int glyphsFull = 0;
+    LCDFontGlyph** glyphs = NULL;
+    uint32_t* codes = NULL;
+
+    for (int p = 0; p < GLYPH_PAGE_COUNT; p++) {
+        LCDFontPage* fontPage = pd->graphics->getFontPage(fontCache.font, (uint32_t)p << 8);
+        if (!fontPage) continue;
+
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = ((uint32_t)p << 8) | i;
+            LCDBitmap* bitmap = NULL;
+            int advance = 0;
+            LCDFontGlyph* glyph = pd->graphics->getPageGlyph(fontPage, c, &bitmap, &advance);
+            if (!glyph) continue;
+
+            if (!fontCache.pages[p]) {
+                fontCache.pages[p] = heapRealloc(NULL, sizeof(GlyphPage));
+                if (!fontCache.pages[p]) break;
+                memset(fontCache.pages[p], 0, sizeof(GlyphPage));
+            }
+            fontCache.pages[p]->advance[i] = (uint8_t)advance;
+            fontCache.pages[p]->present[i >> 3] |= (uint8_t)(1 << (i & 7));
+            fontCache.pages[p]->image[i] = cacheGlyphImage(bitmap, &imageCapacity);
+            cachedCount++;
+
+            if (glyphCount == glyphCapacity && !glyphsFull) {
+                int capacity = glyphCapacity ? glyphCapacity * 2 : 128;
+                LCDFontGlyph** moreGlyphs = heapRealloc(glyphs, capacity * sizeof(LCDFontGlyph*));
+                if (moreGlyphs) glyphs = moreGlyphs;
+                uint32_t* moreCodes = moreGlyphs ? heapRealloc(codes, capacity * sizeof(uint32_t)) : NULL;
+                if (moreCodes) {
+                    codes = moreCodes;
+                    glyphCapacity = capacity;
+                } else {
+                    glyphsFull = 1;
+                }
+            }
+            if (glyphCount < glyphCapacity) {
+                glyphs[glyphCount] = glyph;
+                codes[glyphCount] = c;
+                glyphCount++;
+            }
+        }
+    }
+
+    fontCache.missingAdvance = glyphPresent(0xFFFD) ? glyphAdvance(0xFFFD) : 0;
+    for (int c = 0; c < 128; c++) {
+        fontCache.asciiAdvance[c] = (uint8_t)glyphAdvance(c);
+    }
+    fontCache.missingImage = glyphPresent(0xFFFD) ? fontCache.pages[0xFF]->image[0xFD] : 0;
+
+    // Pairs come out sorted by (first, second) because codes are ascending;
+    // out of memory, the pairs found so far are kept
+    int kerningCapacity = 0;
+    int kerningFull = 0;
+    for (int i = 0; i < glyphCount && !kerningFull; i++) {
+        for (int j = 0; j < glyphCount; j++) {
+            int adjust = pd->graphics->getGlyphKerning(glyphs[i], codes[i], codes[j]);
+            if (adjust == 0) continue;
+
+            if (fontCache.kerningCount == kerningCapacity) {
+                int capacity = kerningCapacity ? kerningCapacity * 2 : 32;
+                KerningPair* kerning = heapRealloc(fontCache.kerning, capacity * sizeof(KerningPair));
+                if (!kerning) {
+                    kerningFull = 1;
+                    break;
+                }
+                fontCache.kerning = kerning;
+                kerningCapacity = capacity;
+            }
+            fontCache.kerning[fontCache.kerningCount].pair = (codes[i] << 16) | codes[j];
+            fontCache.kerning[fontCache.kerningCount].adjust = adjust;
+            fontCache.kerningCount++;
+        }
+    }
+
+    if (glyphs) heapRealloc(glyphs, 0);
+    if (codes) heapRealloc(codes, 0);
+    return cachedCount;
+}
+
+// FNV-1a over the height, the Latin-1 advances and the kerning table
+static uint32_t fontMetricsKey(void) {
+    uint32_t key = 2166136261u;
+    key = (key ^ (uint32_t)fontCache.fontHeight) * 16777619u;
+    if (fontCache.pages[0]) {
+        for (int c = 0; c < 256; c++) {
+            key = (key ^ fontCache.pages[0]->advance[c]) * 16777619u;
+        }
+    }
+    for (int i = 0; i < fontCache.kerningCount; i++) {
+        key = (key ^ fontCache.kerning[i].pair) * 16777619u;
+        key = (key ^ (uint32_t)fontCache.kerning[i].adjust) * 16777619u;
+    }
+    return key;
+}
+
+// Initialize renderer - caches the font and its glyph metrics
 // Args: fontPath
 static int initRenderer(lua_State* L) {
     (void)L;
@@ -512,225 +1413,374 @@ static int initRenderer(lua_State* L) {
     }
 
     fontCache.fontHeight = pd->graphics->getFontHeight(fontCache.font);
-    pd->system->logToConsole("Font loaded: height=%d", fontCache.fontHeight);
+    int glyphCount = cacheGlyphMetrics();
+    fontCache.fontKey = fontMetricsKey();
+    pd->system->logToConsole("Font loaded: height=%d glyphs=%d kerning pairs=%d",
+                             fontCache.fontHeight, glyphCount, fontCache.kerningCount);
 
     pd->lua->pushBool(1);
     return 1;
 }
 
+// ============================================================================
+// Line Breaking
+// ============================================================================
 
-// Word-wrap layout algorithm
-// Returns: number of segments created, updates endX and endY
-static int layoutWords(const char* text, int startX, int startY,
-                       TextSegment* segments, int maxSegments,
-                       int* endX, int* endY,
-                       int contentWidth, int tracking) {
-    if (!text || !segments || !fontCache.font) return 0;
+// Break classes, a compact subset of UAX #14. Whitespace never reaches the
+// breaker (flowRun collapses it), so the classes only decide where text
+// between spaces may still be split.
+typedef enum {
+    BREAK_AL,  // letters, symbols: no break between them
+    BREAK_NU,  // digits: as AL, but keep a minus sign attached
+    BREAK_OP,  // opening punctuation: no break after
+    BREAK_CL,  // closing punctuation, commas, stops: no break before
+    BREAK_GL,  // no-break spaces, word joiner: no break on either side
+    BREAK_HY,  // hyphen-minus: break after, unless a number follows
+    BREAK_BA,  // dashes, soft hyphen, fixed-width spaces: break after
+    BREAK_ZW,  // zero width space: break after
+    BREAK_ID,  // ideographs, kana, hangul: break on either side
+} BreakClass;
 
-    int segmentCount = 0;
-    int x = startX;
-    int y = startY;
-    int h = fontCache.fontHeight;
+typedef struct {
+    uint32_t first, last;
+    uint8_t breakClass;
+} BreakRange;
+
+// Non-ASCII codepoints whose class isn't AL, sorted by codepoint
+static const BreakRange breakRanges[] = {
+    { 0x00A0, 0x00A0, BREAK_GL }, { 0x00AD, 0x00AD, BREAK_BA },
+    { 0x2000, 0x2006, BREAK_BA }, { 0x2007, 0x2007, BREAK_GL }, { 0x2008, 0x200A, BREAK_BA },
+    { 0x200B, 0x200B, BREAK_ZW }, { 0x2010, 0x2010, BREAK_BA }, { 0x2011, 0x2011, BREAK_GL },
+    { 0x2012, 0x2014, BREAK_BA }, { 0x2026, 0x2026, BREAK_CL }, { 0x202F, 0x202F, BREAK_GL },
+    { 0x2060, 0x2060, BREAK_GL },
+    { 0x2E80, 0x2FFF, BREAK_ID }, { 0x3000, 0x3000, BREAK_BA }, { 0x3001, 0x3002, BREAK_CL },
+    { 0x3003, 0x3007, BREAK_ID }, { 0x3008, 0x3008, BREAK_OP }, { 0x3009, 0x3009, BREAK_CL },
+    { 0x300A, 0x300A, BREAK_OP }, { 0x300B, 0x300B, BREAK_CL }, { 0x300C, 0x300C, BREAK_OP },
+    { 0x300D, 0x300D, BREAK_CL }, { 0x300E, 0x300E, BREAK_OP }, { 0x300F, 0x300F, BREAK_CL },
+    { 0x3010, 0x3010, BREAK_OP }, { 0x3011, 0x3011, BREAK_CL }, { 0x3012, 0x9FFF, BREAK_ID },
+    { 0xAC00, 0xD7A3, BREAK_ID }, { 0xF900, 0xFAFF, BREAK_ID }, { 0xFE30, 0xFE4F, BREAK_ID },
+    { 0xFF01, 0xFF01, BREAK_CL }, { 0xFF02, 0xFF07, BREAK_ID }, { 0xFF08, 0xFF08, BREAK_OP },
+    { 0xFF09, 0xFF09, BREAK_CL }, { 0xFF0A, 0xFF0B, BREAK_ID }, { 0xFF0C, 0xFF0C, BREAK_CL },
+    { 0xFF0D, 0xFF0D, BREAK_ID }, { 0xFF0E, 0xFF0E, BREAK_CL }, { 0xFF0F, 0xFF19, BREAK_ID },
+    { 0xFF1A, 0xFF1B, BREAK_CL }, { 0xFF1C, 0xFF1E, BREAK_ID }, { 0xFF1F, 0xFF1F, BREAK_CL },
+    { 0xFF20, 0xFF60, BREAK_ID },
+    { 0x20000, 0x3FFFD, BREAK_ID },
+};
+
+static BreakClass breakClass(uint32_t c) {
+    if (c < 0x80) {
+        switch (c) {
+            case '(': case '[': case '{':
+                return BREAK_OP;
+            case ')': case ']': case '}': case ',': case '.': case ':': case ';': case '!': case '?':
+                return BREAK_CL;
+            case '-':
+                return BREAK_HY;
+            default:
+                return c >= '0' && c <= '9' ? BREAK_NU : BREAK_AL;
+        }
+    }
 
-    // Get space width (without tracking - we add tracking manually)
-    int spaceWidth = pd->graphics->getTextWidth(fontCache.font, " ", 1, kUTF8Encoding, 0);
+    int lo = 0, hi = (int)(sizeof(breakRanges) / sizeof(breakRanges[0])) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (c < breakRanges[mid].first) hi = mid - 1;
+        else if (c > breakRanges[mid].last) lo = mid + 1;
+        else return (BreakClass)breakRanges[mid].breakClass;
+    }
+    return BREAK_AL;
+}
 
-    int pos = 0;
-    int len = (int)strlen(text);
+static int breakBetween(BreakClass before, BreakClass after) {
+    if (after == BREAK_CL || after == BREAK_GL || after == BREAK_HY ||
+        after == BREAK_BA || after == BREAK_ZW) return 0;
+    if (before == BREAK_OP || before == BREAK_GL) return 0;
+    if (before == BREAK_HY) return after != BREAK_NU;
+    return before == BREAK_BA || before == BREAK_ZW || before == BREAK_ID || after == BREAK_ID;
+}
+
+// Byte-parallel tests on a machine word of text
+#define BYTES_ONES (~(uintptr_t)0 / 0xFF)
+#define BYTES_HIGH (BYTES_ONES * 0x80)
+#define BYTES_BELOW(w, n) (((w) - BYTES_ONES * (n)) & ~(w) & BYTES_HIGH)  // any byte < n
+
+// Whether a word of text is all printable ASCII other than '-', i.e. holds
+// no whitespace and no break opportunity
+static int plainASCII(uintptr_t w) {
+    return !(w & BYTES_HIGH) && !BYTES_BELOW(w, 0x21) && !BYTES_BELOW(w ^ (BYTES_ONES * '-'), 1);
+}
 
-    char segment[512] = "";
-    int segX = x, segY = y;
-    int segLen = 0;
+// End of the text from pos (not whitespace) up to the next break opportunity
+// or whitespace, measured in the same pass. Runs of plain ASCII are skipped a
+// machine word at a time when the font has no kerning.
+static size_t nextBreak(const char* text, size_t len, size_t pos, int* width) {
+    int w = 0;
+    uint32_t prev = 0;
+    BreakClass prevClass = BREAK_AL;
 
     while (pos < len) {
-        if (text[pos] == ' ') {
-            // Handle space
-            if (x + spaceWidth <= contentWidth) {
-                x += spaceWidth + tracking;
-                if (segLen < 511) {
-                    segment[segLen++] = ' ';
-                    segment[segLen] = '\0';
+        int fast = fontCache.kerningCount == 0 &&
+            prevClass != BREAK_HY && prevClass != BREAK_BA && prevClass != BREAK_ZW && prevClass != BREAK_ID;
+        if (fast && len - pos >= sizeof(uintptr_t)) {
+            uintptr_t chunk;
+            memcpy(&chunk, text + pos, sizeof(chunk));
+            if (plainASCII(chunk)) {
+                for (size_t i = 0; i < sizeof(chunk); i++) {
+                    w += fontCache.asciiAdvance[(unsigned char)text[pos + i]];
                 }
+                prev = (unsigned char)text[pos + sizeof(chunk) - 1];
+                prevClass = breakClass(prev);
+                pos += sizeof(chunk);
+                continue;
             }
-            pos++;
-        } else {
-            // Find word end
-            int wordEnd = pos;
-            while (wordEnd < len && text[wordEnd] != ' ') {
-                wordEnd++;
-            }
-
-            // Extract word
-            int wordLen = wordEnd - pos;
-            char word[256];
-            if (wordLen > 255) wordLen = 255;
-            strncpy(word, text + pos, wordLen);
-            word[wordLen] = '\0';
-
-            // Get word width without tracking, then add tracking manually
-            int wordWidth = pd->graphics->getTextWidth(fontCache.font, word, wordLen, kUTF8Encoding, 0);
-
-            // Wrap if needed
-            if (x > 0 && x + wordWidth > contentWidth) {
-                // Save current segment
-                if (segLen > 0 && segmentCount < maxSegments) {
-                    strncpy(segments[segmentCount].text, segment, 511);
-                    segments[segmentCount].text[511] = '\0';
-                    segments[segmentCount].x = segX;
-                    segments[segmentCount].y = segY;
-                    segments[segmentCount].width = pd->graphics->getTextWidth(
-                        fontCache.font, segment, segLen, kUTF8Encoding, 0);
-                    segmentCount++;
-                }
+        }
 
-                // Start new line
-                y += h;
-                x = 0;
-                segment[0] = '\0';
-                segLen = 0;
-                segX = x;
-                segY = y;
-            }
+        if (isSpaceChar(text[pos])) break;
 
-            // Add word to segment (add tracking after word like Lua does)
-            x += wordWidth + tracking;
-            if (segLen + wordLen < 511) {
-                strcat(segment, word);
-                segLen += wordLen;
-            }
-            pos = wordEnd;
+        int next = (int)pos;
+        uint32_t c = decodeUTF8(text, (int)len, &next);
+        BreakClass cls = breakClass(c);
+        if (prev) {
+            if (breakBetween(prevClass, cls)) break;
+            w += kerningAdjust(prev, c);
+        } else if (cls == BREAK_HY) {
+            cls = BREAK_AL;  // a leading hyphen is a sign or a dash, not a break
         }
+
+        w += glyphAdvance(c);
+        prev = c;
+        prevClass = cls;
+        pos = (size_t)next;
     }
 
-    // Save final segment
-    if (segLen > 0 && segmentCount < maxSegments) {
-        strncpy(segments[segmentCount].text, segment, 511);
-        segments[segmentCount].text[511] = '\0';
-        segments[segmentCount].x = segX;
-        segments[segmentCount].y = segY;
-        segments[segmentCount].width = pd->graphics->getTextWidth(
-            fontCache.font, segment, segLen, kUTF8Encoding, 0);
-        segmentCount++;
+    *width = w;
+    return pos;
+}
+
+// Longest start of text no wider than maxWidth, but at least one codepoint
+static size_t fitText(const char* text, size_t len, int maxWidth, int* width) {
+    int pos = 0;
+    int w = 0;
+    uint32_t prev = 0;
+
+    while (pos < (int)len) {
+        int next = pos;
+        uint32_t c = decodeUTF8(text, (int)len, &next);
+        int advance = glyphAdvance(c) + (prev ? kerningAdjust(prev, c) : 0);
+        if (pos > 0 && w + advance > maxWidth) break;
+
+        w += advance;
+        prev = c;
+        pos = next;
     }
 
-    *endX = x;
-    *endY = y;
-    return segmentCount;
+    *width = w;
+    return (size_t)pos;
 }
 
+// ============================================================================
+// Word Index
+// ============================================================================
 
-// Pure render function - parse markdown, create page image, return links as JSON
-// Args: markdown, pageWidth, pagePadding, tracking
-// Returns: pageImage, pageHeight, linksJSON
-static int renderPage(lua_State* L) {
-    (void)L;
+// Find looks words up by their first FIND_KEY_CHARS letters, case-folded.
+// Layout records where each word starts as its text goes into the arena;
+// once the page is complete the starts are bucketed by key.
+#define FIND_KEY_CHARS 3
+#define WORD_INDEX_MAX_BUCKETS 4096
 
-    if (!fontCache.font) {
-        pd->system->logToConsole("renderPage: font not loaded");
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+// Letters and digits; punctuation, symbols and spaces separate words
+static int isWordChar(uint32_t c) {
+    if (c < 0x80) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
     }
+    if (c < 0xC0) return 0;                   // Latin-1 punctuation and NBSP
+    if (c == 0xD7 || c == 0xF7) return 0;     // multiplication and division signs
+    if (c >= 0x2000 && c <= 0x206F) return 0; // general punctuation
+    if (c >= 0x2190 && c <= 0x2BFF) return 0; // arrows, maths, boxes, shapes
+    if (c >= 0x3000 && c <= 0x303F) return 0; // CJK punctuation
+    if (c >= 0xFE30 && c <= 0xFE4F) return 0; // CJK compatibility forms
+    if (c >= 0xFF00 && c <= 0xFF0F) return 0; // fullwidth punctuation
+    return c != 0xFFFD;
+}
 
-    const char* markdown = pd->lua->getArgString(1);
-    int pageWidth = pd->lua->getArgInt(2);
-    int pagePadding = pd->lua->getArgInt(3);
-    int tracking = pd->lua->getArgInt(4);
+// Lower case for the scripts the font covers
+static uint32_t foldCase(uint32_t c) {
+    if (c < 0x80) return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    if (c >= 0xC0 && c <= 0xDE && c != 0xD7) return c + 32;
+    if (c >= 0x100 && c <= 0x177) {
+        // Latin Extended-A pairs, except for the odd run around L with stroke
+        if (c >= 0x139 && c <= 0x148) return (c & 1) ? c + 1 : c;
+        return (c & 1) ? c : c + 1;
+    }
+    if (c == 0x178) return 0xFF;
+    if (c >= 0x179 && c <= 0x17E) return (c & 1) ? c + 1 : c;
+    if (c >= 0x391 && c <= 0x3AB && c != 0x3A2) return c + 32;
+    if (c >= 0x410 && c <= 0x42F) return c + 32;
+    if (c >= 0x400 && c <= 0x40F) return c + 80;
+    return c;
+}
 
-    if (!markdown) {
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+// Codepoint of the arena character just before offset
+static uint32_t previousChar(const char* text, uint32_t offset) {
+    int start = (int)offset - 1;
+    while (start > 0 && offset - start < 4 && ((unsigned char)text[start] & 0xC0) == 0x80) {
+        start--;
+    }
+    return decodeUTF8(text, (int)offset, &start);
+}
+
+// Record the words starting in len bytes of arena text at offset. When
+// continuing a segment, a word already open at offset carries on.
+static void indexWords(PageLayout* layout, uint32_t offset, size_t len, int continuing) {
+    const char* text = layout->text;
+    int inWord = continuing && offset > 0 && isWordChar(previousChar(text, offset));
+    int end = (int)(offset + len);
+    int pos = (int)offset;
+
+    while (pos < end) {
+        int start = pos;
+        uint32_t c = (unsigned char)text[pos];
+        if (c < 0x80) {
+            pos++;
+        } else {
+            c = decodeUTF8(text, end, &pos);
+        }
+        int word = isWordChar(c);
+        if (word && !inWord && !appendWord(layout, (uint32_t)start)) return;
+        inWord = word;
     }
+}
 
-    int contentWidth = pageWidth - 2 * pagePadding;
-    int h = fontCache.fontHeight;
+// Hash of the first FIND_KEY_CHARS case-folded letters of the word at pos;
+// chars is how many letters went in
+static uint32_t wordKey(const char* text, int len, int pos, int* chars) {
+    uint32_t hash = 2166136261u;
+    int n = 0;
+
+    while (n < FIND_KEY_CHARS && pos < len) {
+        uint32_t c = decodeUTF8(text, len, &pos);
+        if (!isWordChar(c)) break;
+        c = foldCase(c);
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ (c & 0xFF)) * 16777619u;
+            c >>= 8;
+        }
+        n++;
+    }
 
-    // Parse markdown
-    size_t len = strlen(markdown);
-    cmark_node* doc = cmark_parse_document(markdown, len, CMARK_OPT_DEFAULT);
-    if (!doc) {
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+    *chars = n;
+    return hash;
+}
+
+// Bucket the page's words by key with a stable counting sort, so each
+// bucket stays in page order. Without an index find scans every word.
+static void buildWordIndex(Page* page) {
+    const PageLayout* layout = &page->layout;
+    WordIndex* index = &page->wordIndex;
+    freeWordIndex(index);
+    if (layout->wordCount == 0) return;
+
+    int bucketCount = 16;
+    while (bucketCount < WORD_INDEX_MAX_BUCKETS && bucketCount * 4 < layout->wordCount) {
+        bucketCount *= 2;
     }
 
-    // Collect all text segments for drawing
-    static TextSegment allSegments[MAX_TEXT_SEGMENTS];
-    int totalSegments = 0;
+    index->bucketStart = heapRealloc(NULL, (bucketCount + 1) * sizeof(int));
+    index->entries = heapRealloc(NULL, layout->wordCount * sizeof(uint32_t));
+    if (!index->bucketStart || !index->entries) {
+        freeWordIndex(index);
+        return;
+    }
+    memset(index->bucketStart, 0, (bucketCount + 1) * sizeof(int));
+
+    // Count per bucket, then turn the counts into bucket ends
+    int textLength = (int)layout->textLength;
+    for (int i = 0; i < layout->wordCount; i++) {
+        int chars;
+        uint32_t key = wordKey(layout->text, textLength, (int)layout->words[i], &chars);
+        index->bucketStart[key & (bucketCount - 1)]++;
+    }
+    for (int b = 1; b < bucketCount; b++) {
+        index->bucketStart[b] += index->bucketStart[b - 1];
+    }
+    index->bucketStart[bucketCount] = layout->wordCount;
 
-    // Build links JSON using encoder
-    #define MAX_LINKS_JSON 16384
-    #define MAX_SEGMENTS_PER_LINK 8
-    static char linksJson[MAX_LINKS_JSON];
-    jsonBuffer = linksJson;
-    jsonBufferPos = 0;
-    jsonBufferSize = MAX_LINKS_JSON;
+    // Place the words back to front, leaving each end at its bucket's start
+    for (int i = layout->wordCount - 1; i >= 0; i--) {
+        int chars;
+        uint32_t key = wordKey(layout->text, textLength, (int)layout->words[i], &chars);
+        index->entries[--index->bucketStart[key & (bucketCount - 1)]] = layout->words[i];
+    }
+    index->bucketCount = bucketCount;
+}
 
-    json_encoder encoder;
-    pd->json->initEncoder(&encoder, jsonWrite, NULL, 0);
-    encoder.startArray(&encoder);
+// ============================================================================
+// Markdown Layout
+// ============================================================================
 
-    // Layout state
-    int x = 0, y = 0;
-    int firstParagraph = 1;
+// Progress through a parsed markdown document, so its layout can stop
+// between nodes and carry on in a later frame. A link's segments are
+// contiguous in the layout.
+typedef struct {
+    cmark_node* doc;
+    cmark_iter* iter;
+    int inLink;
+    const char* linkUrl;
+    int linkFirstSegment;
+    int inImage;  // an image's alt text is not laid out
+} MarkdownLayout;
+
+// Lay out md's document until the deadline, continuing from the context's position
+// Returns: 1 once the whole document is laid out
+static int layoutMarkdown(RenderContext* ctx, MarkdownLayout* md, unsigned int deadline) {
+    int h = fontCache.fontHeight;
 
-    // Track current link state
-    int inLink = 0;
-    const char* linkUrl = NULL;
-    static TextSegment linkSegments[MAX_SEGMENTS_PER_LINK];
-    int linkSegmentCount = 0;
+    if (!md->iter) {
+        md->iter = cmark_iter_new(md->doc);
+        if (!md->iter) return 1;
+    }
 
     // Iterate through AST
-    cmark_iter* iter = cmark_iter_new(doc);
     cmark_event_type ev_type;
+    int steps = 0;
 
-    while ((ev_type = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
-        cmark_node* node = cmark_iter_get_node(iter);
+    while ((ev_type = cmark_iter_next(md->iter)) != CMARK_EVENT_DONE) {
+        cmark_node* node = cmark_iter_get_node(md->iter);
         cmark_node_type type = cmark_node_get_type(node);
 
         if (ev_type == CMARK_EVENT_ENTER) {
             switch (type) {
                 case CMARK_NODE_PARAGRAPH:
-                    if (!firstParagraph) {
-                        x = 0;
-                        y += h * 2;  // Paragraph break
+                    breakSegment(ctx, 0);
+                    if (!ctx->firstParagraph) {
+                        ctx->x = 0;
+                        ctx->y += h * 2;  // Paragraph break
                     }
-                    firstParagraph = 0;
+                    ctx->firstParagraph = 0;
                     break;
 
                 case CMARK_NODE_LINK:
-                    inLink = 1;
-                    linkUrl = cmark_node_get_url(node);
-                    linkSegmentCount = 0;
+                    breakSegment(ctx, 1);
+                    md->inLink = 1;
+                    md->linkUrl = cmark_node_get_url(node);
+                    md->linkFirstSegment = ctx->layout->segmentCount;
                     break;
 
+                case CMARK_NODE_IMAGE: {
+                    const char* src = cmark_node_get_url(node);
+                    char url[IMAGE_URL_SIZE];
+                    if (src && resolveURL(ctx->baseURL, src, strlen(src), url, sizeof(url))) {
+                        renderImage(ctx, url, 0, 0);
+                    }
+                    md->inImage = 1;
+                    break;
+                }
+
                 case CMARK_NODE_TEXT:
                 case CMARK_NODE_CODE: {
                     const char* nodeText = cmark_node_get_literal(node);
-                    if (nodeText) {
-                        static TextSegment tempSegments[256];
-                        int newX, newY;
-                        int count = layoutWords(nodeText, x, y, tempSegments, 256,
-                                               &newX, &newY, contentWidth, tracking);
-
-                        // Add segments to total list
-                        for (int i = 0; i < count && totalSegments < MAX_TEXT_SEGMENTS; i++) {
-                            allSegments[totalSegments++] = tempSegments[i];
-                        }
-
-                        // If in a link, also add to link segments
-                        if (inLink) {
-                            for (int i = 0; i < count && linkSegmentCount < MAX_SEGMENTS_PER_LINK; i++) {
-                                linkSegments[linkSegmentCount++] = tempSegments[i];
-                            }
-                        }
-
-                        x = newX;
-                        y = newY;
+                    if (nodeText && !md->inImage) {
+                        renderPlainText(ctx, nodeText);
                     }
                     break;
                 }
@@ -743,242 +1793,4672 @@ static int renderPage(lua_State* L) {
                     break;
             }
         } else if (ev_type == CMARK_EVENT_EXIT) {
-            if (type == CMARK_NODE_LINK && inLink) {
-                // Add link to JSON
-                if (linkSegmentCount > 0) {
-                    encoder.addArrayMember(&encoder);
-                    encoder.startTable(&encoder);
-
-                    // URL
-                    encoder.addTableMember(&encoder, "url", 3);
-                    encoder.writeString(&encoder, linkUrl ? linkUrl : "", linkUrl ? (int)strlen(linkUrl) : 0);
-
-                    // Segments array
-                    encoder.addTableMember(&encoder, "segments", 8);
-                    encoder.startArray(&encoder);
-                    for (int i = 0; i < linkSegmentCount; i++) {
-                        TextSegment* seg = &linkSegments[i];
-                        encoder.addArrayMember(&encoder);
-                        encoder.startArray(&encoder);
-                        encoder.addArrayMember(&encoder);
-                        encoder.writeInt(&encoder, seg->x);
-                        encoder.addArrayMember(&encoder);
-                        encoder.writeInt(&encoder, seg->y);
-                        encoder.addArrayMember(&encoder);
-                        encoder.writeInt(&encoder, seg->width);
-                        encoder.endArray(&encoder);
-                    }
-                    encoder.endArray(&encoder);
+            if (type == CMARK_NODE_LINK && md->inLink) {
+                breakSegment(ctx, 0);
+                appendLink(ctx->layout, md->linkUrl, md->linkFirstSegment);
+                md->inLink = 0;
+                md->linkUrl = NULL;
+            } else if (type == CMARK_NODE_IMAGE) {
+                md->inImage = 0;
+            }
+        }
 
-                    encoder.endTable(&encoder);
-                }
+        if (++steps % STEP_CHECK_INTERVAL == 0 && pastDeadline(deadline)) {
+            return 0;
+        }
+    }
+
+    cmark_iter_free(md->iter);
+    md->iter = NULL;
+
+    // Segments already on screen are never extended by later text
+    breakSegment(ctx, 0);
+    return 1;
+}
+
+// ============================================================================
+// Image Cache
+// ============================================================================
+
+// Inline images are kept decoded, already scaled to their box and dithered to
+// one bit, so drawing a tile only copies their ink. Images that failed to
+// load are remembered too, so they aren't fetched again. The cache holds at
+// most IMAGE_CACHE_ENTRIES images within IMAGE_CACHE_BUDGET bytes of ink.
+#define IMAGE_CACHE_ENTRIES 48
+#define IMAGE_CACHE_BUDGET (384 * 1024)
+
+typedef struct {
+    char* url;
+    int failed;
+    int width, height;
+    int wordsPerRow;
+    uint32_t* ink;  // rows of words, leftmost pixel in the top bit, set bits black
+    uint32_t lastUsed;
+} CachedImage;
+
+static struct {
+    CachedImage entries[IMAGE_CACHE_ENTRIES];
+    uint32_t clock;
+} imageCache;
+
+static void evictImage(CachedImage* entry) {
+    if (entry->url) heapRealloc(entry->url, 0);
+    if (entry->ink) heapRealloc(entry->ink, 0);
+    memset(entry, 0, sizeof(CachedImage));
+}
+
+static CachedImage* findImage(const char* url) {
+    for (int i = 0; i < IMAGE_CACHE_ENTRIES; i++) {
+        CachedImage* entry = &imageCache.entries[i];
+        if (entry->url && strcmp(entry->url, url) == 0) {
+            entry->lastUsed = ++imageCache.clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
 
-                inLink = 0;
-                linkUrl = NULL;
-                linkSegmentCount = 0;
+// Cache an image's ink, which the cache takes over; NULL ink records a failure
+static void storeImage(const char* url, uint32_t* ink, int width, int height) {
+    CachedImage* entry = findImage(url);
+    if (!entry) {
+        // An empty slot, or the least recently used one
+        entry = &imageCache.entries[0];
+        for (int i = 0; i < IMAGE_CACHE_ENTRIES && entry->url; i++) {
+            CachedImage* candidate = &imageCache.entries[i];
+            if (!candidate->url || candidate->lastUsed < entry->lastUsed) entry = candidate;
+        }
+    }
+    evictImage(entry);
+
+    size_t length = strlen(url);
+    entry->url = heapRealloc(NULL, length + 1);
+    if (!entry->url) {
+        if (ink) heapRealloc(ink, 0);
+        return;
+    }
+    memcpy(entry->url, url, length + 1);
+    entry->failed = ink == NULL;
+    entry->ink = ink;
+    entry->width = ink ? width : 0;
+    entry->height = ink ? height : 0;
+    entry->wordsPerRow = (entry->width + 31) / 32;
+    entry->lastUsed = ++imageCache.clock;
+
+    // Drop the oldest other images until the ink fits the budget
+    for (;;) {
+        size_t total = 0;
+        CachedImage* oldest = NULL;
+        for (int i = 0; i < IMAGE_CACHE_ENTRIES; i++) {
+            CachedImage* candidate = &imageCache.entries[i];
+            if (!candidate->ink) continue;
+            total += candidate->wordsPerRow * candidate->height * sizeof(uint32_t);
+            if (candidate != entry && (!oldest || candidate->lastUsed < oldest->lastUsed)) {
+                oldest = candidate;
             }
         }
+        if (!oldest || total <= IMAGE_CACHE_BUDGET) return;
+        evictImage(oldest);
     }
+}
 
-    // Close JSON array
-    encoder.endArray(&encoder);
-    linksJson[jsonBufferPos] = '\0';
+// ============================================================================
+// Tiled Page Rasterization
+// ============================================================================
 
-    cmark_iter_free(iter);
-    cmark_node_free(doc);
+// The shown page is drawn in fixed-height bands, rasterized from its segments
+// (text and link underlines) and images only when they come near the screen and kept in
+// a small LRU cache, so memory stays flat however long the page is. The page
+// is the only layer: scrolling just draws the bands at a different offset.
+#define TILE_HEIGHT 240
+#define TILE_CACHE_SIZE 4
 
-    // Calculate page height
-    int pageHeight = y + h + 2 * pagePadding;
-    if (pageHeight < SCREEN_HEIGHT) {
-        pageHeight = SCREEN_HEIGHT;
+typedef struct {
+    LCDBitmap* bitmap;
+    int valid;
+    int index;             // band of the page: rows [index * TILE_HEIGHT, +TILE_HEIGHT)
+    int segmentCount;      // page segments when drawn, to pick up streamed additions
+    int imageCount;        // page images when drawn
+    int complete;          // text already extended past the band when drawn
+    unsigned int lastUsed;
+} Tile;
+
+static struct {
+    Tile tiles[TILE_CACHE_SIZE];
+    int width;
+    unsigned int clock;
+    int lastTop;
+} tileCache = {0};
+
+static void invalidateTiles(void) {
+    for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+        tileCache.tiles[i].valid = 0;
     }
+}
 
-    // Create page image
-    LCDBitmap* pageImage = pd->graphics->newBitmap(pageWidth, pageHeight, kColorClear);
-    if (!pageImage) {
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+// Make page the one on screen, freeing the page it replaces
+static void showPage(Page* page) {
+    if (page == shownPage) return;
+
+    retainPage(page);
+    releasePage(shownPage);
+    shownPage = page;
+    invalidateTiles();
+
+    // Tile bitmaps are reused between pages of the same width
+    if (page && page->width != tileCache.width) {
+        for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+            if (tileCache.tiles[i].bitmap) {
+                pd->graphics->freeBitmap(tileCache.tiles[i].bitmap);
+                tileCache.tiles[i].bitmap = NULL;
+            }
+        }
+        tileCache.width = page->width;
     }
+}
 
-    // Draw all text to page image
-    pd->graphics->pushContext(pageImage);
-    pd->graphics->setFont(fontCache.font);
+// Tiles are drawn straight into their row data: glyph images and underlines
+// are cleared into the bitmap a 32-bit word at a time. Rows are stored most
+// significant byte first, so masks are byte-swapped to match a native load.
+typedef struct {
+    uint8_t* data;
+    int rowbytes;
+    int width;
+    int height;
+} TileRows;
+
+static inline uint32_t rowMask(uint32_t bits) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(bits);
+#else
+    return bits;
+#endif
+}
 
-    for (int i = 0; i < totalSegments; i++) {
-        pd->graphics->drawText(allSegments[i].text, strlen(allSegments[i].text),
-                               kUTF8Encoding,
-                               pagePadding + allSegments[i].x,
-                               pagePadding + allSegments[i].y);
-    }
+static void blitGlyph(const TileRows* rows, const uint32_t* image, int x, int y) {
+    int words = rows->rowbytes / 4;
+    int word = x >> 5;
+    int shift = x & 31;
+    if (x < 0 || word >= words) return;
 
-    pd->graphics->popContext();
+    int first = y < 0 ? -y : 0;
+    int last = y + fontCache.fontHeight > rows->height ? rows->height - y : fontCache.fontHeight;
 
-    // Return page image, height, and links JSON to Lua
-    pd->lua->pushBitmap(pageImage);
-    pd->lua->pushInt(pageHeight);
-    pd->lua->pushString(linksJson);
+    for (int i = first; i < last; i++) {
+        uint32_t ink = image[i];
+        if (!ink) continue;
 
-    return 3;
+        uint32_t* line = (uint32_t*)(rows->data + (y + i) * rows->rowbytes);
+        line[word] &= ~rowMask(ink >> shift);
+        if (shift && word + 1 < words) {
+            line[word + 1] &= ~rowMask(ink << (32 - shift));
+        }
+    }
 }
 
-// ============================================================================
-// HTML Parsing Functions (lexbor)
-// ============================================================================
+// Draw a segment's text at the positions measureText gives its glyphs
+static void blitText(const TileRows* rows, const char* text, int len, int x, int y) {
+    int pos = 0;
+    uint32_t prev = 0;
 
-// Render HTML page using site-specific renderer
-// Args: htmlString, url, pageWidth, pagePadding, tracking
-// Returns: pageImage, pageHeight, linksJSON
-static int renderHTML(lua_State* L) {
-    (void)L;
+    while (pos < len && text[pos] && x < rows->width) {
+        uint32_t c = decodeUTF8(text, len, &pos);
+        if (prev) x += kerningAdjust(prev, c);
 
-    if (!fontCache.font) {
-        pd->system->logToConsole("renderHTML: font not loaded");
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+        uint16_t image = glyphPresent(c) ? fontCache.pages[c >> 8]->image[c & 0xFF] : fontCache.missingImage;
+        if (image) {
+            blitGlyph(rows, fontCache.glyphImages + (image - 1) * fontCache.fontHeight, x, y);
+        }
+        x += glyphAdvance(c);
+        prev = c;
     }
+}
 
-    const char* html = pd->lua->getArgString(1);
-    const char* url = pd->lua->getArgString(2);
-    int pageWidth = pd->lua->getArgInt(3);
-    int pagePadding = pd->lua->getArgInt(4);
-    int tracking = pd->lua->getArgInt(5);
+// Black out width pixels of row y from x
+static void blitSpan(const TileRows* rows, int x, int y, int width) {
+    if (y < 0 || y >= rows->height) return;
 
-    if (!html || !url) {
-        pd->system->logToConsole("renderHTML: missing arguments");
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
-    }
+    int end = x + width > rows->width ? rows->width : x + width;
+    if (x < 0) x = 0;
 
-    // Find site-specific renderer
-    SiteRenderer renderer = findRenderer(url);
-    if (!renderer) {
-        pd->system->logToConsole("renderHTML: no renderer for URL: %s", url);
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+    uint32_t* line = (uint32_t*)(rows->data + y * rows->rowbytes);
+    while (x < end) {
+        int shift = x & 31;
+        int count = end - x < 32 - shift ? end - x : 32 - shift;
+        uint32_t bits = (0xFFFFFFFFu >> shift) & ~(shift + count < 32 ? 0xFFFFFFFFu >> (shift + count) : 0);
+        line[x >> 5] &= ~rowMask(bits);
+        x += count;
     }
+}
 
-    // Parse HTML
-    lxb_html_document_t* document = lxb_html_document_create();
-    if (!document) {
-        pd->system->logToConsole("renderHTML: failed to create document");
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+// Draw an image's ink with its top left corner at (x, y)
+static void blitInk(const TileRows* rows, const CachedImage* image, int x, int y) {
+    int words = rows->rowbytes / 4;
+    int shift = x & 31;
+    int first = y < 0 ? -y : 0;
+    int last = y + image->height > rows->height ? rows->height - y : image->height;
+    if (x < 0) return;
+
+    for (int i = first; i < last; i++) {
+        const uint32_t* ink = image->ink + i * image->wordsPerRow;
+        uint32_t* line = (uint32_t*)(rows->data + (y + i) * rows->rowbytes);
+        for (int w = 0, word = x >> 5; w < image->wordsPerRow && word < words; w++, word++) {
+            if (!ink[w]) continue;
+            line[word] &= ~rowMask(ink[w] >> shift);
+            if (shift && word + 1 < words) {
+                line[word + 1] &= ~rowMask(ink[w] << (32 - shift));
+            }
+        }
     }
+}
 
-    lxb_status_t status = lxb_html_document_parse(document,
-        (const lxb_char_t*)html, strlen(html));
+// Draw an image's box: its ink centred once decoded, a frame until then
+static void blitImage(const TileRows* rows, const PageLayout* layout, const PageImage* image,
+                      int x, int y) {
+    const CachedImage* cached = findImage(layout->text + image->urlOffset);
+    if (cached && cached->ink) {
+        blitInk(rows, cached, x + (image->width - cached->width) / 2,
+                y + (image->height - cached->height) / 2);
+        return;
+    }
 
-    if (status != LXB_STATUS_OK || !document->body) {
-        pd->system->logToConsole("renderHTML: failed to parse HTML");
-        lxb_html_document_destroy(document);
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+    blitSpan(rows, x, y, image->width);
+    blitSpan(rows, x, y + image->height - 1, image->width);
+    int first = y < 0 ? 0 : y + 1;
+    int last = y + image->height - 1 < rows->height ? y + image->height - 1 : rows->height;
+    for (int row = first; row < last; row++) {
+        blitSpan(rows, x, row, 1);
+        blitSpan(rows, x + image->width - 1, row, 1);
     }
+}
 
-    // Initialize render context
-    static TextSegment allSegments[MAX_TEXT_SEGMENTS];
-    static char linksJson[MAX_LINKS_JSON];
+// Draw the segments and images that fall in a band of the page into a tile
+static int rasterizeTile(Page* page, Tile* tile, int index) {
+    if (!tile->bitmap) {
+        // A width in whole words keeps every row 32-bit aligned
+        tile->bitmap = pd->graphics->newBitmap((page->width + 31) & ~31, TILE_HEIGHT, kColorWhite);
+        if (!tile->bitmap) return 0;
+    } else {
+        pd->graphics->clearBitmap(tile->bitmap, kColorWhite);
+    }
 
-    jsonBuffer = linksJson;
-    jsonBufferPos = 0;
-    jsonBufferSize = MAX_LINKS_JSON;
+    TileRows rows;
+    pd->graphics->getBitmapData(tile->bitmap, NULL, &rows.height, &rows.rowbytes, NULL, &rows.data);
+    rows.width = page->width;
 
-    json_encoder encoder;
-    pd->json->initEncoder(&encoder, jsonWrite, NULL, 0);
-    encoder.startArray(&encoder);
-
-    RenderContext ctx = {
-        .x = 0,
-        .y = 0,
-        .contentWidth = pageWidth - 2 * pagePadding,
-        .tracking = tracking,
-        .firstParagraph = 1,
-        .segments = allSegments,
-        .segmentCount = 0,
-        .maxSegments = MAX_TEXT_SEGMENTS,
-        .linkEncoder = &encoder,
-        .linkSegmentCount = 0
-    };
+    PageLayout* layout = &page->layout;
+    int top = index * TILE_HEIGHT;
+    int h = fontCache.fontHeight;
 
-    // Run site-specific renderer
-    renderer(&ctx, document);
+    // Start with the first line that reaches into the band
+    for (int i = findSegmentAtY(layout, top - page->padding - h + 1); i < layout->segmentCount; i++) {
+        TextSegment* seg = &layout->segments[i];
+        int y = page->padding + seg->y - top;
+        if (y >= TILE_HEIGHT) break;
 
-    // Close JSON array
-    encoder.endArray(&encoder);
-    linksJson[jsonBufferPos] = '\0';
+        blitText(&rows, segmentText(layout, seg), seg->length, page->padding + seg->x, y);
+    }
 
-    // Cleanup document
-    lxb_html_document_destroy(document);
+    // Underline link segments on the lines that reach into the band
+    LinkIndex* lines = &page->linkIndex;
+    int firstLine = (top - page->padding - h + 1) / h;
+    int lastLine = (top + TILE_HEIGHT - page->padding) / h;
+    if (firstLine < 0) firstLine = 0;
+    if (lastLine >= lines->lineCount) lastLine = lines->lineCount - 1;
+
+    for (int line = firstLine; line <= lastLine; line++) {
+        for (int e = lines->lineStart[line]; e < lines->lineStart[line + 1]; e++) {
+            TextSegment* seg = &layout->segments[lines->entries[e].segment];
+            blitSpan(&rows, page->padding + seg->x, page->padding + seg->y + h - 2 - top, seg->width + 1);
+        }
+    }
 
-    // Calculate page height
-    int pageHeight = ctx.y + fontCache.fontHeight + 2 * pagePadding;
-    if (pageHeight < SCREEN_HEIGHT) {
-        pageHeight = SCREEN_HEIGHT;
+    for (int i = 0; i < layout->imageCount; i++) {
+        PageImage* image = &layout->images[i];
+        int y = page->padding + image->y - top;
+        if (y >= TILE_HEIGHT) break;
+        if (y + image->height <= 0) continue;
+        blitImage(&rows, layout, image, page->padding + image->x, y);
     }
 
-    // Create page image
-    LCDBitmap* pageImage = pd->graphics->newBitmap(pageWidth, pageHeight, kColorClear);
-    if (!pageImage) {
-        pd->lua->pushNil();
-        pd->lua->pushInt(SCREEN_HEIGHT);
-        pd->lua->pushString("[]");
-        return 3;
+    tile->valid = 1;
+    tile->index = index;
+    tile->segmentCount = layout->segmentCount;
+    tile->imageCount = layout->imageCount;
+    tile->complete = layout->segmentCount > 0 &&
+        page->padding + layout->segments[layout->segmentCount - 1].y >= top + TILE_HEIGHT;
+    return 1;
+}
+
+// Find a band in the cache, rasterizing it into the least recently used slot if needed
+static Tile* getTile(Page* page, int index) {
+    Tile* slot = NULL;
+
+    for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+        Tile* tile = &tileCache.tiles[i];
+        if (tile->valid && tile->index == index) {
+            slot = tile;
+            break;
+        }
+        if (!slot || !tile->valid || (slot->valid && tile->lastUsed < slot->lastUsed)) {
+            slot = tile;
+        }
     }
 
-    // Draw all text to page image
-    pd->graphics->pushContext(pageImage);
-    pd->graphics->setFont(fontCache.font);
+    // A band at the end of a page that is still streaming may have gained text
+    int stale = slot->valid && slot->index == index && !slot->complete &&
+                (slot->segmentCount != page->layout.segmentCount ||
+                 slot->imageCount != page->layout.imageCount);
 
-    for (int i = 0; i < ctx.segmentCount; i++) {
-        pd->graphics->drawText(allSegments[i].text, strlen(allSegments[i].text),
-                               kUTF8Encoding,
-                               pagePadding + allSegments[i].x,
-                               pagePadding + allSegments[i].y);
+    if (!slot->valid || slot->index != index || stale) {
+        float start = beginPhase();
+        int drawn = rasterizeTile(page, slot, index);
+        endPhase(PHASE_RASTER, start);
+        if (!drawn) return NULL;
     }
 
-    pd->graphics->popContext();
+    slot->lastUsed = ++tileCache.clock;
+    return slot;
+}
 
-    // Return page image, height, and links JSON to Lua
-    pd->lua->pushBitmap(pageImage);
-    pd->lua->pushInt(pageHeight);
-    pd->lua->pushString(linksJson);
+// Redraw the bands showing an image, once it has been decoded
+static void invalidateImageTiles(const char* url) {
+    if (!shownPage) return;
+    PageLayout* layout = &shownPage->layout;
+
+    for (int i = 0; i < layout->imageCount; i++) {
+        PageImage* image = &layout->images[i];
+        if (strcmp(layout->text + image->urlOffset, url) != 0) continue;
+
+        int y = shownPage->padding + image->y;
+        for (int t = 0; t < TILE_CACHE_SIZE; t++) {
+            Tile* tile = &tileCache.tiles[t];
+            int top = tile->index * TILE_HEIGHT;
+            if (tile->valid && y < top + TILE_HEIGHT && y + image->height > top) {
+                tile->valid = 0;
+            }
+        }
+    }
+}
 
-    return 3;
+static int isTileCached(int index) {
+    for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+        if (tileCache.tiles[i].valid && tileCache.tiles[i].index == index) return 1;
+    }
+    return 0;
 }
 
-#ifdef _WINDLL
-__declspec(dllexport)
-#endif
-int eventHandler(PlaydateAPI* playdate, PDSystemEvent event, uint32_t arg) {
-    (void)arg;
+// ============================================================================
+// Parser Arena
+// ============================================================================
 
-    if (event == kEventInitLua) {
-        pd = playdate;
+// cmark makes many small allocations while a page is parsed. They are
+// bump-allocated from large blocks of the Playdate heap and all released in
+// one step once the parse results are no longer needed, so they don't
+// fragment the heap over a long session. Frees inside the arena are no-ops.
+// (lexbor keeps its own pools in the persistent HTML document instead.)
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
 
-        const char* err;
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;  // usable bytes after the header
+    size_t used;
+} ArenaBlock;
 
-        if (!pd->lua->addFunction(initRenderer, "cmark.initRenderer", &err)) {
-            pd->system->logToConsole("Failed to register cmark.initRenderer: %s", err);
-        }
+#define ARENA_BLOCK_HEADER ARENA_ROUND(sizeof(ArenaBlock))
 
-        if (!pd->lua->addFunction(renderPage, "cmark.render", &err)) {
-            pd->system->logToConsole("Failed to register cmark.render: %s", err);
-        }
+// Each allocation is preceded by its size, for realloc
+typedef struct {
+    size_t size;
+    size_t reserved;  // keeps allocations ARENA_ALIGN-aligned
+} AllocHeader;
 
-        if (!pd->lua->addFunction(renderHTML, "html.render", &err)) {
-            pd->system->logToConsole("Failed to register html.render: %s", err);
+static struct {
+    ArenaBlock* blocks;  // newest first; allocations come from the first
+    void* last;          // newest allocation, which can grow in place
+    size_t used;
+    size_t highWater;
+    size_t reported;
+} parserArena;
+
+static void* arenaAlloc(size_t size) {
+    size_t need = sizeof(AllocHeader) + ARENA_ROUND(size);
+    ArenaBlock* block = parserArena.blocks;
+
+    if (!block || block->used + need > block->size) {
+        size_t blockSize = need > ARENA_BLOCK_SIZE ? need : ARENA_BLOCK_SIZE;
+        block = pageRealloc(NULL, ARENA_BLOCK_HEADER + blockSize);
+        if (!block) return NULL;
+        block->next = parserArena.blocks;
+        block->size = blockSize;
+        block->used = 0;
+        parserArena.blocks = block;
+    }
+
+    AllocHeader* header = (AllocHeader*)((char*)block + ARENA_BLOCK_HEADER + block->used);
+    header->size = size;
+    block->used += need;
+
+    parserArena.used += need;
+    if (parserArena.used > parserArena.highWater) parserArena.highWater = parserArena.used;
+    parserArena.last = header + 1;
+    return header + 1;
+}
+
+static void* arenaRealloc(void* ptr, size_t size) {
+    if (!ptr) return arenaAlloc(size);
+
+    AllocHeader* header = (AllocHeader*)ptr - 1;
+    if (size <= header->size) return ptr;
+
+    // The newest allocation grows in place while its block has room
+    ArenaBlock* block = parserArena.blocks;
+    size_t grow = ARENA_ROUND(size) - ARENA_ROUND(header->size);
+    if (ptr == parserArena.last && block->used + grow <= block->size) {
+        block->used += grow;
+        header->size = size;
+        parserArena.used += grow;
+        if (parserArena.used > parserArena.highWater) parserArena.highWater = parserArena.used;
+        return ptr;
+    }
+
+    void* moved = arenaAlloc(size);
+    if (!moved) return NULL;
+    memcpy(moved, ptr, header->size);
+    return moved;
+}
+
+static void* arenaCalloc(size_t count, size_t size) {
+    if (size && count > (size_t)-1 / size) return NULL;
+    void* ptr = arenaAlloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+static void arenaFree(void* ptr) {
+    (void)ptr;
+}
+
+// Release everything in the arena, keeping one standard block for the next parse
+static void resetParserArena(void) {
+    ArenaBlock* kept = NULL;
+    ArenaBlock* block = parserArena.blocks;
+    while (block) {
+        ArenaBlock* next = block->next;
+        if (!kept && block->size == ARENA_BLOCK_SIZE) {
+            kept = block;
+            kept->next = NULL;
+            kept->used = 0;
+        } else {
+            heapRealloc(block, 0);
+        }
+        block = next;
+    }
+
+    parserArena.blocks = kept;
+    parserArena.last = NULL;
+    parserArena.used = 0;
+
+    if (parserArena.highWater > parserArena.reported) {
+        pd->system->logToConsole("Parser arena high-water: %u KB",
+                                 (unsigned)((parserArena.highWater + 1023) / 1024));
+        parserArena.reported = parserArena.highWater;
+    }
+}
+
+static cmark_mem arenaCmarkMem = { arenaCalloc, arenaRealloc, arenaFree };
+
+// ============================================================================
+// HTML Engine
+// ============================================================================
+
+// One lexbor document is kept for the session and cleaned between pages, so
+// its tag and namespace tables, parser and memory pools are set up once.
+// Cleaning keeps the pools' first chunks warm; if lexbor still holds more
+// than HTML_ENGINE_POOL_CAP afterwards, the document is rebuilt instead.
+#define HTML_ENGINE_POOL_CAP (512 * 1024)
+
+static struct {
+    lxb_html_document_t* document;
+    size_t heapUsed;  // bytes lexbor has allocated and not freed
+} htmlEngine;
+
+// lexbor allocates through these hooks; each block carries its size so the
+// engine's footprint is known
+static void* lexborMalloc(size_t size) {
+    AllocHeader* header = pageRealloc(NULL, sizeof(AllocHeader) + size);
+    if (!header) return NULL;
+    header->size = size;
+    htmlEngine.heapUsed += size;
+    return header + 1;
+}
+
+static void lexborFree(void* ptr) {
+    if (!ptr) return;
+    AllocHeader* header = (AllocHeader*)ptr - 1;
+    htmlEngine.heapUsed -= header->size;
+    heapRealloc(header, 0);
+}
+
+static void* lexborRealloc(void* ptr, size_t size) {
+    if (!ptr) return lexborMalloc(size);
+    if (size == 0) {
+        lexborFree(ptr);
+        return NULL;
+    }
+
+    AllocHeader* header = (AllocHeader*)ptr - 1;
+    size_t oldSize = header->size;
+    header = pageRealloc(header, sizeof(AllocHeader) + size);
+    if (!header) return NULL;
+    header->size = size;
+    htmlEngine.heapUsed += size - oldSize;
+    return header + 1;
+}
+
+static void* lexborCalloc(size_t count, size_t size) {
+    if (size && count > (size_t)-1 / size) return NULL;
+    void* ptr = lexborMalloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+// Returns: the engine's document, empty and ready to parse, or NULL
+static lxb_html_document_t* acquireHTMLDocument(void) {
+    if (!htmlEngine.document) {
+        htmlEngine.document = lxb_html_document_create();
+    }
+    return htmlEngine.document;
+}
+
+// Drop the page parsed into the engine's document
+static void releaseHTMLDocument(void) {
+    if (!htmlEngine.document) return;
+
+    lxb_html_document_clean(htmlEngine.document);
+    if (htmlEngine.heapUsed > HTML_ENGINE_POOL_CAP) {
+        htmlEngine.document = lxb_html_document_destroy(htmlEngine.document);
+    }
+}
+
+// ============================================================================
+// Response Cache
+// ============================================================================
+
+// Page bodies are kept in the Data folder, keyed by URL, so back navigation,
+// revisits and offline mode load from flash. The index records each body's
+// URL, HTTP validators and times; once the bodies and their saved layouts
+// add up to more than CACHE_MAX_BYTES the least recently used are evicted. A body is written
+// while its stream is fed and only enters the index once the page renders.
+#define CACHE_DIR "cache"
+#define CACHE_INDEX CACHE_DIR "/index"
+#define CACHE_PARTIAL CACHE_DIR "/partial"
+#define CACHE_MAX_BYTES (4 * 1024 * 1024)
+#define CACHE_VALIDATOR_SIZE 96
+#define CACHE_URL_SIZE 384
+
+typedef struct {
+    uint32_t hash;    // of the URL; names the body file
+    uint32_t size;    // of the body and its saved layout
+    uint32_t stored;  // seconds since epoch
+    uint32_t used;
+    char etag[CACHE_VALIDATOR_SIZE];
+    char lastModified[CACHE_VALIDATOR_SIZE];
+    char url[CACHE_URL_SIZE];
+} CacheEntry;
+
+static struct {
+    int loaded;
+    CacheEntry* entries;
+    int count;
+    int capacity;
+    uint32_t totalSize;
+
+    // Body being written for the current stream
+    SDFile* partial;
+    int partialFailed;
+    CacheEntry pending;
+} responseCache;
+
+static uint32_t hashURL(const char* url) {
+    uint32_t hash = 2166136261u;
+    while (*url) {
+        hash ^= (uint8_t)*url++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void cacheBodyPath(char* path, size_t size, uint32_t hash) {
+    snprintf(path, size, CACHE_DIR "/%08x", (unsigned)hash);
+}
+
+static void cacheLayoutPath(char* path, size_t size, uint32_t hash) {
+    snprintf(path, size, CACHE_DIR "/%08x.page", (unsigned)hash);
+}
+
+// Copy a header value or URL into a fixed field; values that don't fit or
+// would break the index line are not stored
+static int copyCacheField(char* field, size_t size, const char* value) {
+    field[0] = '\0';
+    if (!value) return 1;
+
+    size_t len = strlen(value);
+    if (len >= size || strpbrk(value, "\t\r\n")) return 0;
+    memcpy(field, value, len + 1);
+    return 1;
+}
+
+static CacheEntry* addCacheEntry(void) {
+    if (responseCache.count == responseCache.capacity) {
+        int capacity = responseCache.capacity ? responseCache.capacity * 2 : 32;
+        CacheEntry* entries = heapRealloc(responseCache.entries,
+                                                  capacity * sizeof(CacheEntry));
+        if (!entries) return NULL;
+        responseCache.entries = entries;
+        responseCache.capacity = capacity;
+    }
+    return &responseCache.entries[responseCache.count++];
+}
+
+// Index lines: "hash size stored used<TAB>etag<TAB>lastModified<TAB>url"
+static void parseCacheIndexLine(char* line) {
+    char* fields[4];
+    fields[0] = line;
+    for (int i = 1; i < 4; i++) {
+        fields[i] = strchr(fields[i - 1], '\t');
+        if (!fields[i]) return;
+        *fields[i]++ = '\0';
+    }
+
+    CacheEntry entry;
+    unsigned hash, size, stored, used;
+    if (sscanf(fields[0], "%x %u %u %u", &hash, &size, &stored, &used) != 4) return;
+    if (!copyCacheField(entry.etag, sizeof(entry.etag), fields[1]) ||
+        !copyCacheField(entry.lastModified, sizeof(entry.lastModified), fields[2]) ||
+        !copyCacheField(entry.url, sizeof(entry.url), fields[3])) {
+        return;
+    }
+    entry.hash = hash;
+    entry.size = size;
+    entry.stored = stored;
+    entry.used = used;
+
+    CacheEntry* slot = addCacheEntry();
+    if (slot) {
+        *slot = entry;
+        responseCache.totalSize += entry.size;
+    }
+}
+
+static void loadCacheIndex(void) {
+    if (responseCache.loaded) return;
+    responseCache.loaded = 1;
+
+    FileStat stat;
+    if (pd->file->stat(CACHE_INDEX, &stat) != 0 || stat.size == 0) return;
+
+    char* buffer = heapRealloc(NULL, stat.size + 1);
+    if (!buffer) return;
+
+    SDFile* file = pd->file->open(CACHE_INDEX, kFileReadData);
+    int length = file ? pd->file->read(file, buffer, stat.size) : -1;
+    if (file) pd->file->close(file);
+
+    if (length > 0) {
+        buffer[length] = '\0';
+        char* line = buffer;
+        while (*line) {
+            char* newline = strchr(line, '\n');
+            if (newline) *newline = '\0';
+            parseCacheIndexLine(line);
+            if (!newline) break;
+            line = newline + 1;
+        }
+    }
+    heapRealloc(buffer, 0);
+}
+
+static void saveCacheIndex(void) {
+    SDFile* file = pd->file->open(CACHE_INDEX, kFileWrite);
+    if (!file) {
+        pd->system->logToConsole("Cache: can't write index: %s", pd->file->geterr());
+        return;
+    }
+
+    for (int i = 0; i < responseCache.count; i++) {
+        CacheEntry* entry = &responseCache.entries[i];
+        char line[CACHE_URL_SIZE + 2 * CACHE_VALIDATOR_SIZE + 64];
+        int length = snprintf(line, sizeof(line), "%08x %u %u %u\t%s\t%s\t%s\n",
+                              (unsigned)entry->hash, (unsigned)entry->size,
+                              (unsigned)entry->stored, (unsigned)entry->used,
+                              entry->etag, entry->lastModified, entry->url);
+        pd->file->write(file, line, length);
+    }
+    pd->file->close(file);
+}
+
+static int findCacheEntry(const char* url) {
+    uint32_t hash = hashURL(url);
+    for (int i = 0; i < responseCache.count; i++) {
+        if (responseCache.entries[i].hash == hash &&
+            strcmp(responseCache.entries[i].url, url) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void removeCacheEntry(int i) {
+    CacheEntry* entry = &responseCache.entries[i];
+    char path[32];
+    cacheBodyPath(path, sizeof(path), entry->hash);
+    pd->file->unlink(path, 0);
+    cacheLayoutPath(path, sizeof(path), entry->hash);
+    pd->file->unlink(path, 0);
+
+    responseCache.totalSize -= entry->size;
+    *entry = responseCache.entries[--responseCache.count];
+}
+
+// Evict least recently used bodies until `size` more bytes fit
+static void makeCacheRoom(uint32_t size) {
+    while (responseCache.count > 0 && responseCache.totalSize + size > CACHE_MAX_BYTES) {
+        int oldest = 0;
+        for (int i = 1; i < responseCache.count; i++) {
+            if (responseCache.entries[i].used < responseCache.entries[oldest].used) oldest = i;
+        }
+        removeCacheEntry(oldest);
+    }
+}
+
+static void abortCacheStore(void) {
+    if (!responseCache.partial) return;
+    pd->file->close(responseCache.partial);
+    pd->file->unlink(CACHE_PARTIAL, 0);
+    responseCache.partial = NULL;
+}
+
+// Start writing the body of url as it is fed to the current stream
+// Returns: 0 if it can't be cached
+static int beginCacheStore(const char* url, const char* etag, const char* lastModified) {
+    abortCacheStore();
+    loadCacheIndex();
+
+    CacheEntry* pending = &responseCache.pending;
+    if (!copyCacheField(pending->url, sizeof(pending->url), url)) return 0;
+    if (!copyCacheField(pending->etag, sizeof(pending->etag), etag) ||
+        !copyCacheField(pending->lastModified, sizeof(pending->lastModified), lastModified)) {
+        // Still cached, just never revalidated
+        pending->etag[0] = '\0';
+        pending->lastModified[0] = '\0';
+    }
+    pending->hash = hashURL(url);
+    pending->size = 0;
+
+    pd->file->mkdir(CACHE_DIR);
+    responseCache.partial = pd->file->open(CACHE_PARTIAL, kFileWrite);
+    responseCache.partialFailed = 0;
+    return responseCache.partial != NULL;
+}
+
+static void cacheStoreChunk(const char* data, size_t len) {
+    if (!responseCache.partial || responseCache.partialFailed) return;
+
+    responseCache.pending.size += (uint32_t)len;
+    if (responseCache.pending.size > CACHE_MAX_BYTES / 2 ||
+        pd->file->write(responseCache.partial, data, (unsigned int)len) != (int)len) {
+        responseCache.partialFailed = 1;
+    }
+}
+
+// The page rendered: move its body into the cache
+static void commitCacheStore(void) {
+    if (!responseCache.partial) return;
+    if (responseCache.partialFailed) {
+        abortCacheStore();
+        return;
+    }
+
+    pd->file->close(responseCache.partial);
+    responseCache.partial = NULL;
+
+    CacheEntry* pending = &responseCache.pending;
+    int existing = findCacheEntry(pending->url);
+    if (existing >= 0) removeCacheEntry(existing);
+    makeCacheRoom(pending->size);
+
+    char path[32];
+    cacheBodyPath(path, sizeof(path), pending->hash);
+    CacheEntry* entry = addCacheEntry();
+    if (!entry || pd->file->rename(CACHE_PARTIAL, path) != 0) {
+        if (entry) responseCache.count--;
+        pd->file->unlink(CACHE_PARTIAL, 0);
+        return;
+    }
+
+    pending->stored = pending->used = pd->system->getSecondsSinceEpoch(NULL);
+    *entry = *pending;
+    responseCache.totalSize += entry->size;
+    saveCacheIndex();
+}
+
+// ============================================================================
+// Content Decoding
+// ============================================================================
+
+// Bodies sent with Content-Encoding gzip or deflate are inflated here as the
+// chunks arrive, before they reach the parser. Output goes through a fixed
+// 32 KB window (the most a deflate match can reach back) and is handed to
+// the sink each time the window fills and at the end of every chunk. Input
+// that stops partway through a header or symbol is kept until the next chunk,
+// and decoding picks up from the start of that unit.
+#define INFLATE_WINDOW_SIZE 32768
+#define INFLATE_MAX_BITS 15
+
+typedef enum {
+    CODING_IDENTITY,
+    CODING_GZIP,
+    CODING_DEFLATE
+} ContentCoding;
+
+typedef enum {
+    INFLATE_HEADER,        // gzip or zlib header
+    INFLATE_BLOCK,         // deflate block header
+    INFLATE_STORED,        // bytes of a stored block
+    INFLATE_CODES,         // symbols of a Huffman-coded block
+    INFLATE_TRAILER,       // checksum and length
+    INFLATE_END
+} InflateState;
+
+// Canonical Huffman code: how many codes of each length, and the symbols in
+// code order
+typedef struct {
+    uint16_t counts[INFLATE_MAX_BITS + 1];
+    uint16_t symbols[288];
+} Huffman;
+
+typedef void (*InflateSink)(const char* data, size_t len);
+
+typedef struct {
+    ContentCoding coding;
+    InflateState state;
+    InflateSink sink;
+    int failed;
+    int zlib;              // deflate with a zlib wrapper, as RFC 9110 asks for
+    int lastBlock;
+
+    // Input carried over from the previous chunk
+    unsigned char* input;
+    size_t inputLength;
+    size_t inputCapacity;
+    size_t inputPos;
+    uint32_t bitBuffer;
+    int bitCount;
+
+    size_t storedRemaining;
+    Huffman lengths;
+    Huffman distances;
+
+    unsigned char* window;
+    size_t windowPos;
+    size_t flushedPos;
+    uint32_t totalOut;     // mod 2^32, as in the gzip trailer
+    uint32_t check;        // CRC-32 (gzip) or Adler-32 (zlib) of the output
+} Inflater;
+
+// Decodes the body of the page being streamed
+static Inflater bodyInflater = {0};
+
+static uint32_t crcTable[256];
+
+static uint32_t updateCRC32(uint32_t crc, const unsigned char* data, size_t len) {
+    if (!crcTable[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crcTable[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t updateAdler32(uint32_t adler, const unsigned char* data, size_t len) {
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (len > 0) {
+        // 5552 bytes is the most that can be summed before b overflows
+        size_t run = len < 5552 ? len : 5552;
+        len -= run;
+        while (run--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+// Hand the output since the last flush to the sink
+static void flushInflateWindow(Inflater* inf) {
+    size_t len = inf->windowPos - inf->flushedPos;
+    if (len == 0) return;
+
+    const unsigned char* data = inf->window + inf->flushedPos;
+    if (inf->coding == CODING_GZIP) {
+        inf->check = updateCRC32(inf->check, data, len);
+    } else if (inf->zlib) {
+        inf->check = updateAdler32(inf->check, data, len);
+    }
+    inf->sink((const char*)data, len);
+
+    inf->flushedPos = inf->windowPos;
+    if (inf->windowPos == INFLATE_WINDOW_SIZE) {
+        inf->windowPos = 0;
+        inf->flushedPos = 0;
+    }
+}
+
+static void putInflatedByte(Inflater* inf, unsigned char c) {
+    inf->window[inf->windowPos++] = c;
+    inf->totalOut++;
+    if (inf->windowPos == INFLATE_WINDOW_SIZE) {
+        flushInflateWindow(inf);
+    }
+}
+
+// Take n bits (n <= 16), least significant first
+// Returns: 0 if the input runs out first
+static int pullBits(Inflater* inf, int n, uint32_t* out) {
+    while (inf->bitCount < n) {
+        if (inf->inputPos == inf->inputLength) return 0;
+        inf->bitBuffer |= (uint32_t)inf->input[inf->inputPos++] << inf->bitCount;
+        inf->bitCount += 8;
+    }
+    *out = inf->bitBuffer & ((1u << n) - 1);
+    inf->bitBuffer >>= n;
+    inf->bitCount -= n;
+    return 1;
+}
+
+// Drop the rest of the current byte
+static void alignToByte(Inflater* inf) {
+    inf->bitBuffer >>= inf->bitCount & 7;
+    inf->bitCount -= inf->bitCount & 7;
+}
+
+// Build a canonical code from a code length per symbol
+// Returns: 0 if the lengths oversubscribe the code
+static int buildHuffman(Huffman* h, const uint8_t* lengths, int count) {
+    uint16_t offsets[INFLATE_MAX_BITS + 1];
+
+    memset(h->counts, 0, sizeof(h->counts));
+    for (int i = 0; i < count; i++) h->counts[lengths[i]]++;
+    h->counts[0] = 0;
+
+    int left = 1;
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+        left = (left << 1) - h->counts[len];
+        if (left < 0) return 0;
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < INFLATE_MAX_BITS; len++) {
+        offsets[len + 1] = offsets[len] + h->counts[len];
+    }
+    for (int i = 0; i < count; i++) {
+        if (lengths[i]) h->symbols[offsets[lengths[i]]++] = i;
+    }
+    return 1;
+}
+
+// Decode one symbol a bit at a time
+// Returns: 1 with *symbol set, 0 if the input runs out, -1 for an unused code
+static int decodeSymbol(Inflater* inf, const Huffman* h, int* symbol) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+        uint32_t bit;
+        if (!pullBits(inf, 1, &bit)) return 0;
+        code |= bit;
+
+        int count = h->counts[len];
+        if (code - first < count) {
+            *symbol = h->symbols[index + code - first];
+            return 1;
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static void useFixedCodes(Inflater* inf) {
+    uint8_t lengths[288];
+    int i = 0;
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < 288; i++) lengths[i] = 8;
+    buildHuffman(&inf->lengths, lengths, 288);
+
+    for (i = 0; i < 30; i++) lengths[i] = 5;
+    buildHuffman(&inf->distances, lengths, 30);
+}
+
+// Read the code length tables at the start of a dynamic block
+// Returns: 1, 0 if the input runs out, -1 if the tables are corrupt
+static int readDynamicCodes(Inflater* inf) {
+    static const uint8_t order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    uint8_t lengths[320];
+    uint32_t nlen, ndist, ncode, bits;
+
+    if (!pullBits(inf, 5, &nlen) || !pullBits(inf, 5, &ndist) || !pullBits(inf, 4, &ncode)) return 0;
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    if (nlen > 286 || ndist > 30) return -1;
+
+    memset(lengths, 0, 19);
+    for (uint32_t i = 0; i < ncode; i++) {
+        if (!pullBits(inf, 3, &bits)) return 0;
+        lengths[order[i]] = bits;
+    }
+    Huffman lengthCode;
+    if (!buildHuffman(&lengthCode, lengths, 19)) return -1;
+
+    uint32_t i = 0;
+    while (i < nlen + ndist) {
+        int symbol;
+        int result = decodeSymbol(inf, &lengthCode, &symbol);
+        if (result <= 0) return result;
+
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+
+        uint8_t value = 0;
+        uint32_t repeat;
+        if (symbol == 16) {
+            if (i == 0) return -1;
+            value = lengths[i - 1];
+            if (!pullBits(inf, 2, &repeat)) return 0;
+            repeat += 3;
+        } else if (symbol == 17) {
+            if (!pullBits(inf, 3, &repeat)) return 0;
+            repeat += 3;
+        } else {
+            if (!pullBits(inf, 7, &repeat)) return 0;
+            repeat += 11;
+        }
+        if (i + repeat > nlen + ndist) return -1;
+        while (repeat--) lengths[i++] = value;
+    }
+
+    if (lengths[256] == 0) return -1;
+    if (!buildHuffman(&inf->lengths, lengths, nlen) ||
+        !buildHuffman(&inf->distances, lengths + nlen, ndist)) {
+        return -1;
+    }
+    return 1;
+}
+
+// Decode one literal, end of block, or length/distance pair
+// Returns: 1, 0 if the input runs out, -1 if the data is corrupt
+static int inflateSymbol(Inflater* inf) {
+    static const uint16_t lengthBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const uint8_t lengthExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    static const uint16_t distanceBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+        8193, 12289, 16385, 24577
+    };
+    static const uint8_t distanceExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    int symbol;
+    int result = decodeSymbol(inf, &inf->lengths, &symbol);
+    if (result <= 0) return result;
+
+    if (symbol < 256) {
+        putInflatedByte(inf, symbol);
+        return 1;
+    }
+    if (symbol == 256) {
+        inf->state = inf->lastBlock ? INFLATE_TRAILER : INFLATE_BLOCK;
+        return 1;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29) return -1;
+    uint32_t extra, length, distance;
+    if (!pullBits(inf, lengthExtra[symbol], &extra)) return 0;
+    length = lengthBase[symbol] + extra;
+
+    result = decodeSymbol(inf, &inf->distances, &symbol);
+    if (result <= 0) return result;
+    if (symbol >= 30) return -1;
+    if (!pullBits(inf, distanceExtra[symbol], &extra)) return 0;
+    distance = distanceBase[symbol] + extra;
+
+    // The window only starts wrapping once it has been filled
+    if (distance > inf->totalOut && inf->totalOut < INFLATE_WINDOW_SIZE) return -1;
+
+    size_t from = (inf->windowPos + INFLATE_WINDOW_SIZE - distance) % INFLATE_WINDOW_SIZE;
+    while (length--) {
+        putInflatedByte(inf, inf->window[from]);
+        if (++from == INFLATE_WINDOW_SIZE) from = 0;
+    }
+    return 1;
+}
+
+// Read a gzip header (RFC 1952) or zlib header (RFC 1950); a deflate body
+// without the zlib wrapper, as some servers send, is taken as raw deflate
+// Returns: 1, 0 if the input runs out, -1 if the header is not valid
+static int readInflateHeader(Inflater* inf) {
+    uint32_t b0, b1, flags, skip;
+
+    if (inf->coding == CODING_DEFLATE) {
+        if (!pullBits(inf, 8, &b0) || !pullBits(inf, 8, &b1)) return 0;
+        inf->zlib = (b0 & 0x0F) == 8 && ((b0 << 8) | b1) % 31 == 0;
+        if (!inf->zlib) {
+            // Not a zlib header: give the bytes back to the deflate decoder
+            inf->inputPos -= 2;
+            inf->bitBuffer = 0;
+            inf->bitCount = 0;
+            return 1;
+        }
+        if (b1 & 0x20) return -1;  // preset dictionary
+        inf->check = 1;
+        return 1;
+    }
+
+    if (!pullBits(inf, 8, &b0) || !pullBits(inf, 8, &b1) || !pullBits(inf, 8, &skip) ||
+        !pullBits(inf, 8, &flags)) return 0;
+    if (b0 != 0x1F || b1 != 0x8B || skip != 8) return -1;
+    for (int i = 0; i < 6; i++) {
+        if (!pullBits(inf, 8, &skip)) return 0;  // mtime, xfl, os
+    }
+
+    if (flags & 0x04) {
+        // FEXTRA
+        if (!pullBits(inf, 16, &skip)) return 0;
+        while (skip--) {
+            if (!pullBits(inf, 8, &b0)) return 0;
+        }
+    }
+    for (uint32_t flag = 0x08; flag <= 0x10; flag <<= 1) {
+        // FNAME and FCOMMENT are zero-terminated
+        if (!(flags & flag)) continue;
+        do {
+            if (!pullBits(inf, 8, &b0)) return 0;
+        } while (b0 != 0);
+    }
+    if (flags & 0x02) {
+        if (!pullBits(inf, 16, &skip)) return 0;  // FHCRC
+    }
+
+    inf->check = 0;
+    inf->totalOut = 0;
+    return 1;
+}
+
+// Returns: 1 if the trailer matches the output, 0 if the input runs out, -1 if not
+static int readInflateTrailer(Inflater* inf) {
+    uint32_t lo, hi;
+    alignToByte(inf);
+
+    if (inf->coding == CODING_GZIP) {
+        uint32_t crc, size;
+        if (!pullBits(inf, 16, &lo) || !pullBits(inf, 16, &hi)) return 0;
+        crc = lo | (hi << 16);
+        if (!pullBits(inf, 16, &lo) || !pullBits(inf, 16, &hi)) return 0;
+        size = lo | (hi << 16);
+        return crc == inf->check && size == inf->totalOut ? 1 : -1;
+    }
+
+    if (!inf->zlib) return 1;
+
+    // Adler-32 is stored big-endian
+    uint32_t adler = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!pullBits(inf, 8, &lo)) return 0;
+        adler = (adler << 8) | lo;
+    }
+    return adler == inf->check ? 1 : -1;
+}
+
+// Run the decoder over the buffered input, one unit at a time; a unit that
+// runs out of input is rolled back and retried when more arrives
+// Returns: 0 if the data is corrupt
+static int runInflater(Inflater* inf) {
+    for (;;) {
+        size_t pos = inf->inputPos;
+        uint32_t bitBuffer = inf->bitBuffer;
+        int bitCount = inf->bitCount;
+        int result = 1;
+        uint32_t bits;
+
+        switch (inf->state) {
+            case INFLATE_HEADER:
+                result = readInflateHeader(inf);
+                if (result > 0) inf->state = INFLATE_BLOCK;
+                break;
+
+            case INFLATE_BLOCK:
+                if (!pullBits(inf, 3, &bits)) {
+                    result = 0;
+                    break;
+                }
+                inf->lastBlock = bits & 1;
+                if ((bits >> 1) == 0) {
+                    uint32_t len, nlen;
+                    alignToByte(inf);
+                    if (!pullBits(inf, 16, &len) || !pullBits(inf, 16, &nlen)) {
+                        result = 0;
+                    } else if (len != (~nlen & 0xFFFF)) {
+                        result = -1;
+                    } else {
+                        inf->storedRemaining = len;
+                        inf->state = INFLATE_STORED;
+                    }
+                } else if ((bits >> 1) == 1) {
+                    useFixedCodes(inf);
+                    inf->state = INFLATE_CODES;
+                } else if ((bits >> 1) == 2) {
+                    result = readDynamicCodes(inf);
+                    if (result > 0) inf->state = INFLATE_CODES;
+                } else {
+                    result = -1;
+                }
+                break;
+
+            case INFLATE_STORED:
+                if (inf->storedRemaining == 0) {
+                    inf->state = inf->lastBlock ? INFLATE_TRAILER : INFLATE_BLOCK;
+                } else if (pullBits(inf, 8, &bits)) {
+                    putInflatedByte(inf, bits);
+                    inf->storedRemaining--;
+                } else {
+                    result = 0;
+                }
+                break;
+
+            case INFLATE_CODES:
+                result = inflateSymbol(inf);
+                break;
+
+            case INFLATE_TRAILER:
+                flushInflateWindow(inf);
+                result = readInflateTrailer(inf);
+                if (result > 0) inf->state = INFLATE_END;
+                break;
+
+            case INFLATE_END:
+                // gzip allows several members back to back
+                alignToByte(inf);
+                if (inf->coding != CODING_GZIP || inf->bitCount > 0 ||
+                    inf->inputPos == inf->inputLength) {
+                    return 1;
+                }
+                inf->state = INFLATE_HEADER;
+                break;
+        }
+
+        if (result < 0) return 0;
+        if (result == 0) {
+            inf->inputPos = pos;
+            inf->bitBuffer = bitBuffer;
+            inf->bitCount = bitCount;
+            return 1;
+        }
+    }
+}
+
+static void endInflate(Inflater* inf) {
+    if (inf->input) heapRealloc(inf->input, 0);
+    if (inf->window) heapRealloc(inf->window, 0);
+    memset(inf, 0, sizeof(*inf));
+}
+
+// Start decoding a body sent with the given Content-Encoding
+// Returns: 0 if the coding isn't supported or the window can't be allocated
+static int beginInflate(Inflater* inf, const char* encoding, InflateSink sink) {
+    endInflate(inf);
+
+    if (strcasecmp(encoding, "gzip") == 0 || strcasecmp(encoding, "x-gzip") == 0) {
+        inf->coding = CODING_GZIP;
+    } else if (strcasecmp(encoding, "deflate") == 0) {
+        inf->coding = CODING_DEFLATE;
+    } else {
+        return strcasecmp(encoding, "identity") == 0;
+    }
+
+    inf->window = pageRealloc(NULL, INFLATE_WINDOW_SIZE);
+    if (!inf->window) {
+        inf->coding = CODING_IDENTITY;
+        return 0;
+    }
+    inf->sink = sink;
+    inf->state = INFLATE_HEADER;
+    return 1;
+}
+
+// Decode the next chunk of the body into the sink
+// Returns: 0 if the data is corrupt
+static int inflateChunk(Inflater* inf, const char* data, size_t len) {
+    if (inf->failed) return 0;
+
+    // Keep only the input not yet decoded, then add the chunk
+    size_t kept = inf->inputLength - inf->inputPos;
+    if (kept + len > inf->inputCapacity) {
+        size_t capacity = inf->inputCapacity ? inf->inputCapacity : 4096;
+        while (kept + len > capacity) capacity *= 2;
+        unsigned char* input = pageRealloc(inf->input, capacity);
+        if (!input) {
+            inf->failed = 1;
+            return 0;
+        }
+        inf->input = input;
+        inf->inputCapacity = capacity;
+    }
+    memmove(inf->input, inf->input + inf->inputPos, kept);
+    memcpy(inf->input + kept, data, len);
+    inf->inputLength = kept + len;
+    inf->inputPos = 0;
+
+    if (!runInflater(inf)) {
+        pd->system->logToConsole("inflate: corrupt %s data",
+                                 inf->coding == CODING_GZIP ? "gzip" : "deflate");
+        inf->failed = 1;
+    }
+    flushInflateWindow(inf);
+    return !inf->failed;
+}
+
+// Returns: 1 if the body ended cleanly, with its checksum verified
+static int inflateComplete(Inflater* inf) {
+    return !inf->failed && inf->state == INFLATE_END;
+}
+
+// ============================================================================
+// Image Decoding
+// ============================================================================
+
+// Inline images are decoded one at a time as their bytes arrive, straight to
+// the size of their box: source rows are box-filtered down as they are
+// decoded, and each output row is dithered to one bit once it is complete,
+// so an image is never held at full size (bar interlaced GIFs). PNG, GIF
+// (its first frame) and baseline JPEG (luminance only) are read. As in the inflater, a unit of
+// input that hasn't fully arrived is rolled back and retried with more.
+#define IMAGE_MAX_DIMENSION 8192
+
+typedef enum {
+    IMAGE_UNKNOWN,
+    IMAGE_PNG,
+    IMAGE_GIF,
+    IMAGE_JPEG
+} ImageFormat;
+
+// Scales gray source rows down to the output size and dithers them to ink
+typedef struct {
+    int srcWidth, srcHeight;
+    int width, height;   // the source fitted to the box, never enlarged
+    int srcRow;          // source rows taken so far
+    int outRow;          // output row being summed
+    uint16_t* columnOf;  // output column of each source column
+    uint32_t* sums;      // gray summed into each column of the output row
+    uint32_t* counts;
+    int16_t* error[3];   // Atkinson error for this row and the next two
+    uint32_t* ink;
+    int wordsPerRow;
+} ImageScaler;
+
+typedef enum {
+    PNG_SIGNATURE,
+    PNG_CHUNK,   // chunk length and type, and the whole chunk for small ones
+    PNG_DATA,    // IDAT bytes, fed to the inflater
+    PNG_SKIP     // the rest of a chunk we don't use, and its CRC
+} PngState;
+
+typedef struct {
+    PngState state;
+    uint32_t remaining;
+    int bitDepth;
+    int colorType;
+    int channels;
+    size_t stride;      // bytes in a row, without its filter byte
+    int pixelBytes;     // distance the filters look back
+    uint8_t* rows;      // the previous row and the one being inflated, each after its filter byte
+    size_t rowFill;
+    int badFilter;
+    uint8_t paletteGray[256];
+    uint8_t paletteAlpha[256];
+    int32_t key[3];     // tRNS sample values drawn as background, or -1
+    Inflater inflater;
+} PngDecoder;
+
+typedef enum {
+    GIF_HEADER,
+    GIF_BLOCK,
+    GIF_SUBBLOCKS,  // data sub-blocks of an extension, skipped
+    GIF_IMAGE,
+    GIF_DATA        // LZW data sub-blocks of the first frame
+} GifState;
+
+#define GIF_MAX_CODES 4096
+#define GIF_MAX_INTERLACED (1024 * 1024)  // pixels of an interlaced frame, which is held whole
+
+typedef struct {
+    GifState state;
+    uint8_t paletteGray[256];
+    int transparent;      // palette index drawn as background, or -1
+    int graphicControl;   // the sub-blocks being skipped are a graphic control extension
+    int left, top, frameWidth, frameHeight;
+    int x, y;             // next pixel of the frame, y counting rows in the order they come
+    int row, pass;        // the frame row y is, which differs for interlaced frames
+    uint8_t* frame;       // an interlaced frame's gray, passed on once complete
+
+    uint16_t* prefix;
+    uint8_t* suffix;
+    uint8_t* stack;
+    int minCodeSize;
+    int codeSize;
+    int nextCode;
+    int prevCode;         // -1 straight after a clear code
+    int firstChar;
+    uint32_t bitBuffer;
+    int bitCount;
+} GifDecoder;
+
+typedef enum {
+    JPEG_MARKER,
+    JPEG_SKIP,   // the rest of a segment we don't use
+    JPEG_SCAN    // entropy-coded data, one MCU per unit
+} JpegState;
+
+// Huffman table in the form of JPEG Annex F.2.2.3
+typedef struct {
+    int defined;
+    int32_t mincode[17];
+    int32_t maxcode[17];  // -1 where there are no codes of that length
+    int32_t valptr[17];
+    uint8_t values[256];
+} JpegHuffman;
+
+typedef struct {
+    int id;
+    int h, v;
+    int quant;
+    int dcTable, acTable;
+    int pred;
+} JpegComponent;
+
+typedef struct {
+    JpegState state;
+    uint32_t remaining;
+    uint16_t quant[4][64];  // natural order
+    JpegHuffman dc[4];
+    JpegHuffman ac[4];
+    JpegComponent components[3];
+    int componentCount;
+    int width, height;
+    int hmax, vmax;
+    int scan[3];            // components in the scan, by index
+    int scanCount;
+    int mcusPerLine, mcuRows;
+    int mcuX, mcuY;
+    int restartInterval, restartsLeft;
+    int dcOnly;             // scaled down so far that only block averages show
+    uint8_t* strip;         // luminance of one row of MCUs
+    int stripWidth, stripHeight;
+
+    uint32_t bitBuffer;     // most significant bit first
+    int bitCount;
+    int markerHit;          // a marker ends the entropy-coded data; zeros follow
+    int shortInput;
+} JpegDecoder;
+
+static struct {
+    int active;
+    char url[IMAGE_URL_SIZE];
+    int boxWidth, boxHeight;
+    ImageFormat format;
+
+    unsigned char* input;
+    size_t inputLength;
+    size_t inputCapacity;
+    size_t inputPos;
+    int inputDone;
+    int finished;
+
+    ImageScaler scaler;
+    uint8_t* gray;  // one source row
+
+    PngDecoder png;
+    GifDecoder gif;
+    JpegDecoder jpeg;
+} imageLoad;
+
+static int beginScaler(ImageScaler* sc, int srcWidth, int srcHeight, int boxWidth, int boxHeight) {
+    sc->srcWidth = srcWidth;
+    sc->srcHeight = srcHeight;
+    sc->width = srcWidth;
+    sc->height = srcHeight;
+    if (sc->width > boxWidth) {
+        sc->height = (int)((int64_t)sc->height * boxWidth / sc->width);
+        sc->width = boxWidth;
+    }
+    if (sc->height > boxHeight) {
+        sc->width = (int)((int64_t)sc->width * boxHeight / sc->height);
+        sc->height = boxHeight;
+    }
+    if (sc->width < 1) sc->width = 1;
+    if (sc->height < 1) sc->height = 1;
+    sc->wordsPerRow = (sc->width + 31) / 32;
+
+    sc->columnOf = pageRealloc(NULL, srcWidth * sizeof(uint16_t));
+    sc->sums = pageRealloc(NULL, sc->width * sizeof(uint32_t));
+    sc->counts = pageRealloc(NULL, sc->width * sizeof(uint32_t));
+    sc->ink = pageRealloc(NULL, sc->wordsPerRow * sc->height * sizeof(uint32_t));
+    for (int i = 0; i < 3; i++) {
+        sc->error[i] = pageRealloc(NULL, (sc->width + 4) * sizeof(int16_t));
+    }
+    if (!sc->columnOf || !sc->sums || !sc->counts || !sc->ink ||
+        !sc->error[0] || !sc->error[1] || !sc->error[2]) {
+        return 0;
+    }
+
+    for (int x = 0; x < srcWidth; x++) {
+        sc->columnOf[x] = (uint16_t)((int64_t)x * sc->width / srcWidth);
+    }
+    memset(sc->sums, 0, sc->width * sizeof(uint32_t));
+    memset(sc->counts, 0, sc->width * sizeof(uint32_t));
+    memset(sc->ink, 0, sc->wordsPerRow * sc->height * sizeof(uint32_t));
+    for (int i = 0; i < 3; i++) {
+        memset(sc->error[i], 0, (sc->width + 4) * sizeof(int16_t));
+    }
+    return 1;
+}
+
+static void endScaler(ImageScaler* sc) {
+    if (sc->columnOf) heapRealloc(sc->columnOf, 0);
+    if (sc->sums) heapRealloc(sc->sums, 0);
+    if (sc->counts) heapRealloc(sc->counts, 0);
+    if (sc->ink) heapRealloc(sc->ink, 0);
+    for (int i = 0; i < 3; i++) {
+        if (sc->error[i]) heapRealloc(sc->error[i], 0);
+    }
+    memset(sc, 0, sizeof(*sc));
+}
+
+// Average the summed output row and dither it, spreading six eighths of each
+// pixel's error to its neighbours (Atkinson), which keeps flat areas clean
+static void emitScaledRow(ImageScaler* sc) {
+    if (sc->outRow >= sc->height) return;
+
+    int16_t* here = sc->error[0] + 2;
+    int16_t* next = sc->error[1] + 2;
+    int16_t* after = sc->error[2] + 2;
+    uint32_t* ink = sc->ink + sc->outRow * sc->wordsPerRow;
+
+    for (int x = 0; x < sc->width; x++) {
+        int value = (sc->counts[x] ? (int)(sc->sums[x] / sc->counts[x]) : 255) + here[x];
+        int error = value < 128 ? value : value - 255;
+        if (value < 128) ink[x >> 5] |= 0x80000000u >> (x & 31);
+
+        error /= 8;
+        here[x + 1] += error;
+        here[x + 2] += error;
+        next[x - 1] += error;
+        next[x] += error;
+        next[x + 1] += error;
+        after[x] += error;
+    }
+
+    int16_t* done = sc->error[0];
+    memset(done, 0, (sc->width + 4) * sizeof(int16_t));
+    sc->error[0] = sc->error[1];
+    sc->error[1] = sc->error[2];
+    sc->error[2] = done;
+
+    memset(sc->sums, 0, sc->width * sizeof(uint32_t));
+    memset(sc->counts, 0, sc->width * sizeof(uint32_t));
+    sc->outRow++;
+}
+
+// Add the next source row, 8-bit gray over a white background
+static void scaleRow(ImageScaler* sc, const uint8_t* gray) {
+    if (sc->srcRow >= sc->srcHeight) return;
+
+    int out = (int)((int64_t)sc->srcRow * sc->height / sc->srcHeight);
+    while (sc->outRow < out) emitScaledRow(sc);
+
+    for (int x = 0; x < sc->srcWidth; x++) {
+        int column = sc->columnOf[x];
+        sc->sums[column] += gray[x];
+        sc->counts[column]++;
+    }
+
+    if (++sc->srcRow == sc->srcHeight) emitScaledRow(sc);
+}
+
+static int scalerDone(const ImageScaler* sc) {
+    return sc->srcHeight > 0 && sc->srcRow == sc->srcHeight;
+}
+
+static inline int luminance(int r, int g, int b) {
+    return (r * 77 + g * 150 + b * 29) >> 8;
+}
+
+// Blend gray with coverage alpha over the white page
+static inline int overWhite(int gray, int alpha) {
+    return (gray * alpha + 255 * (255 - alpha)) / 255;
+}
+
+static inline uint32_t readBE32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Take n bytes of input, or NULL if they haven't all arrived
+static const uint8_t* takeImageBytes(size_t n) {
+    if (imageLoad.inputLength - imageLoad.inputPos < n) return NULL;
+    const uint8_t* bytes = imageLoad.input + imageLoad.inputPos;
+    imageLoad.inputPos += n;
+    return bytes;
+}
+
+// Allocate the source row buffer and the scaler once the size is known
+static int beginImageRows(int width, int height) {
+    if (width < 1 || height < 1 || width > IMAGE_MAX_DIMENSION || height > IMAGE_MAX_DIMENSION) {
+        pd->system->logToConsole("image: unsupported size %dx%d", width, height);
+        return 0;
+    }
+    imageLoad.gray = pageRealloc(NULL, width);
+    return imageLoad.gray &&
+           beginScaler(&imageLoad.scaler, width, height, imageLoad.boxWidth, imageLoad.boxHeight);
+}
+
+// --- PNG ---
+
+// The sample at index in a row of packed samples, at full depth
+static inline int pngSample(const uint8_t* row, int index, int depth) {
+    switch (depth) {
+        case 8: return row[index];
+        case 16: return (row[index * 2] << 8) | row[index * 2 + 1];
+        default: {
+            int perByte = 8 / depth;
+            int shift = 8 - depth * (index % perByte + 1);
+            return (row[index / perByte] >> shift) & ((1 << depth) - 1);
+        }
+    }
+}
+
+static void pngGrayRow(PngDecoder* png, const uint8_t* row, uint8_t* gray, int width) {
+    int depth = png->bitDepth;
+    int max = (1 << depth) - 1;
+
+    for (int x = 0; x < width; x++) {
+        int value, alpha = 255;
+        switch (png->colorType) {
+            case 0: {
+                int v = pngSample(row, x, depth);
+                value = v * 255 / max;
+                if (v == png->key[0]) alpha = 0;
+                break;
+            }
+            case 2: {
+                int r = pngSample(row, x * 3, depth);
+                int g = pngSample(row, x * 3 + 1, depth);
+                int b = pngSample(row, x * 3 + 2, depth);
+                if (r == png->key[0] && g == png->key[1] && b == png->key[2]) alpha = 0;
+                value = luminance(r * 255 / max, g * 255 / max, b * 255 / max);
+                break;
+            }
+            case 3: {
+                int index = pngSample(row, x, depth);
+                value = png->paletteGray[index];
+                alpha = png->paletteAlpha[index];
+                break;
+            }
+            case 4:
+                value = pngSample(row, x * 2, depth) * 255 / max;
+                alpha = pngSample(row, x * 2 + 1, depth) * 255 / max;
+                break;
+            default: {
+                int r = pngSample(row, x * 4, depth);
+                int g = pngSample(row, x * 4 + 1, depth);
+                int b = pngSample(row, x * 4 + 2, depth);
+                value = luminance(r * 255 / max, g * 255 / max, b * 255 / max);
+                alpha = pngSample(row, x * 4 + 3, depth) * 255 / max;
+                break;
+            }
+        }
+        gray[x] = alpha == 255 ? value : overWhite(value, alpha);
+    }
+}
+
+static inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Undo a row's filter against the row above
+static int pngUnfilter(uint8_t* row, const uint8_t* prior, size_t stride, int filter, int bpp) {
+    switch (filter) {
+        case 0:
+            return 1;
+        case 1:
+            for (size_t i = bpp; i < stride; i++) row[i] += row[i - bpp];
+            return 1;
+        case 2:
+            for (size_t i = 0; i < stride; i++) row[i] += prior[i];
+            return 1;
+        case 3:
+            for (size_t i = 0; i < stride; i++) {
+                int left = i >= (size_t)bpp ? row[i - bpp] : 0;
+                row[i] += (left + prior[i]) >> 1;
+            }
+            return 1;
+        case 4:
+            for (size_t i = 0; i < stride; i++) {
+                int left = i >= (size_t)bpp ? row[i - bpp] : 0;
+                int corner = i >= (size_t)bpp ? prior[i - bpp] : 0;
+                row[i] += paeth(left, prior[i], corner);
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Inflated image data: split into rows, unfilter, and scale
+static void pngSink(const char* data, size_t len) {
+    PngDecoder* png = &imageLoad.png;
+    ImageScaler* sc = &imageLoad.scaler;
+    size_t rowSize = png->stride + 1;
+
+    while (len > 0 && !scalerDone(sc) && !png->badFilter) {
+        uint8_t* row = png->rows + (sc->srcRow & 1) * rowSize;
+        uint8_t* prior = png->rows + (~sc->srcRow & 1) * rowSize;
+
+        size_t n = rowSize - png->rowFill < len ? rowSize - png->rowFill : len;
+        memcpy(row + png->rowFill, data, n);
+        png->rowFill += n;
+        data += n;
+        len -= n;
+        if (png->rowFill < rowSize) break;
+
+        png->rowFill = 0;
+        if (!pngUnfilter(row + 1, prior + 1, png->stride, row[0], png->pixelBytes)) {
+            png->badFilter = 1;
+            break;
+        }
+        pngGrayRow(png, row + 1, imageLoad.gray, sc->srcWidth);
+        scaleRow(sc, imageLoad.gray);
+    }
+}
+
+static int readPNGHeader(PngDecoder* png, const uint8_t* data, uint32_t length) {
+    if (length < 13) return -1;
+    int width = (int)readBE32(data);
+    int height = (int)readBE32(data + 4);
+    png->bitDepth = data[8];
+    png->colorType = data[9];
+    if (data[12] != 0) {
+        pd->system->logToConsole("image: interlaced PNG not supported");
+        return -1;
+    }
+
+    int depth = png->bitDepth;
+    int depthOK;
+    switch (png->colorType) {
+        case 0: png->channels = 1; depthOK = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16; break;
+        case 3: png->channels = 1; depthOK = depth == 1 || depth == 2 || depth == 4 || depth == 8; break;
+        case 2: png->channels = 3; depthOK = depth == 8 || depth == 16; break;
+        case 4: png->channels = 2; depthOK = depth == 8 || depth == 16; break;
+        case 6: png->channels = 4; depthOK = depth == 8 || depth == 16; break;
+        default: depthOK = 0; break;
+    }
+    if (!depthOK || data[10] != 0 || data[11] != 0) return -1;
+    if (!beginImageRows(width, height)) return -1;
+
+    png->stride = ((size_t)width * png->channels * depth + 7) / 8;
+    png->pixelBytes = png->channels * depth / 8 > 0 ? png->channels * depth / 8 : 1;
+    png->rows = pageRealloc(NULL, 2 * (png->stride + 1));
+    if (!png->rows) return -1;
+    memset(png->rows, 0, 2 * (png->stride + 1));
+
+    return beginInflate(&png->inflater, "deflate", pngSink) ? 1 : -1;
+}
+
+// Returns: 1 after a unit of progress, 0 if more input is needed, -1 if the
+// image can't be read
+static int decodePNGUnit(void) {
+    PngDecoder* png = &imageLoad.png;
+    const uint8_t* bytes;
+
+    switch (png->state) {
+        case PNG_SIGNATURE:
+            if (!(bytes = takeImageBytes(8))) return 0;
+            if (memcmp(bytes, "\x89PNG\r\n\x1a\n", 8) != 0) return -1;
+            memset(png->paletteAlpha, 255, sizeof(png->paletteAlpha));
+            png->key[0] = png->key[1] = png->key[2] = -1;
+            png->state = PNG_CHUNK;
+            return 1;
+
+        case PNG_CHUNK: {
+            if (!(bytes = takeImageBytes(8))) return 0;
+            uint32_t length = readBE32(bytes);
+            const uint8_t* type = bytes + 4;
+            int header = memcmp(type, "IHDR", 4) == 0;
+            if (length > 0x7FFFFFFF || header != (imageLoad.scaler.srcWidth == 0)) return -1;
+
+            if (memcmp(type, "IDAT", 4) == 0) {
+                png->remaining = length;
+                png->state = PNG_DATA;
+                return 1;
+            }
+            if (memcmp(type, "IEND", 4) == 0) {
+                imageLoad.finished = 1;
+                return 1;
+            }
+            if (!header && memcmp(type, "PLTE", 4) != 0 && memcmp(type, "tRNS", 4) != 0) {
+                png->remaining = length + 4;
+                png->state = PNG_SKIP;
+                return 1;
+            }
+
+            // Small chunks we use are read whole, with their CRC
+            if (length > 4096) return -1;
+            const uint8_t* data = takeImageBytes(length + 4);
+            if (!data) {
+                imageLoad.inputPos -= 8;
+                return 0;
+            }
+            if (header) return readPNGHeader(png, data, length);
+
+            if (type[0] == 'P') {
+                for (uint32_t i = 0; i < length / 3 && i < 256; i++) {
+                    png->paletteGray[i] = luminance(data[i * 3], data[i * 3 + 1], data[i * 3 + 2]);
+                }
+            } else if (png->colorType == 3) {
+                for (uint32_t i = 0; i < length && i < 256; i++) png->paletteAlpha[i] = data[i];
+            } else if (png->colorType == 0 && length >= 2) {
+                png->key[0] = (data[0] << 8) | data[1];
+            } else if (png->colorType == 2 && length >= 6) {
+                for (int i = 0; i < 3; i++) png->key[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+            }
+            return 1;
+        }
+
+        case PNG_DATA: {
+            if (png->remaining == 0) {
+                if (!takeImageBytes(4)) return 0;
+                png->state = PNG_CHUNK;
+                return 1;
+            }
+
+            // A kilobyte at a time, so deadlines are kept
+            size_t available = imageLoad.inputLength - imageLoad.inputPos;
+            size_t n = available < png->remaining ? available : png->remaining;
+            if (n > 1024) n = 1024;
+            if (n == 0) return 0;
+
+            bytes = takeImageBytes(n);
+            png->remaining -= n;
+            if (!inflateChunk(&png->inflater, (const char*)bytes, n) || png->badFilter) return -1;
+            if (scalerDone(&imageLoad.scaler)) imageLoad.finished = 1;
+            return 1;
+        }
+
+        case PNG_SKIP: {
+            size_t available = imageLoad.inputLength - imageLoad.inputPos;
+            size_t n = available < png->remaining ? available : png->remaining;
+            if (png->remaining == 0) {
+                png->state = PNG_CHUNK;
+                return 1;
+            }
+            if (n == 0) return 0;
+            imageLoad.inputPos += n;
+            png->remaining -= n;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// --- GIF ---
+
+static void readGIFPalette(GifDecoder* gif, const uint8_t* colors, int count) {
+    for (int i = 0; i < count; i++) {
+        gif->paletteGray[i] = luminance(colors[i * 3], colors[i * 3 + 1], colors[i * 3 + 2]);
+    }
+}
+
+// Pass the screen rows above the frame, or below it once it is done, as background
+static void fillGIFRows(int untilRow) {
+    ImageScaler* sc = &imageLoad.scaler;
+    memset(imageLoad.gray, 255, sc->srcWidth);
+    while (sc->srcRow < untilRow && !scalerDone(sc)) {
+        scaleRow(sc, imageLoad.gray);
+    }
+}
+
+// Interlaced frames come in four passes, of every 8th, 8th, 4th and 2nd row
+static const uint8_t gifPassStart[4] = { 0, 4, 2, 1 };
+static const uint8_t gifPassStep[4] = { 8, 8, 4, 2 };
+
+static void gifPixel(GifDecoder* gif, int index) {
+    ImageScaler* sc = &imageLoad.scaler;
+    if (gif->y >= gif->frameHeight) return;
+
+    int value = index == gif->transparent ? 255 : gif->paletteGray[index];
+    if (gif->frame) {
+        gif->frame[gif->row * gif->frameWidth + gif->x] = value;
+    } else if (gif->left + gif->x < sc->srcWidth) {
+        imageLoad.gray[gif->left + gif->x] = value;
+    }
+    if (++gif->x < gif->frameWidth) return;
+
+    gif->x = 0;
+    gif->y++;
+    if (!gif->frame) {
+        if (gif->top + gif->row < sc->srcHeight) scaleRow(sc, imageLoad.gray);
+        memset(imageLoad.gray, 255, sc->srcWidth);
+        gif->row++;
+        return;
+    }
+    gif->row += gifPassStep[gif->pass];
+    while (gif->row >= gif->frameHeight && gif->pass < 3) {
+        gif->pass++;
+        gif->row = gifPassStart[gif->pass];
+    }
+}
+
+// Pass on an interlaced frame's rows, then the screen rows below the frame
+static void finishGIFFrame(GifDecoder* gif) {
+    ImageScaler* sc = &imageLoad.scaler;
+    if (gif->frame) {
+        int width = gif->left + gif->frameWidth <= sc->srcWidth ? gif->frameWidth : sc->srcWidth - gif->left;
+        for (int row = 0; row < gif->frameHeight && gif->top + row < sc->srcHeight; row++) {
+            memset(imageLoad.gray, 255, sc->srcWidth);
+            if (width > 0) memcpy(imageLoad.gray + gif->left, gif->frame + row * gif->frameWidth, width);
+            scaleRow(sc, imageLoad.gray);
+        }
+    }
+    fillGIFRows(sc->srcHeight);
+}
+
+// Decode the codes in one data sub-block
+// Returns: 1, or 0 once the end code is reached, -1 if the data is corrupt
+static int gifDecodeBytes(GifDecoder* gif, const uint8_t* data, int len) {
+    int clearCode = 1 << gif->minCodeSize;
+
+    for (int i = 0; i < len; i++) {
+        gif->bitBuffer |= (uint32_t)data[i] << gif->bitCount;
+        gif->bitCount += 8;
+
+        while (gif->bitCount >= gif->codeSize) {
+            int code = gif->bitBuffer & ((1 << gif->codeSize) - 1);
+            gif->bitBuffer >>= gif->codeSize;
+            gif->bitCount -= gif->codeSize;
+
+            if (code == clearCode) {
+                gif->codeSize = gif->minCodeSize + 1;
+                gif->nextCode = clearCode + 2;
+                gif->prevCode = -1;
+                continue;
+            }
+            if (code == clearCode + 1) return 0;
+
+            if (gif->prevCode < 0) {
+                if (code > clearCode) return -1;
+                gif->prevCode = code;
+                gif->firstChar = code;
+                gifPixel(gif, code);
+                continue;
+            }
+            if (code > gif->nextCode) return -1;
+
+            // Unwind the string for code, last character first
+            int in = code;
+            int depth = 0;
+            if (code == gif->nextCode) {
+                gif->stack[depth++] = gif->firstChar;
+                code = gif->prevCode;
+            }
+            while (code > clearCode) {
+                if (depth >= GIF_MAX_CODES) return -1;
+                gif->stack[depth++] = gif->suffix[code];
+                code = gif->prefix[code];
+            }
+            gif->firstChar = code;
+            gif->stack[depth++] = code;
+
+            if (gif->nextCode < GIF_MAX_CODES) {
+                gif->prefix[gif->nextCode] = gif->prevCode;
+                gif->suffix[gif->nextCode] = gif->firstChar;
+                if (++gif->nextCode == (1 << gif->codeSize) && gif->codeSize < 12) {
+                    gif->codeSize++;
+                }
+            }
+            gif->prevCode = in;
+
+            while (depth > 0) gifPixel(gif, gif->stack[--depth]);
+        }
+    }
+    return 1;
+}
+
+static int decodeGIFUnit(void) {
+    GifDecoder* gif = &imageLoad.gif;
+    size_t start = imageLoad.inputPos;
+    const uint8_t* bytes;
+
+    switch (gif->state) {
+        case GIF_HEADER: {
+            if (!(bytes = takeImageBytes(13))) return 0;
+            if (memcmp(bytes, "GIF87a", 6) != 0 && memcmp(bytes, "GIF89a", 6) != 0) return -1;
+
+            int colors = (bytes[10] & 0x80) ? 2 << (bytes[10] & 7) : 0;
+            const uint8_t* palette = takeImageBytes(colors * 3);
+            if (!palette) {
+                imageLoad.inputPos = start;
+                return 0;
+            }
+            readGIFPalette(gif, palette, colors);
+            gif->transparent = -1;
+            if (!beginImageRows(bytes[6] | (bytes[7] << 8), bytes[8] | (bytes[9] << 8))) return -1;
+            gif->state = GIF_BLOCK;
+            return 1;
+        }
+
+        case GIF_BLOCK:
+            if (!(bytes = takeImageBytes(1))) return 0;
+            if (bytes[0] == 0x2C) {
+                gif->state = GIF_IMAGE;
+            } else if (bytes[0] == 0x21) {
+                // Extension label, then sub-blocks
+                if (!(bytes = takeImageBytes(1))) {
+                    imageLoad.inputPos = start;
+                    return 0;
+                }
+                gif->graphicControl = bytes[0] == 0xF9;
+                gif->state = GIF_SUBBLOCKS;
+            } else {
+                return -1;  // the trailer, or junk, before any frame
+            }
+            return 1;
+
+        case GIF_SUBBLOCKS: {
+            if (!(bytes = takeImageBytes(1))) return 0;
+            int len = bytes[0];
+            if (!(bytes = takeImageBytes(len))) {
+                imageLoad.inputPos = start;
+                return 0;
+            }
+            if (len == 0) {
+                gif->state = GIF_BLOCK;
+            } else if (gif->graphicControl && len >= 4) {
+                if (bytes[0] & 1) gif->transparent = bytes[3];
+                gif->graphicControl = 0;
+            }
+            return 1;
+        }
+
+        case GIF_IMAGE: {
+            // Descriptor, local palette, and LZW code size
+            if (!(bytes = takeImageBytes(9))) return 0;
+            int colors = (bytes[8] & 0x80) ? 2 << (bytes[8] & 7) : 0;
+            const uint8_t* palette = takeImageBytes(colors * 3);
+            const uint8_t* codeSize = palette ? takeImageBytes(1) : NULL;
+            if (!codeSize) {
+                imageLoad.inputPos = start;
+                return 0;
+            }
+            if (*codeSize < 2 || *codeSize > 8) return -1;
+            readGIFPalette(gif, palette, colors);
+
+            gif->left = bytes[0] | (bytes[1] << 8);
+            gif->top = bytes[2] | (bytes[3] << 8);
+            gif->frameWidth = bytes[4] | (bytes[5] << 8);
+            gif->frameHeight = bytes[6] | (bytes[7] << 8);
+            if (gif->frameWidth == 0 || gif->frameHeight == 0) return -1;
+
+            if (bytes[8] & 0x40) {
+                if (gif->frameWidth * gif->frameHeight > GIF_MAX_INTERLACED) {
+                    pd->system->logToConsole("image: interlaced GIF too large");
+                    return -1;
+                }
+                gif->frame = pageRealloc(NULL, gif->frameWidth * gif->frameHeight);
+                if (!gif->frame) return -1;
+                memset(gif->frame, 255, gif->frameWidth * gif->frameHeight);
+            }
+
+            gif->prefix = pageRealloc(NULL, GIF_MAX_CODES * sizeof(uint16_t));
+            gif->suffix = pageRealloc(NULL, GIF_MAX_CODES);
+            gif->stack = pageRealloc(NULL, GIF_MAX_CODES + 1);
+            if (!gif->prefix || !gif->suffix || !gif->stack) return -1;
+
+            gif->minCodeSize = *codeSize;
+            gif->codeSize = gif->minCodeSize + 1;
+            gif->nextCode = (1 << gif->minCodeSize) + 2;
+            gif->prevCode = -1;
+
+            fillGIFRows(gif->top);
+            gif->state = GIF_DATA;
+            return 1;
+        }
+
+        case GIF_DATA: {
+            if (!(bytes = takeImageBytes(1))) return 0;
+            int len = bytes[0];
+            if (!(bytes = takeImageBytes(len))) {
+                imageLoad.inputPos = start;
+                return 0;
+            }
+
+            int result = len ? gifDecodeBytes(gif, bytes, len) : 0;
+            if (result < 0) return -1;
+            if (result == 0 || gif->y >= gif->frameHeight) {
+                // Only the first frame is shown
+                finishGIFFrame(gif);
+                imageLoad.finished = 1;
+            }
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// --- JPEG ---
+
+// Natural order of the coefficients, by their position in zigzag order
+static const uint8_t jpegZigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// cos((2x + 1)uπ/16) with the DCT's scale factor, in 12-bit fixed point
+static int32_t idctTable[8][8];
+
+static void buildIDCTTable(void) {
+    for (int x = 0; x < 8; x++) {
+        for (int u = 0; u < 8; u++) {
+            double scale = u == 0 ? 0.5 / sqrt(2.0) : 0.5;
+            idctTable[x][u] = (int32_t)lround(scale * cos((2 * x + 1) * u * 3.14159265358979323846 / 16) * 4096);
+        }
+    }
+}
+
+// Inverse DCT of a dequantized block into 8x8 samples of out
+static void jpegIDCT(const int32_t* block, uint8_t* out, int outStride) {
+    int32_t rows[64];
+
+    // Along each row, skipping the rows that are all zero
+    for (int v = 0; v < 8; v++) {
+        const int32_t* in = block + v * 8;
+        int32_t* row = rows + v * 8;
+        if (!(in[1] | in[2] | in[3] | in[4] | in[5] | in[6] | in[7])) {
+            int32_t dc = (in[0] * idctTable[0][0] + 256) >> 9;
+            for (int x = 0; x < 8; x++) row[x] = dc;
+            continue;
+        }
+        for (int x = 0; x < 8; x++) {
+            int32_t sum = 0;
+            for (int u = 0; u < 8; u++) sum += idctTable[x][u] * in[u];
+            row[x] = (sum + 256) >> 9;  // three bits kept for the second pass
+        }
+    }
+
+    // Then down each column
+    for (int x = 0; x < 8; x++) {
+        for (int y = 0; y < 8; y++) {
+            int32_t sum = 0;
+            for (int v = 0; v < 8; v++) sum += idctTable[y][v] * rows[v * 8 + x];
+            int value = ((sum + (1 << 14)) >> 15) + 128;
+            out[y * outStride + x] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+    }
+}
+
+// Fill the bit buffer to at least 16 bits; past a marker or the end of the
+// input it is padded with zeros, and running off the input is noted
+static void jpegFill(JpegDecoder* jpeg) {
+    while (jpeg->bitCount <= 16) {
+        uint32_t byte = 0;
+        if (!jpeg->markerHit) {
+            size_t pos = imageLoad.inputPos;
+            if (pos >= imageLoad.inputLength ||
+                (imageLoad.input[pos] == 0xFF && pos + 1 >= imageLoad.inputLength)) {
+                jpeg->shortInput = 1;
+            } else if (imageLoad.input[pos] != 0xFF) {
+                byte = imageLoad.input[pos];
+                imageLoad.inputPos++;
+            } else if (imageLoad.input[pos + 1] == 0x00) {
+                byte = 0xFF;  // stuffed
+                imageLoad.inputPos += 2;
+            } else {
+                jpeg->markerHit = 1;
+            }
+        }
+        jpeg->bitBuffer |= byte << (24 - jpeg->bitCount);
+        jpeg->bitCount += 8;
+    }
+}
+
+static inline int jpegBits(JpegDecoder* jpeg, int n) {
+    if (n == 0) return 0;
+    if (jpeg->bitCount < n) jpegFill(jpeg);
+    int value = jpeg->bitBuffer >> (32 - n);
+    jpeg->bitBuffer <<= n;
+    jpeg->bitCount -= n;
+    return value;
+}
+
+// An n-bit coefficient magnitude, sign-extended as in JPEG F.2.2.1
+static inline int jpegReceive(JpegDecoder* jpeg, int n) {
+    int value = jpegBits(jpeg, n);
+    return n && value < (1 << (n - 1)) ? value - (1 << n) + 1 : value;
+}
+
+static int jpegDecodeHuffman(JpegDecoder* jpeg, const JpegHuffman* table) {
+    if (jpeg->bitCount < 16) jpegFill(jpeg);
+    int32_t bits = jpeg->bitBuffer >> 16;
+    for (int length = 1; length <= 16; length++) {
+        int32_t code = bits >> (16 - length);
+        if (code <= table->maxcode[length]) {
+            jpeg->bitBuffer <<= length;
+            jpeg->bitCount -= length;
+            return table->values[table->valptr[length] + code - table->mincode[length]];
+        }
+    }
+    return -1;
+}
+
+// Decode one block's coefficients, dequantized into block if it is wanted
+static int jpegDecodeBlock(JpegDecoder* jpeg, JpegComponent* component, int32_t* block) {
+    const uint16_t* quant = jpeg->quant[component->quant];
+    const JpegHuffman* ac = &jpeg->ac[component->acTable];
+
+    int size = jpegDecodeHuffman(jpeg, &jpeg->dc[component->dcTable]);
+    if (size < 0 || size > 11) return 0;
+    component->pred += jpegReceive(jpeg, size);
+    if (block) {
+        memset(block, 0, 64 * sizeof(int32_t));
+        block[0] = component->pred * quant[0];
+    }
+
+    for (int k = 1; k < 64; k++) {
+        int rs = jpegDecodeHuffman(jpeg, ac);
+        if (rs < 0) return 0;
+        int run = rs >> 4;
+        int bits = rs & 15;
+        if (bits == 0) {
+            if (run != 15) break;  // end of block
+            k += 15;
+            continue;
+        }
+        k += run;
+        if (k > 63) return 0;
+        int value = jpegReceive(jpeg, bits);
+        if (block) block[jpegZigzag[k]] = value * quant[jpegZigzag[k]];
+    }
+    return 1;
+}
+
+static int readJPEGFrame(JpegDecoder* jpeg, const uint8_t* data, uint32_t length) {
+    if (length < 6 || data[0] != 8) return -1;
+    jpeg->height = (data[1] << 8) | data[2];
+    jpeg->width = (data[3] << 8) | data[4];
+    jpeg->componentCount = data[5];
+    if ((jpeg->componentCount != 1 && jpeg->componentCount != 3) ||
+        length < 6 + 3 * (uint32_t)jpeg->componentCount || imageLoad.scaler.srcWidth) {
+        return -1;
+    }
+
+    jpeg->hmax = jpeg->vmax = 1;
+    for (int i = 0; i < jpeg->componentCount; i++) {
+        JpegComponent* component = &jpeg->components[i];
+        const uint8_t* spec = data + 6 + i * 3;
+        component->id = spec[0];
+        component->h = spec[1] >> 4;
+        component->v = spec[1] & 15;
+        component->quant = spec[2] & 3;
+        if (component->h < 1 || component->h > 4 || component->v < 1 || component->v > 4) return -1;
+        if (component->h > jpeg->hmax) jpeg->hmax = component->h;
+        if (component->v > jpeg->vmax) jpeg->vmax = component->v;
+    }
+
+    // Only luminance is decoded, and it has to be at full resolution
+    if (jpeg->componentCount > 1 &&
+        (jpeg->components[0].h != jpeg->hmax || jpeg->components[0].v != jpeg->vmax)) {
+        return -1;
+    }
+    if (!beginImageRows(jpeg->width, jpeg->height)) return -1;
+
+    ImageScaler* sc = &imageLoad.scaler;
+    jpeg->dcOnly = sc->width * 8 <= jpeg->width && sc->height * 8 <= jpeg->height;
+    if (!idctTable[0][0]) buildIDCTTable();
+    return 1;
+}
+
+static int readJPEGHuffmanTables(JpegDecoder* jpeg, const uint8_t* data, uint32_t length) {
+    while (length > 17) {
+        int kind = data[0] >> 4;
+        int id = data[0] & 15;
+        if (kind > 1 || id > 3) return -1;
+
+        int total = 0;
+        for (int i = 1; i <= 16; i++) total += data[i];
+        if (total > 256 || length < 17 + (uint32_t)total) return -1;
+
+        JpegHuffman* table = kind ? &jpeg->ac[id] : &jpeg->dc[id];
+        int32_t code = 0;
+        int k = 0;
+        for (int bits = 1; bits <= 16; bits++) {
+            table->valptr[bits] = k;
+            table->mincode[bits] = code;
+            code += data[bits];
+            k += data[bits];
+            table->maxcode[bits] = data[bits] ? code - 1 : -1;
+            if (code > (1 << bits)) return -1;
+            code <<= 1;
+        }
+        memcpy(table->values, data + 17, total);
+        table->defined = 1;
+
+        data += 17 + total;
+        length -= 17 + total;
+    }
+    return length == 0 ? 1 : -1;
+}
+
+static int readJPEGQuantTables(JpegDecoder* jpeg, const uint8_t* data, uint32_t length) {
+    while (length > 0) {
+        int wide = data[0] >> 4;
+        int id = data[0] & 15;
+        uint32_t size = 1 + 64 * (wide ? 2 : 1);
+        if (wide > 1 || id > 3 || length < size) return -1;
+
+        for (int k = 0; k < 64; k++) {
+            jpeg->quant[id][jpegZigzag[k]] =
+                wide ? (data[1 + k * 2] << 8) | data[2 + k * 2] : data[1 + k];
+        }
+        data += size;
+        length -= size;
+    }
+    return 1;
+}
+
+static int readJPEGScan(JpegDecoder* jpeg, const uint8_t* data, uint32_t length) {
+    if (!imageLoad.scaler.srcWidth || length < 1) return -1;
+    jpeg->scanCount = data[0];
+    if (jpeg->scanCount < 1 || jpeg->scanCount > jpeg->componentCount ||
+        length < 4 + 2 * (uint32_t)jpeg->scanCount) {
+        return -1;
+    }
+
+    int hasLuminance = 0;
+    for (int i = 0; i < jpeg->scanCount; i++) {
+        int id = data[1 + i * 2];
+        int tables = data[2 + i * 2];
+        int index = 0;
+        while (index < jpeg->componentCount && jpeg->components[index].id != id) index++;
+        if (index == jpeg->componentCount) return -1;
+
+        JpegComponent* component = &jpeg->components[index];
+        component->dcTable = tables >> 4 & 3;
+        component->acTable = tables & 3;
+        component->pred = 0;
+        if (!jpeg->dc[component->dcTable].defined || !jpeg->ac[component->acTable].defined) return -1;
+        jpeg->scan[i] = index;
+        hasLuminance |= index == 0;
+    }
+    if (!hasLuminance) {
+        pd->system->logToConsole("image: JPEG scan without luminance not supported");
+        return -1;
+    }
+
+    // A single-component scan codes its blocks one at a time
+    int mcuWidth = jpeg->scanCount == 1 ? 8 : 8 * jpeg->hmax;
+    int mcuHeight = jpeg->scanCount == 1 ? 8 : 8 * jpeg->vmax;
+    jpeg->mcusPerLine = (jpeg->width + mcuWidth - 1) / mcuWidth;
+    jpeg->mcuRows = (jpeg->height + mcuHeight - 1) / mcuHeight;
+    jpeg->stripWidth = jpeg->mcusPerLine * mcuWidth;
+    jpeg->stripHeight = mcuHeight;
+    jpeg->strip = pageRealloc(NULL, jpeg->stripWidth * jpeg->stripHeight);
+    if (!jpeg->strip) return -1;
+
+    jpeg->mcuX = jpeg->mcuY = 0;
+    jpeg->restartsLeft = jpeg->restartInterval;
+    jpeg->bitBuffer = 0;
+    jpeg->bitCount = 0;
+    jpeg->markerHit = 0;
+    jpeg->state = JPEG_SCAN;
+    return 1;
+}
+
+// Decode the next MCU, passing the row of MCUs to the scaler once complete
+static int decodeJPEGMCU(JpegDecoder* jpeg) {
+    size_t pos = imageLoad.inputPos;
+    uint32_t bitBuffer = jpeg->bitBuffer;
+    int bitCount = jpeg->bitCount;
+    int markerHit = jpeg->markerHit;
+    int restartsLeft = jpeg->restartsLeft;
+    int preds[3];
+    for (int i = 0; i < jpeg->componentCount; i++) preds[i] = jpeg->components[i].pred;
+
+    if (jpeg->restartInterval && jpeg->restartsLeft == 0) {
+        // Bits left before the restart marker are padding
+        jpeg->bitBuffer = 0;
+        jpeg->bitCount = 0;
+        jpeg->markerHit = 0;
+        const uint8_t* marker = takeImageBytes(2);
+        if (!marker) {
+            jpeg->bitBuffer = bitBuffer;
+            jpeg->bitCount = bitCount;
+            jpeg->markerHit = markerHit;
+            return 0;
+        }
+        if (marker[0] != 0xFF || (marker[1] & 0xF8) != 0xD0) return -1;
+        for (int i = 0; i < jpeg->componentCount; i++) jpeg->components[i].pred = 0;
+        jpeg->restartsLeft = jpeg->restartInterval;
+    }
+
+    int32_t block[64];
+    jpeg->shortInput = 0;
+    for (int i = 0; i < jpeg->scanCount; i++) {
+        JpegComponent* component = &jpeg->components[jpeg->scan[i]];
+        int across = jpeg->scanCount == 1 ? 1 : component->h;
+        int down = jpeg->scanCount == 1 ? 1 : component->v;
+        int luminance = jpeg->scan[i] == 0;
+
+        for (int by = 0; by < down; by++) {
+            for (int bx = 0; bx < across; bx++) {
+                int wanted = luminance && !jpeg->dcOnly;
+                if (!jpegDecodeBlock(jpeg, component, wanted ? block : NULL)) {
+                    if (jpeg->shortInput) break;
+                    return -1;
+                }
+                if (!luminance) continue;
+
+                uint8_t* out = jpeg->strip + by * 8 * jpeg->stripWidth +
+                               (jpeg->mcuX * across + bx) * 8;
+                if (wanted) {
+                    jpegIDCT(block, out, jpeg->stripWidth);
+                } else {
+                    int value = component->pred * jpeg->quant[component->quant][0] / 8 + 128;
+                    value = value < 0 ? 0 : value > 255 ? 255 : value;
+                    for (int y = 0; y < 8; y++) memset(out + y * jpeg->stripWidth, value, 8);
+                }
+            }
+        }
+    }
+
+    if (jpeg->shortInput) {
+        imageLoad.inputPos = pos;
+        jpeg->bitBuffer = bitBuffer;
+        jpeg->bitCount = bitCount;
+        jpeg->markerHit = markerHit;
+        jpeg->restartsLeft = restartsLeft;
+        for (int i = 0; i < jpeg->componentCount; i++) jpeg->components[i].pred = preds[i];
+        return 0;
+    }
+
+    jpeg->restartsLeft--;
+    if (++jpeg->mcuX == jpeg->mcusPerLine) {
+        for (int y = 0; y < jpeg->stripHeight; y++) {
+            scaleRow(&imageLoad.scaler, jpeg->strip + y * jpeg->stripWidth);
+        }
+        jpeg->mcuX = 0;
+        if (++jpeg->mcuY == jpeg->mcuRows) imageLoad.finished = 1;
+    }
+    return 1;
+}
+
+static int decodeJPEGUnit(void) {
+    JpegDecoder* jpeg = &imageLoad.jpeg;
+    size_t start = imageLoad.inputPos;
+    const uint8_t* bytes;
+
+    switch (jpeg->state) {
+        case JPEG_MARKER: {
+            if (!(bytes = takeImageBytes(2))) return 0;
+            if (bytes[0] != 0xFF) return -1;
+            int marker = bytes[1];
+            while (marker == 0xFF) {
+                // Fill bytes before the marker
+                if (!(bytes = takeImageBytes(1))) {
+                    imageLoad.inputPos = start;
+                    return 0;
+                }
+                marker = bytes[0];
+            }
+            if (marker == 0xD8 || (marker >= 0xD0 && marker <= 0xD7) || marker == 0x01) return 1;
+            if (marker == 0xD9) return -1;  // no frame before the end of the image
+
+            if (!(bytes = takeImageBytes(2))) {
+                imageLoad.inputPos = start;
+                return 0;
+            }
+            uint32_t length = (bytes[0] << 8) | bytes[1];
+            if (length < 2) return -1;
+            length -= 2;
+
+            if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                pd->system->logToConsole("image: progressive or arithmetic JPEG not supported");
+                return -1;
+            }
+            if (marker != 0xC0 && marker != 0xC1 && marker != 0xC4 && marker != 0xDB &&
+                marker != 0xDD && marker != 0xDA) {
+                jpeg->remaining = length;
+                jpeg->state = JPEG_SKIP;
+                return 1;
+            }
+
+            const uint8_t* data = takeImageBytes(length);
+            if (!data) {
+                imageLoad.inputPos = start;
+                return 0;
+            }
+            switch (marker) {
+                case 0xC4: return readJPEGHuffmanTables(jpeg, data, length);
+                case 0xDB: return readJPEGQuantTables(jpeg, data, length);
+                case 0xDA: return readJPEGScan(jpeg, data, length);
+                case 0xDD:
+                    if (length < 2) return -1;
+                    jpeg->restartInterval = (data[0] << 8) | data[1];
+                    return 1;
+                default: return readJPEGFrame(jpeg, data, length);
+            }
+        }
+
+        case JPEG_SKIP: {
+            size_t available = imageLoad.inputLength - imageLoad.inputPos;
+            size_t n = available < jpeg->remaining ? available : jpeg->remaining;
+            if (jpeg->remaining == 0) {
+                jpeg->state = JPEG_MARKER;
+                return 1;
+            }
+            if (n == 0) return 0;
+            imageLoad.inputPos += n;
+            jpeg->remaining -= n;
+            return 1;
+        }
+
+        case JPEG_SCAN:
+            return decodeJPEGMCU(jpeg);
+    }
+    return -1;
+}
+
+// --- Loading ---
+
+static void endImageLoad(void) {
+    if (imageLoad.input) heapRealloc(imageLoad.input, 0);
+    if (imageLoad.gray) heapRealloc(imageLoad.gray, 0);
+    endScaler(&imageLoad.scaler);
+    if (imageLoad.png.rows) heapRealloc(imageLoad.png.rows, 0);
+    endInflate(&imageLoad.png.inflater);
+    if (imageLoad.gif.prefix) heapRealloc(imageLoad.gif.prefix, 0);
+    if (imageLoad.gif.suffix) heapRealloc(imageLoad.gif.suffix, 0);
+    if (imageLoad.gif.stack) heapRealloc(imageLoad.gif.stack, 0);
+    if (imageLoad.gif.frame) heapRealloc(imageLoad.gif.frame, 0);
+    if (imageLoad.jpeg.strip) heapRealloc(imageLoad.jpeg.strip, 0);
+    memset(&imageLoad, 0, sizeof(imageLoad));
+}
+
+static void beginImageLoad(const char* url, int boxWidth, int boxHeight) {
+    endImageLoad();
+    imageLoad.active = 1;
+    snprintf(imageLoad.url, sizeof(imageLoad.url), "%s", url);
+    imageLoad.boxWidth = boxWidth;
+    imageLoad.boxHeight = boxHeight;
+}
+
+// Buffer the next chunk of the image, dropping the input already decoded
+static int feedImageLoad(const char* data, size_t len) {
+    size_t kept = imageLoad.inputLength - imageLoad.inputPos;
+    if (kept + len > imageLoad.inputCapacity) {
+        size_t capacity = imageLoad.inputCapacity ? imageLoad.inputCapacity : 4096;
+        while (kept + len > capacity) capacity *= 2;
+        unsigned char* input = pageRealloc(imageLoad.input, capacity);
+        if (!input) return 0;
+        imageLoad.input = input;
+        imageLoad.inputCapacity = capacity;
+    }
+    memmove(imageLoad.input, imageLoad.input + imageLoad.inputPos, kept);
+    memcpy(imageLoad.input + kept, data, len);
+    imageLoad.inputLength = kept + len;
+    imageLoad.inputPos = 0;
+    return 1;
+}
+
+// Tell the format from the first bytes
+static int sniffImage(void) {
+    size_t available = imageLoad.inputLength - imageLoad.inputPos;
+    const uint8_t* bytes = imageLoad.input + imageLoad.inputPos;
+    if (available < 4) return 0;
+
+    if (memcmp(bytes, "\x89PNG", 4) == 0) {
+        imageLoad.format = IMAGE_PNG;
+    } else if (memcmp(bytes, "GIF8", 4) == 0) {
+        imageLoad.format = IMAGE_GIF;
+    } else if (bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF) {
+        imageLoad.format = IMAGE_JPEG;
+    } else {
+        pd->system->logToConsole("image: unsupported format %s", imageLoad.url);
+        return -1;
+    }
+    return 1;
+}
+
+// Cache what was decoded, or the failure, and end the load
+static void finishImageLoad(int ok) {
+    ImageScaler* sc = &imageLoad.scaler;
+    if (ok && sc->srcRow > 0) {
+        // Show a cut-short image as far as it got
+        if (!scalerDone(sc)) emitScaledRow(sc);
+        storeImage(imageLoad.url, sc->ink, sc->width, sc->height);
+        sc->ink = NULL;
+    } else {
+        storeImage(imageLoad.url, NULL, 0, 0);
+    }
+    endImageLoad();
+}
+
+// Decode buffered input until the deadline
+// Returns: 1 once the image has been cached (or found unreadable), 0 if it
+// needs more time or input
+static int stepImageLoad(unsigned int deadline) {
+    if (!imageLoad.active) return 1;
+
+    int steps = 0;
+    while (!imageLoad.finished) {
+        int result;
+        switch (imageLoad.format) {
+            case IMAGE_PNG: result = decodePNGUnit(); break;
+            case IMAGE_GIF: result = decodeGIFUnit(); break;
+            case IMAGE_JPEG: result = decodeJPEGUnit(); break;
+            default: result = sniffImage(); break;
+        }
+
+        if (result < 0 || (result == 0 && imageLoad.inputDone)) {
+            finishImageLoad(result == 0);
+            return 1;
+        }
+        if (result == 0) return 0;
+
+        if (++steps % STEP_CHECK_INTERVAL == 0 && pastDeadline(deadline)) {
+            return 0;
+        }
+    }
+
+    finishImageLoad(1);
+    return 1;
+}
+
+// ============================================================================
+// Streaming Render Session
+// ============================================================================
+
+typedef enum {
+    STREAM_NONE,
+    STREAM_MARKDOWN,
+    STREAM_HTML
+} StreamKind;
+
+// The page currently being rendered. Chunks are only buffered as they
+// arrive from the network; stepStream does the parsing and layout in slices
+// that fit a frame's time budget, so the UI keeps running while a big page
+// loads. Markdown is laid out one run of complete blocks at a time, so the
+// top of the page can be shown before the download finishes; HTML is parsed
+// slice by slice and laid out by its site renderer once complete.
+#define PARSE_SLICE 4096
+
+static struct {
+    StreamKind kind;
+    int failed;
+    int inputDone;        // no more chunks will be fed
+    int laidOut;          // all input has been laid out
+    Page* page;
+    RenderContext ctx;
+    char url[CACHE_URL_SIZE];  // for relative image sources, empty if unknown
+
+    // Source not yet handed to a parser (markdown keeps all of it)
+    char* source;
+    size_t sourceLength;
+    size_t sourceCapacity;
+    size_t parsedLength;
+
+    // Markdown: block boundaries, and the run of blocks being parsed or laid out
+    size_t scanOffset;    // first line not yet scanned for block boundaries
+    size_t boundary;      // end of the last blank line outside a code fence
+    char fenceChar;       // '`' or '~' while inside a fenced code block
+    int fenceLength;
+    int hasReferences;    // link reference definitions resolve across blocks
+    int relaidOut;        // restarted from the top once references were seen
+    cmark_parser* parser;
+    size_t rangeEnd;      // end of the run being fed to the parser
+    MarkdownLayout markdown;
+
+    // HTML
+    lxb_html_document_t* document;
+    const SiteRenderer* renderer;
+    int parseEnded;
+    int titleDone;
+    lxb_dom_node_t* cursor;  // next node for the renderer's rules
+} stream = {0};
+
+// Free the markdown run in progress and everything cmark allocated for it
+static void endMarkdownRange(void) {
+    if (stream.markdown.iter) cmark_iter_free(stream.markdown.iter);
+    if (stream.markdown.doc) cmark_node_free(stream.markdown.doc);
+    if (stream.parser) cmark_parser_free(stream.parser);
+    memset(&stream.markdown, 0, sizeof(stream.markdown));
+    stream.parser = NULL;
+
+    // Nothing cmark allocated outlives the run
+    resetParserArena();
+}
+
+// Clear the layout and links and start again at the top of the page
+static void restartStreamLayout(void) {
+    resetPageLayout(&stream.page->layout);
+    if (stream.page == shownPage) {
+        invalidateTiles();
+    }
+
+    stream.ctx.x = 0;
+    stream.ctx.y = 0;
+    stream.ctx.firstParagraph = 1;
+    stream.ctx.segmentOpen = 0;
+    stream.ctx.pendingSpace = 0;
+    stream.ctx.layout = &stream.page->layout;
+}
+
+// Drop any stream in progress and free its buffers; a page that is already
+// on screen or referenced from Lua stays alive
+static void discardStream(void) {
+    endMarkdownRange();
+    endInflate(&bodyInflater);
+    if (stream.source) heapRealloc(stream.source, 0);
+    if (stream.document) releaseHTMLDocument();
+    abortCacheStore();
+    releasePage(stream.page);
+    memset(&stream, 0, sizeof(stream));
+}
+
+// Returns: 0 if the page could not be allocated
+static int beginStream(StreamKind kind, const char* url, int pageWidth, int pagePadding, int tracking) {
+    discardStream();
+
+    stream.page = newPage(pageWidth, pagePadding);
+    if (!stream.page) return 0;
+
+    stream.page->tracking = tracking;
+    stream.kind = kind;
+
+    memset(stats.page, 0, sizeof(stats.page));
+    stats.streamStart = pd->system->getElapsedTime();
+    stream.ctx.contentWidth = pageWidth - 2 * pagePadding;
+    stream.ctx.tracking = tracking;
+    snprintf(stream.url, sizeof(stream.url), "%s", url ? url : "");
+    stream.ctx.baseURL = url ? stream.url : NULL;
+
+    restartStreamLayout();
+    return 1;
+}
+
+// Start parsing source[parsedLength, end) as a standalone run of blocks
+static void beginMarkdownRange(size_t end) {
+    stream.parser = cmark_parser_new_with_mem(CMARK_OPT_DEFAULT, &arenaCmarkMem);
+    if (!stream.parser) {
+        stream.failed = 1;
+        resetParserArena();
+        return;
+    }
+    stream.rangeEnd = end;
+}
+
+// Feed the run to the parser a slice at a time
+// Returns: 1 once the run is parsed (or failed to parse)
+static int parseMarkdownRange(unsigned int deadline) {
+    while (stream.parser) {
+        if (stream.parsedLength < stream.rangeEnd) {
+            size_t length = stream.rangeEnd - stream.parsedLength;
+            if (length > PARSE_SLICE) length = PARSE_SLICE;
+            cmark_parser_feed(stream.parser, stream.source + stream.parsedLength, length);
+            stream.parsedLength += length;
+        } else {
+            stream.markdown.doc = cmark_parser_finish(stream.parser);
+            cmark_parser_free(stream.parser);
+            stream.parser = NULL;
+            if (!stream.markdown.doc) {
+                stream.failed = 1;
+                endMarkdownRange();
+                return 1;
+            }
+        }
+        if (pastDeadline(deadline)) return 0;
+    }
+    return 1;
+}
+
+// Parse the run, then lay it out
+// Returns: 1 once the run is laid out
+static int stepMarkdownRange(unsigned int deadline) {
+    float start = beginPhase();
+    int parsed = parseMarkdownRange(deadline);
+    endPhase(PHASE_PARSE, start);
+    if (!parsed || stream.failed) return parsed;
+
+    start = beginPhase();
+    int laidOut = layoutMarkdown(&stream.ctx, &stream.markdown, deadline);
+    endPhase(PHASE_LAYOUT, start);
+    if (!laidOut) return 0;
+
+    endMarkdownRange();
+    return 1;
+}
+
+// Scan newly completed lines for block boundaries: a blank line outside a
+// fenced code block ends every open block, so the text before it can be
+// parsed on its own
+static void scanMarkdownLines(void) {
+    size_t pos = stream.scanOffset;
+
+    while (pos < stream.sourceLength) {
+        const char* line = stream.source + pos;
+        const char* newline = memchr(line, '\n', stream.sourceLength - pos);
+        if (!newline) break;
+
+        size_t lineLength = newline - line;
+        size_t indent = 0;
+        while (indent < lineLength && indent < 4 && line[indent] == ' ') indent++;
+
+        int blank = 1;
+        for (size_t i = indent; i < lineLength; i++) {
+            if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+                blank = 0;
+                break;
+            }
+        }
+
+        if (indent < 4 && !blank) {
+            char c = line[indent];
+            int run = 0;
+            while (indent + run < lineLength && line[indent + run] == c) run++;
+
+            if ((c == '`' || c == '~') && run >= 3) {
+                if (!stream.fenceChar) {
+                    stream.fenceChar = c;
+                    stream.fenceLength = run;
+                } else if (c == stream.fenceChar && run >= stream.fenceLength) {
+                    stream.fenceChar = 0;
+                }
+            } else if (!stream.fenceChar && c == '[') {
+                for (size_t i = indent + 1; i + 1 < lineLength; i++) {
+                    if (line[i] == ']' && line[i + 1] == ':') {
+                        stream.hasReferences = 1;
+                        break;
+                    }
+                }
+            }
+        }
+
+        pos += lineLength + 1;
+        if (blank && !stream.fenceChar) {
+            stream.boundary = pos;
+        }
+    }
+
+    stream.scanOffset = pos;
+}
+
+// Buffer the next chunk; it is parsed and laid out by stepStream
+static void feedStream(const char* data, size_t len) {
+    if (stream.kind == STREAM_NONE || stream.failed || stream.inputDone || len == 0) return;
+
+    // HTML handed to lexbor is not needed again
+    if (stream.kind == STREAM_HTML && stream.parsedLength == stream.sourceLength) {
+        stream.sourceLength = 0;
+        stream.parsedLength = 0;
+    }
+
+    if (stream.sourceLength + len + 1 > stream.sourceCapacity) {
+        size_t capacity = stream.sourceCapacity ? stream.sourceCapacity : 16384;
+        while (stream.sourceLength + len + 1 > capacity) capacity *= 2;
+        char* source = pageRealloc(stream.source, capacity);
+        if (!source) {
+            stream.failed = 1;
+            return;
+        }
+        stream.source = source;
+        stream.sourceCapacity = capacity;
+    }
+
+    memcpy(stream.source + stream.sourceLength, data, len);
+    stream.sourceLength += len;
+    stream.source[stream.sourceLength] = '\0';
+
+    if (stream.kind == STREAM_MARKDOWN) {
+        scanMarkdownLines();
+    }
+}
+
+// Markdown: lay out every complete run of blocks, and the rest once all
+// input has arrived. Once reference definitions show up the page is laid out
+// in one go at the end, since they may follow the links that use them.
+static int stepMarkdown(unsigned int deadline) {
+    for (;;) {
+        if (stream.parser || stream.markdown.doc) {
+            if (!stepMarkdownRange(deadline)) return 0;
+            if (stream.failed) return 1;
+        }
+
+        if (stream.inputDone && stream.hasReferences && !stream.relaidOut) {
+            restartStreamLayout();
+            stream.parsedLength = 0;
+            stream.relaidOut = 1;
+        }
+
+        size_t end = stream.inputDone ? stream.sourceLength :
+                     stream.hasReferences ? stream.parsedLength : stream.boundary;
+        if (end <= stream.parsedLength) return stream.inputDone;
+
+        beginMarkdownRange(end);
+        if (stream.failed || pastDeadline(deadline)) return stream.failed;
+    }
+}
+
+// HTML: parse what has arrived a slice at a time, and end the document
+// once all input is in
+// Returns: 1 once the document is complete (or failed to parse)
+static int parseHTML(unsigned int deadline) {
+    while (stream.parsedLength < stream.sourceLength) {
+        size_t length = stream.sourceLength - stream.parsedLength;
+        if (length > PARSE_SLICE) length = PARSE_SLICE;
+        lxb_status_t status = lxb_html_document_parse_chunk(stream.document,
+            (const lxb_char_t*)stream.source + stream.parsedLength, length);
+        stream.parsedLength += length;
+        if (status != LXB_STATUS_OK) {
+            stream.failed = 1;
+            return 1;
+        }
+        if (pastDeadline(deadline)) return 0;
+    }
+    if (!stream.inputDone) return 0;
+
+    if (!stream.parseEnded) {
+        stream.parseEnded = 1;
+        lxb_status_t status = lxb_html_document_parse_chunk_end(stream.document);
+        if (status != LXB_STATUS_OK || !stream.document->body) {
+            pd->system->logToConsole("renderHTML: failed to parse HTML");
+            stream.failed = 1;
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// HTML: parse, then run the site renderer's rules over the finished document
+static int stepHTML(unsigned int deadline) {
+    float start = beginPhase();
+    int parsed = parseHTML(deadline);
+    endPhase(PHASE_PARSE, start);
+    if (!parsed || stream.failed) return parsed;
+
+    start = beginPhase();
+    if (!stream.titleDone) {
+        stream.titleDone = 1;
+        if (stream.renderer->title) {
+            renderPlainText(&stream.ctx, stream.renderer->title);
+            renderNewline(&stream.ctx);
+            renderNewline(&stream.ctx);
+        }
+    }
+
+    int laidOut = matchRules(stream.document, stream.renderer->rules, stream.renderer->ruleCount,
+                             &stream.ctx, &stream.cursor, deadline);
+    endPhase(PHASE_LAYOUT, start);
+    return laidOut;
+}
+
+// Parse and lay out buffered input until the deadline (0 for no limit)
+// Returns: 1 once all input has arrived and been laid out, or the stream failed
+static int stepStream(unsigned int deadline) {
+    if (stream.kind == STREAM_NONE || stream.failed || stream.laidOut) return 1;
+
+    int done = stream.kind == STREAM_MARKDOWN ? stepMarkdown(deadline) : stepHTML(deadline);
+    if (done) {
+        stream.laidOut = 1;
+    } else {
+        // Text on screen may be rasterized before the next slice, so it
+        // must not be extended by it
+        stream.ctx.segmentOpen = 0;
+    }
+    return done;
+}
+
+// Lay out whatever is left once all input has arrived
+// Returns: 1 if the page is ready to draw
+static int finishStream(void) {
+    if (stream.kind == STREAM_NONE) return 0;
+
+    stream.inputDone = 1;
+    stepStream(0);
+    return !stream.failed;
+}
+
+// Bottom of the text laid out so far, including padding
+static int streamContentHeight(void) {
+    return stream.ctx.y + fontCache.fontHeight + 2 * stream.page->padding;
+}
+
+// Update the page height for what has been laid out so far
+static void updateStreamPageHeight(void) {
+    int pageHeight = streamContentHeight();
+    if (pageHeight < SCREEN_HEIGHT) {
+        pageHeight = SCREEN_HEIGHT;
+    }
+    stream.page->height = pageHeight;
+}
+
+// ============================================================================
+// Link Table
+// ============================================================================
+
+// Links are handed to Lua as a userdata over the page's link array, so no
+// tables are built per render and there is no cap on links or segments.
+// The userdata holds a page reference until it is collected.
+#define LINK_TABLE_CLASS "orbit.LinkTable"
+
+static void pushLinkTable(Page* page) {
+    retainPage(page);
+    pd->lua->pushObject(page, LINK_TABLE_CLASS, 0);
+}
+
+// Returns: the link at 1-based Lua argument pos, or NULL if out of range
+static PageLink* getArgLink(Page* page, int pos) {
+    int index = pd->lua->getArgInt(pos) - 1;
+    if (!page || index < 0 || index >= page->layout.linkCount) return NULL;
+    return &page->layout.links[index];
+}
+
+static int linkTableGC(lua_State* L) {
+    (void)L;
+    releasePage(pd->lua->getArgObject(1, LINK_TABLE_CLASS, NULL));
+    return 0;
+}
+
+// links:count() -> number of links on the page
+static int linkTableCount(lua_State* L) {
+    (void)L;
+    Page* page = pd->lua->getArgObject(1, LINK_TABLE_CLASS, NULL);
+    pd->lua->pushInt(page ? page->layout.linkCount : 0);
+    return 1;
+}
+
+// links:url(i) -> URL of link i
+static int linkTableURL(lua_State* L) {
+    (void)L;
+    Page* page = pd->lua->getArgObject(1, LINK_TABLE_CLASS, NULL);
+    PageLink* link = getArgLink(page, 2);
+    if (!link) {
+        pd->lua->pushNil();
+        return 1;
+    }
+    pd->lua->pushBytes(page->layout.text + link->urlOffset, link->urlLength);
+    return 1;
+}
+
+// links:segmentCount(i) -> number of text segments (lines) in link i
+static int linkTableSegmentCount(lua_State* L) {
+    (void)L;
+    Page* page = pd->lua->getArgObject(1, LINK_TABLE_CLASS, NULL);
+    PageLink* link = getArgLink(page, 2);
+    pd->lua->pushInt(link ? link->segmentCount : 0);
+    return 1;
+}
+
+// links:segment(i, j) -> x, y, width of segment j of link i, in content coordinates
+static int linkTableSegment(lua_State* L) {
+    (void)L;
+    Page* page = pd->lua->getArgObject(1, LINK_TABLE_CLASS, NULL);
+    PageLink* link = getArgLink(page, 2);
+    int j = pd->lua->getArgInt(3) - 1;
+    if (!link || j < 0 || j >= link->segmentCount) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    TextSegment* seg = &page->layout.segments[link->firstSegment + j];
+    pd->lua->pushInt(seg->x);
+    pd->lua->pushInt(seg->y);
+    pd->lua->pushInt(seg->width);
+    return 3;
+}
+
+// links:hitTest(x, y, [radius]) -> index of the link under a point in page
+// coordinates (screen y plus scroll offset), or nil
+static int linkTableHitTest(lua_State* L) {
+    (void)L;
+    Page* page = pd->lua->getArgObject(1, LINK_TABLE_CLASS, NULL);
+    if (!page) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    int x = pd->lua->getArgInt(2) - page->padding;
+    int y = pd->lua->getArgInt(3) - page->padding;
+    int radius = pd->lua->argIsNil(4) ? 0 : pd->lua->getArgInt(4);
+
+    int link = hitTestLinks(page, x, y, radius);
+    if (link < 0) {
+        pd->lua->pushNil();
+    } else {
+        pd->lua->pushInt(link + 1);
+    }
+    return 1;
+}
+
+#define RANK_MAX 4
+
+// links:rank(x, y, heading, top, bottom, [count]) -> up to count (default 2)
+// indices of the links on rows [top, bottom) closest to a point, best first.
+// Distance is scaled by up to 3x for links away from heading (degrees, 0 =
+// right, 90 = down), so links the cursor is moving toward come first.
+static int linkTableRank(lua_State* L) {
+    (void)L;
+    Page* page = pd->lua->getArgObject(1, LINK_TABLE_CLASS, NULL);
+    if (!page) return 0;
+
+    float x = pd->lua->getArgFloat(2) - page->padding;
+    float y = pd->lua->getArgFloat(3) - page->padding;
+    float heading = pd->lua->getArgFloat(4) * (float)M_PI / 180.0f;
+    int top = pd->lua->getArgInt(5) - page->padding;
+    int bottom = pd->lua->getArgInt(6) - page->padding;
+    int count = pd->lua->argIsNil(7) ? 2 : pd->lua->getArgInt(7);
+    if (count > RANK_MAX) count = RANK_MAX;
+    if (count < 1) return 0;
+
+    float dirX = cosf(heading), dirY = sinf(heading);
+    int h = fontCache.fontHeight;
+    const PageLayout* layout = &page->layout;
+
+    int best[RANK_MAX];
+    float bestScore[RANK_MAX];
+    int found = 0;
+
+    for (int i = 0; i < layout->linkCount; i++) {
+        const PageLink* link = &layout->links[i];
+        float score = -1;
+
+        for (int j = 0; j < link->segmentCount; j++) {
+            const TextSegment* seg = &layout->segments[link->firstSegment + j];
+            if (seg->y + h <= top || seg->y >= bottom) continue;
+
+            // Nearest point of the segment's line to the cursor
+            float px = x < seg->x ? seg->x : (x > seg->x + seg->width ? seg->x + seg->width : x);
+            float dx = px - x, dy = seg->y + h / 2.0f - y;
+            float distance = sqrtf(dx * dx + dy * dy);
+            float alignment = distance > 0 ? (dx * dirX + dy * dirY) / distance : 1;
+            float segScore = distance * (2 - alignment);
+            if (score < 0 || segScore < score) score = segScore;
+        }
+        if (score < 0) continue;
+
+        // Insert into the sorted shortlist
+        int pos = found < count ? found++ : count;
+        while (pos > 0 && bestScore[pos - 1] > score) {
+            if (pos < count) {
+                best[pos] = best[pos - 1];
+                bestScore[pos] = bestScore[pos - 1];
+            }
+            pos--;
+        }
+        if (pos < count) {
+            best[pos] = i;
+            bestScore[pos] = score;
+        }
+    }
+
+    for (int k = 0; k < found; k++) {
+        pd->lua->pushInt(best[k] + 1);
+    }
+    return found;
+}
+
+static const lua_reg linkTableMethods[] = {
+    { "__gc", linkTableGC },
+    { "hitTest", linkTableHitTest },
+    { "rank", linkTableRank },
+    { "count", linkTableCount },
+    { "url", linkTableURL },
+    { "segmentCount", linkTableSegmentCount },
+    { "segment", linkTableSegment },
+    { NULL, NULL }
+};
+
+static int pushRenderFailure(void) {
+    pd->lua->pushNil();
+    pd->lua->pushNil();
+    return 2;
+}
+
+// Finish the stream, show its page, and return height and link table to Lua
+static int pushFinishedStream(void) {
+    if (!finishStream()) {
+        discardStream();
+        return pushRenderFailure();
+    }
+
+    updateStreamPageHeight();
+    Page* page = stream.page;
+    buildLinkIndex(page);
+    buildWordIndex(page);
+    stats.pages++;
+    if (page == shownPage) {
+        // Bands drawn during the preview have no underlines yet
+        invalidateTiles();
+    }
+    showPage(page);
+    commitCacheStore();
+    discardStream();
+
+    pd->lua->pushInt(page->height);
+    pushLinkTable(page);
+    return 2;
+}
+
+// Start an HTML stream; fails if no site renderer handles the URL
+static int beginHTMLStream(const char* url, int pageWidth, int pagePadding, int tracking) {
+    // Find site-specific renderer
+    const SiteRenderer* renderer = findRenderer(url);
+    if (!renderer) {
+        pd->system->logToConsole("renderHTML: no renderer for URL: %s", url);
+        return 0;
+    }
+
+    if (!beginStream(STREAM_HTML, url, pageWidth, pagePadding, tracking)) {
+        return 0;
+    }
+    stream.renderer = renderer;
+
+    // Borrowed from the HTML engine until the stream is discarded
+    stream.document = acquireHTMLDocument();
+    if (!stream.document ||
+        lxb_html_document_parse_chunk_begin(stream.document) != LXB_STATUS_OK) {
+        pd->system->logToConsole("renderHTML: failed to create document");
+        discardStream();
+        return 0;
+    }
+    return 1;
+}
+
+// ============================================================================
+// Page Cache
+// ============================================================================
+
+// Recently shown pages are kept laid out, with the reader's scroll position,
+// so going back to one redraws it straight away. The cache holds at most
+// PAGE_CACHE_SIZE pages within PAGE_CACHE_BUDGET bytes, and is emptied when
+// building a new page runs out of memory.
+#define PAGE_CACHE_SIZE 6
+#define PAGE_CACHE_BUDGET (1024 * 1024)
+
+typedef struct {
+    Page* page;
+    char* url;
+    int top;
+    uint32_t lastUsed;
+} CachedPage;
+
+static struct {
+    CachedPage entries[PAGE_CACHE_SIZE];
+    uint32_t clock;
+} pageCache;
+
+static size_t pageFootprint(const Page* page) {
+    const PageLayout* layout = &page->layout;
+    const LinkIndex* index = &page->linkIndex;
+    const WordIndex* words = &page->wordIndex;
+    int entryCount = index->lineCount ? index->lineStart[index->lineCount] : 0;
+    return sizeof(Page) + layout->textCapacity +
+           layout->segmentCapacity * sizeof(TextSegment) +
+           layout->linkCapacity * sizeof(PageLink) +
+           layout->imageCapacity * sizeof(PageImage) +
+           layout->wordCapacity * sizeof(uint32_t) +
+           (index->lineCount + 1) * sizeof(int) +
+           entryCount * sizeof(LinkIndexEntry) +
+           (words->bucketCount ? (words->bucketCount + 1) * sizeof(int) : 0) +
+           (words->bucketCount ? layout->wordCount * sizeof(uint32_t) : 0);
+}
+
+static void evictCachedPage(CachedPage* entry) {
+    releasePage(entry->page);
+    if (entry->url) heapRealloc(entry->url, 0);
+    memset(entry, 0, sizeof(CachedPage));
+}
+
+static void trimPageCache(size_t budget) {
+    for (;;) {
+        size_t total = 0;
+        CachedPage* oldest = NULL;
+        for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
+            CachedPage* entry = &pageCache.entries[i];
+            if (!entry->page) continue;
+            total += pageFootprint(entry->page);
+            if (!oldest || entry->lastUsed < oldest->lastUsed) oldest = entry;
+        }
+        if (!oldest || total <= budget) return;
+        evictCachedPage(oldest);
+    }
+}
+
+static CachedPage* findCachedPage(const char* url) {
+    for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
+        CachedPage* entry = &pageCache.entries[i];
+        if (entry->page && strcmp(entry->url, url) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Remember the shown page as url, scrolled to top
+// Args: url, top
+// Returns: true if url wasn't remembered before
+static int rememberPage(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    if (!url || !shownPage) return 0;
+
+    CachedPage* entry = findCachedPage(url);
+    int added = entry == NULL;
+    if (!entry) {
+        // An empty slot, or the least recently used one
+        entry = &pageCache.entries[0];
+        for (int i = 0; i < PAGE_CACHE_SIZE && entry->page; i++) {
+            CachedPage* candidate = &pageCache.entries[i];
+            if (!candidate->page || candidate->lastUsed < entry->lastUsed) entry = candidate;
+        }
+        evictCachedPage(entry);
+
+        size_t length = strlen(url);
+        entry->url = heapRealloc(NULL, length + 1);
+        if (!entry->url) return 0;
+        memcpy(entry->url, url, length + 1);
+    }
+
+    if (entry->page != shownPage) {
+        releasePage(entry->page);
+        retainPage(shownPage);
+        entry->page = shownPage;
+    }
+    entry->top = pd->lua->getArgInt(2);
+    entry->lastUsed = ++pageCache.clock;
+
+    trimPageCache(PAGE_CACHE_BUDGET);
+    pd->lua->pushBool(added);
+    return 1;
+}
+
+// Drop a remembered page, as when the navigation that remembered it
+// couldn't load anything
+// Args: url
+static int forgetPage(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    CachedPage* entry = url ? findCachedPage(url) : NULL;
+    if (entry) evictCachedPage(entry);
+    return 0;
+}
+
+// Show a remembered page
+// Args: url
+// Returns: pageHeight, links (LinkTable), top, or nil if it isn't remembered
+static int recallPage(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    CachedPage* entry = url ? findCachedPage(url) : NULL;
+    if (!entry) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    entry->lastUsed = ++pageCache.clock;
+    showPage(entry->page);
+    pd->lua->pushInt(entry->page->height);
+    pushLinkTable(entry->page);
+    pd->lua->pushInt(entry->top);
+    return 3;
+}
+
+// ============================================================================
+// Lua Render API
+// ============================================================================
+
+// Pure render function - parse markdown, show the page, return its links
+// Args: markdown, pageWidth, pagePadding, tracking
+// Returns: pageHeight, links (LinkTable)
+static int renderPage(lua_State* L) {
+    (void)L;
+
+    if (!fontCache.font) {
+        pd->system->logToConsole("renderPage: font not loaded");
+        return pushRenderFailure();
+    }
+
+    const char* markdown = pd->lua->getArgString(1);
+    int pageWidth = pd->lua->getArgInt(2);
+    int pagePadding = pd->lua->getArgInt(3);
+    int tracking = pd->lua->getArgInt(4);
+
+    if (!markdown) {
+        return pushRenderFailure();
+    }
+
+    if (!beginStream(STREAM_MARKDOWN, NULL, pageWidth, pagePadding, tracking)) {
+        return pushRenderFailure();
+    }
+    feedStream(markdown, strlen(markdown));
+    return pushFinishedStream();
+}
+
+// Render HTML page using site-specific renderer and show it
+// Args: htmlString, url, pageWidth, pagePadding, tracking
+// Returns: pageHeight, links (LinkTable)
+static int renderHTML(lua_State* L) {
+    (void)L;
+
+    if (!fontCache.font) {
+        pd->system->logToConsole("renderHTML: font not loaded");
+        return pushRenderFailure();
+    }
+
+    const char* html = pd->lua->getArgString(1);
+    const char* url = pd->lua->getArgString(2);
+    int pageWidth = pd->lua->getArgInt(3);
+    int pagePadding = pd->lua->getArgInt(4);
+    int tracking = pd->lua->getArgInt(5);
+
+    if (!html || !url) {
+        pd->system->logToConsole("renderHTML: missing arguments");
+        return pushRenderFailure();
+    }
+
+    if (!beginHTMLStream(url, pageWidth, pagePadding, tracking)) {
+        return pushRenderFailure();
+    }
+
+    feedStream(html, strlen(html));
+    return pushFinishedStream();
+}
+
+// Start streaming a markdown page
+// Args: pageWidth, pagePadding, tracking, [url] (for relative image sources)
+// Returns: true if the stream started
+static int startMarkdownStream(lua_State* L) {
+    (void)L;
+
+    if (!fontCache.font) {
+        pd->system->logToConsole("cmark.beginStream: font not loaded");
+        pd->lua->pushBool(0);
+        return 1;
+    }
+
+    const char* url = pd->lua->argIsNil(4) ? NULL : pd->lua->getArgString(4);
+    pd->lua->pushBool(beginStream(STREAM_MARKDOWN, url, pd->lua->getArgInt(1),
+                                  pd->lua->getArgInt(2), pd->lua->getArgInt(3)));
+    return 1;
+}
+
+// Check whether a site renderer handles an HTML page
+// Args: url
+// Returns: true if html.beginStream would accept the URL
+static int canRenderHTML(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    pd->lua->pushBool(url && findRenderer(url) != NULL);
+    return 1;
+}
+
+// Start streaming an HTML page
+// Args: url, pageWidth, pagePadding, tracking
+// Returns: true if a site renderer handles the URL
+static int startHTMLStream(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    if (!fontCache.font || !url) {
+        pd->system->logToConsole("html.beginStream: font not loaded or missing URL");
+        pd->lua->pushBool(0);
+        return 1;
+    }
+
+    pd->lua->pushBool(beginHTMLStream(url, pd->lua->getArgInt(2),
+                                      pd->lua->getArgInt(3), pd->lua->getArgInt(4)));
+    return 1;
+}
+
+// Decoded body bytes go to the page and to the response cache
+static void deliverBody(const char* data, size_t len) {
+    feedStream(data, len);
+    cacheStoreChunk(data, len);
+}
+
+// Decode the rest of the streamed page's body
+// Args: encoding (the Content-Encoding header)
+// Returns: false if the encoding isn't supported
+static int setPageEncoding(lua_State* L) {
+    (void)L;
+
+    const char* encoding = pd->lua->getArgString(1);
+    int ok = stream.kind != STREAM_NONE && encoding && beginInflate(&bodyInflater, encoding, deliverBody);
+    if (!ok) {
+        pd->system->logToConsole("setEncoding: can't decode %s", encoding ? encoding : "(nil)");
+        stream.failed = 1;
+    }
+    pd->lua->pushBool(ok);
+    return 1;
+}
+
+// Buffer the next chunk of the page being streamed; step lays it out
+// Args: chunk (still compressed if an encoding was set)
+// Returns: height of the content laid out so far (not padded to the screen)
+static int feedPage(lua_State* L) {
+    (void)L;
+
+    size_t len;
+    const char* chunk = pd->lua->getArgBytes(1, &len);
+    if (chunk && bodyInflater.coding != CODING_IDENTITY) {
+        if (!inflateChunk(&bodyInflater, chunk, len)) stream.failed = 1;
+    } else if (chunk) {
+        deliverBody(chunk, len);
+    }
+
+    if (stream.kind == STREAM_NONE) {
+        pd->lua->pushInt(0);
+        return 1;
+    }
+
+    updateStreamPageHeight();
+    pd->lua->pushInt(streamContentHeight());
+    return 1;
+}
+
+// Parse and lay out buffered chunks for up to budgetMs milliseconds
+// Args: budgetMs
+// Returns: height of the content laid out so far, true once all input has
+// been fed (see endInput) and laid out
+static int stepPage(lua_State* L) {
+    (void)L;
+
+    int budget = pd->lua->getArgInt(1);
+    if (budget < 1) budget = 1;
+    int done = stepStream(pd->system->getCurrentTimeMilliseconds() + budget);
+
+    if (stream.kind == STREAM_NONE) {
+        pd->lua->pushInt(0);
+        pd->lua->pushBool(done);
+        return 2;
+    }
+
+    updateStreamPageHeight();
+    pd->lua->pushInt(streamContentHeight());
+    pd->lua->pushBool(done);
+    return 2;
+}
+
+// Mark the end of the streamed page's input. A body cut short is shown as
+// far as it got but never cached, so it can't be revalidated as complete.
+// Args: complete (optional, false if the connection failed)
+// Returns: true if the whole body arrived
+static int endPageInput(lua_State* L) {
+    (void)L;
+
+    int complete = pd->lua->getArgType(1, NULL) == kTypeNil || pd->lua->getArgBool(1);
+    if (complete && bodyInflater.coding != CODING_IDENTITY && !inflateComplete(&bodyInflater)) {
+        pd->system->logToConsole("inflate: body ended early");
+        complete = 0;
+    }
+    if (!complete) {
+        abortCacheStore();
+    }
+    if (stream.kind != STREAM_NONE && !stream.inputDone) {
+        endPhase(PHASE_NETWORK, stats.streamStart);
+    }
+    stream.inputDone = 1;
+    pd->lua->pushBool(complete);
+    return 1;
+}
+
+// Drop the streamed page, its parser, inflater and partly written cache
+// file, as when its load fails before anything of it is shown
+static int cancelPage(lua_State* L) {
+    (void)L;
+    discardStream();
+    return 0;
+}
+
+// Show what has been laid out so far, without links, while the rest loads;
+// tiles keep up with the layout as more chunks are fed
+// Returns: pageHeight, or nil if there is nothing to show
+static int previewPage(lua_State* L) {
+    (void)L;
+
+    if (stream.kind == STREAM_NONE || stream.failed) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    updateStreamPageHeight();
+    showPage(stream.page);
+    pd->lua->pushInt(stream.page->height);
+    return 1;
+}
+
+// Lay out the rest of the streamed page and show it
+// Returns: pageHeight, links (LinkTable)
+static int finishPage(lua_State* L) {
+    (void)L;
+    return pushFinishedStream();
+}
+
+// Feed the cached body of url into the current stream
+// Returns: 0 if it isn't cached or can't be read
+static int loadCachedPage(const char* url) {
+    loadCacheIndex();
+    int i = findCacheEntry(url);
+    if (i < 0 || stream.kind == STREAM_NONE) return 0;
+
+    CacheEntry* entry = &responseCache.entries[i];
+    char path[32];
+    cacheBodyPath(path, sizeof(path), entry->hash);
+    SDFile* file = pd->file->open(path, kFileReadData);
+    if (!file) {
+        removeCacheEntry(i);
+        saveCacheIndex();
+        return 0;
+    }
+
+    char buffer[4096];
+    int length;
+    while ((length = pd->file->read(file, buffer, sizeof(buffer))) > 0) {
+        feedStream(buffer, length);
+    }
+    pd->file->close(file);
+    if (length < 0) return 0;
+
+    entry->used = pd->system->getSecondsSinceEpoch(NULL);
+    saveCacheIndex();
+    return 1;
+}
+
+// Look up a cached page
+// Args: url
+// Returns: age in seconds, etag, lastModified (nil where absent), or nil if not cached
+static int cacheLookup(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    loadCacheIndex();
+    int i = url ? findCacheEntry(url) : -1;
+    if (i < 0) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    CacheEntry* entry = &responseCache.entries[i];
+    unsigned int now = pd->system->getSecondsSinceEpoch(NULL);
+    pd->lua->pushInt(now > entry->stored ? (int)(now - entry->stored) : 0);
+    if (entry->etag[0]) pd->lua->pushString(entry->etag);
+    else pd->lua->pushNil();
+    if (entry->lastModified[0]) pd->lua->pushString(entry->lastModified);
+    else pd->lua->pushNil();
+    return 3;
+}
+
+// Restart a cached page's freshness after the server confirmed it (a 304),
+// so it isn't revalidated again until it goes stale
+// Args: url
+static int cacheTouch(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    loadCacheIndex();
+    int i = url ? findCacheEntry(url) : -1;
+    if (i >= 0) {
+        responseCache.entries[i].stored = pd->system->getSecondsSinceEpoch(NULL);
+        saveCacheIndex();
+    }
+    return 0;
+}
+
+// Cache the body of the page being streamed once it renders
+// Args: url, [etag], [lastModified]
+// Returns: true if the body is being stored
+static int cacheStore(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    const char* etag = pd->lua->argIsNil(2) ? NULL : pd->lua->getArgString(2);
+    const char* lastModified = pd->lua->argIsNil(3) ? NULL : pd->lua->getArgString(3);
+    pd->lua->pushBool(url && beginCacheStore(url, etag, lastModified));
+    return 1;
+}
+
+// Feed a cached page into the open stream
+// Args: url
+// Returns: true if it was cached
+static int cacheLoad(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    pd->lua->pushBool(url && loadCachedPage(url));
+    return 1;
+}
+
+// Laid-out pages are saved next to their cached bodies, so a revisit skips
+// parsing and layout: the file holds the segments, their text, the links and
+// the geometry they were laid out for, and is only used if all of it matches
+#define LAYOUT_MAGIC 0x3350524fu  // "ORP3", changed with the format or line breaking
+
+typedef struct {
+    uint32_t magic;
+    uint32_t fontKey;
+    int32_t width, padding, tracking, height;
+    uint32_t urlLength;
+    uint32_t textLength;
+    int32_t segmentCount;
+    int32_t linkCount;
+    int32_t imageCount;
+} LayoutHeader;
+
+static int writeAll(SDFile* file, const void* data, size_t len) {
+    return len == 0 || pd->file->write(file, data, (unsigned int)len) == (int)len;
+}
+
+static int readAll(SDFile* file, void* data, size_t len) {
+    return len == 0 || pd->file->read(file, data, (unsigned int)len) == (int)len;
+}
+
+// Save the layout of a page whose body is cached under url
+static void saveLayout(const Page* page, const char* url) {
+    loadCacheIndex();
+    int i = findCacheEntry(url);
+    if (i < 0) return;
+
+    const PageLayout* layout = &page->layout;
+    LayoutHeader header = {
+        .magic = LAYOUT_MAGIC,
+        .fontKey = fontCache.fontKey,
+        .width = page->width,
+        .padding = page->padding,
+        .tracking = page->tracking,
+        .height = page->height,
+        .urlLength = (uint32_t)strlen(url),
+        .textLength = (uint32_t)layout->textLength,
+        .segmentCount = layout->segmentCount,
+        .linkCount = layout->linkCount,
+        .imageCount = layout->imageCount,
+    };
+
+    char path[32];
+    cacheLayoutPath(path, sizeof(path), responseCache.entries[i].hash);
+    FileStat stat;
+    uint32_t oldSize = pd->file->stat(path, &stat) == 0 ? (uint32_t)stat.size : 0;
+    uint32_t size = (uint32_t)(sizeof(header) + header.urlLength + layout->textLength +
+                               layout->segmentCount * sizeof(TextSegment) +
+                               layout->linkCount * sizeof(PageLink) +
+                               layout->imageCount * sizeof(PageImage));
+
+    SDFile* file = pd->file->open(path, kFileWrite);
+    int ok = file &&
+             writeAll(file, &header, sizeof(header)) &&
+             writeAll(file, url, header.urlLength) &&
+             writeAll(file, layout->text, layout->textLength) &&
+             writeAll(file, layout->segments, layout->segmentCount * sizeof(TextSegment)) &&
+             writeAll(file, layout->links, layout->linkCount * sizeof(PageLink)) &&
+             writeAll(file, layout->images, layout->imageCount * sizeof(PageImage));
+    if (file) pd->file->close(file);
+    if (!ok) {
+        pd->file->unlink(path, 0);
+        size = 0;
+    }
+
+    // The layout counts toward its entry's size, in place of the one it
+    // replaces, so eviction keeps bodies and layouts within the budget
+    CacheEntry* entry = &responseCache.entries[i];
+    if (oldSize > entry->size) oldSize = entry->size;
+    entry->size = entry->size - oldSize + size;
+    responseCache.totalSize = responseCache.totalSize - oldSize + size;
+    makeCacheRoom(0);
+    saveCacheIndex();
+}
+
+// A string in the arena: inside it, without overflowing, and NUL-terminated
+static int arenaStringIsValid(const PageLayout* layout, uint32_t offset, uint32_t length) {
+    return offset < layout->textLength && length < layout->textLength - offset &&
+           layout->text[offset + length] == '\0';
+}
+
+// Every segment's text, every link's URL and segments, and every image's URL
+// must lie inside the page, and segments and images within its height, with
+// segments top to bottom: the link index is sized from the last segment
+static int layoutIsConsistent(const PageLayout* layout, int height) {
+    int h = fontCache.fontHeight;
+    int lastY = 0;
+    if (height < 0) return 0;
+    for (int i = 0; i < layout->segmentCount; i++) {
+        const TextSegment* seg = &layout->segments[i];
+        if (!arenaStringIsValid(layout, seg->offset, seg->length)) return 0;
+        if (seg->y < lastY || seg->y > height - h) return 0;
+        lastY = seg->y;
+    }
+    for (int i = 0; i < layout->linkCount; i++) {
+        const PageLink* link = &layout->links[i];
+        if (!arenaStringIsValid(layout, link->urlOffset, link->urlLength) ||
+            link->firstSegment < 0 || link->segmentCount < 0 ||
+            link->firstSegment > layout->segmentCount ||
+            link->segmentCount > layout->segmentCount - link->firstSegment) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < layout->imageCount; i++) {
+        const PageImage* image = &layout->images[i];
+        if (!arenaStringIsValid(layout, image->urlOffset, image->urlLength) ||
+            image->y < 0 || image->height < 1 || image->y > height - image->height) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Read a saved layout, checking it was made for url, this font and this geometry
+// Returns: a page with one reference, or NULL
+static Page* readLayout(SDFile* file, const char* url, int width, int padding, int tracking) {
+    LayoutHeader header;
+    if (!readAll(file, &header, sizeof(header)) ||
+        header.magic != LAYOUT_MAGIC || header.fontKey != fontCache.fontKey ||
+        header.width != width || header.padding != padding || header.tracking != tracking ||
+        header.urlLength != strlen(url) || header.textLength == 0 ||
+        header.segmentCount < 0 || header.linkCount < 0 || header.imageCount < 0) {
+        return NULL;
+    }
+
+    char savedURL[CACHE_URL_SIZE];
+    if (header.urlLength >= sizeof(savedURL) || !readAll(file, savedURL, header.urlLength) ||
+        memcmp(savedURL, url, header.urlLength) != 0) {
+        return NULL;
+    }
+
+    Page* page = newPage(width, padding);
+    if (!page) return NULL;
+    page->tracking = tracking;
+    page->height = header.height;
+
+    PageLayout* layout = &page->layout;
+    layout->text = pageRealloc(NULL, header.textLength);
+    layout->segments = pageRealloc(NULL, (header.segmentCount + 1) * sizeof(TextSegment));
+    layout->links = pageRealloc(NULL, (header.linkCount + 1) * sizeof(PageLink));
+    layout->images = pageRealloc(NULL, (header.imageCount + 1) * sizeof(PageImage));
+    if (!layout->text || !layout->segments || !layout->links || !layout->images) {
+        releasePage(page);
+        return NULL;
+    }
+
+    layout->textCapacity = layout->textLength = header.textLength;
+    layout->segmentCapacity = header.segmentCount + 1;
+    layout->segmentCount = header.segmentCount;
+    layout->linkCapacity = header.linkCount + 1;
+    layout->linkCount = header.linkCount;
+    layout->imageCapacity = header.imageCount + 1;
+    layout->imageCount = header.imageCount;
+
+    if (!readAll(file, layout->text, layout->textLength) ||
+        !readAll(file, layout->segments, layout->segmentCount * sizeof(TextSegment)) ||
+        !readAll(file, layout->links, layout->linkCount * sizeof(PageLink)) ||
+        !readAll(file, layout->images, layout->imageCount * sizeof(PageImage)) ||
+        !layoutIsConsistent(layout, page->height)) {
+        releasePage(page);
+        return NULL;
+    }
+
+    // Word starts aren't saved; each segment starts afresh, as when laid out
+    for (int i = 0; i < layout->segmentCount; i++) {
+        indexWords(layout, layout->segments[i].offset, layout->segments[i].length, 0);
+    }
+    return page;
+}
+
+// Load the saved layout of a cached page
+// Returns: a page with one reference, or NULL if there is no usable layout
+static Page* loadLayout(const char* url, int width, int padding, int tracking) {
+    loadCacheIndex();
+    int i = findCacheEntry(url);
+    if (i < 0) return NULL;
+
+    char path[32];
+    cacheLayoutPath(path, sizeof(path), responseCache.entries[i].hash);
+    SDFile* file = pd->file->open(path, kFileReadData);
+    if (!file) return NULL;
+
+    Page* page = readLayout(file, url, width, padding, tracking);
+    pd->file->close(file);
+
+    if (page) {
+        responseCache.entries[i].used = pd->system->getSecondsSinceEpoch(NULL);
+        saveCacheIndex();
+    }
+    return page;
+}
+
+// Save the shown page's layout for the next visit to url
+// Args: url
+static int cacheSaveLayout(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    if (url && shownPage) {
+        saveLayout(shownPage, url);
+    }
+    return 0;
+}
+
+// Show the saved layout of a cached page
+// Args: url, pageWidth, pagePadding, tracking
+// Returns: pageHeight, links (LinkTable), or nil if there is no usable layout
+static int cacheShowLayout(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    Page* page = url ? loadLayout(url, pd->lua->getArgInt(2), pd->lua->getArgInt(3),
+                                  pd->lua->getArgInt(4)) : NULL;
+    if (!page) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    buildLinkIndex(page);
+    buildWordIndex(page);
+    showPage(page);
+    releasePage(page);
+
+    pd->lua->pushInt(page->height);
+    pushLinkTable(page);
+    return 2;
+}
+
+// Draw the shown page into the current context, scrolled to top; only the
+// bands overlapping the dirty rows are drawn, and one band ahead in the
+// scrolling direction is rasterized so it is ready when it comes into view.
+// The hovered link gets a second underline row drawn over the bands.
+// Args: top, y, height (dirty rows on screen), [hoveredLink]
+static int drawPage(lua_State* L) {
+    (void)L;
+
+    int top = pd->lua->getArgInt(1);
+    int y = pd->lua->getArgInt(2);
+    int height = pd->lua->getArgInt(3);
+    if (height <= 0) {
+        y = 0;
+        height = SCREEN_HEIGHT;
+    }
+
+    Page* page = shownPage;
+    if (!page) {
+        pd->graphics->fillRect(0, y, LCD_COLUMNS, height, kColorWhite);
+        return 0;
+    }
+
+    int lastBand = (page->height - 1) / TILE_HEIGHT;
+    int first = (top + y) / TILE_HEIGHT;
+    int last = (top + y + height - 1) / TILE_HEIGHT;
+    if (first < 0) first = 0;
+    if (last > lastBand) last = lastBand;
+
+    for (int i = first; i <= last; i++) {
+        Tile* tile = getTile(page, i);
+        if (tile) {
+            pd->graphics->drawBitmap(tile->bitmap, 0, i * TILE_HEIGHT - top, kBitmapUnflipped);
+        }
+    }
+
+    int hovered = pd->lua->argIsNil(4) ? -1 : pd->lua->getArgInt(4) - 1;
+    if (hovered >= 0 && hovered < page->layout.linkCount) {
+        PageLink* link = &page->layout.links[hovered];
+        int h = fontCache.fontHeight;
+        for (int j = 0; j < link->segmentCount; j++) {
+            TextSegment* seg = &page->layout.segments[link->firstSegment + j];
+            pd->graphics->fillRect(page->padding + seg->x, page->padding + seg->y + h - 1 - top,
+                                   seg->width + 1, 1, kColorBlack);
+        }
+    }
+
+    int ahead = top >= tileCache.lastTop
+        ? (top + SCREEN_HEIGHT - 1) / TILE_HEIGHT + 1
+        : top / TILE_HEIGHT - 1;
+    if (ahead >= 0 && ahead <= lastBand && !isTileCached(ahead)) {
+        getTile(page, ahead);
+    }
+    tileCache.lastTop = top;
+
+    return 0;
+}
+
+// ============================================================================
+// Lua Image API
+// ============================================================================
+
+// Lua fetches the shown page's images one at a time, nearest the screen
+// first, and they are decoded here in slices like pages are
+
+// The shown page's image with this URL, or NULL if it has none
+static const PageImage* findPageImage(const char* url) {
+    if (!shownPage) return NULL;
+    const PageLayout* layout = &shownPage->layout;
+    for (int i = 0; i < layout->imageCount; i++) {
+        if (strcmp(layout->text + layout->images[i].urlOffset, url) == 0) return &layout->images[i];
+    }
+    return NULL;
+}
+
+// The next image on the shown page still to be loaded: the first that reaches
+// down to top or below, else the last one above it
+// Args: top
+// Returns: url, or nil once all are loaded
+static int nextImage(lua_State* L) {
+    (void)L;
+
+    int top = pd->lua->getArgInt(1);
+    const char* above = NULL;
+    if (shownPage) {
+        const PageLayout* layout = &shownPage->layout;
+        for (int i = 0; i < layout->imageCount; i++) {
+            const PageImage* image = &layout->images[i];
+            const char* url = layout->text + image->urlOffset;
+            if (findImage(url) || (imageLoad.active && strcmp(url, imageLoad.url) == 0)) continue;
+
+            if (shownPage->padding + image->y + image->height > top) {
+                pd->lua->pushString(url);
+                return 1;
+            }
+            above = url;
+        }
+    }
+
+    if (above) {
+        pd->lua->pushString(above);
+    } else {
+        pd->lua->pushNil();
+    }
+    return 1;
+}
+
+// Start decoding one of the shown page's images, to fit its box
+// Args: url
+// Returns: false if the shown page has no such image
+static int beginImage(lua_State* L) {
+    (void)L;
+
+    const char* url = pd->lua->getArgString(1);
+    const PageImage* image = url ? findPageImage(url) : NULL;
+    if (!image) {
+        pd->lua->pushBool(0);
+        return 1;
+    }
+    beginImageLoad(url, image->width, image->height);
+    pd->lua->pushBool(1);
+    return 1;
+}
+
+// Buffer the next chunk of the image; stepImage decodes it
+// Args: chunk
+static int feedImage(lua_State* L) {
+    (void)L;
+
+    size_t len;
+    const char* chunk = pd->lua->getArgBytes(1, &len);
+    if (chunk && imageLoad.active && !feedImageLoad(chunk, len)) {
+        storeImage(imageLoad.url, NULL, 0, 0);
+        endImageLoad();
+    }
+    return 0;
+}
+
+// Mark the end of the image's input
+// Args: ok (false if the download failed, so the image isn't tried again)
+static int endImageInput(lua_State* L) {
+    (void)L;
+
+    if (!imageLoad.active) return 0;
+    if (pd->lua->getArgBool(1)) {
+        imageLoad.inputDone = 1;
+    } else {
+        storeImage(imageLoad.url, NULL, 0, 0);
+        endImageLoad();
+    }
+    return 0;
+}
+
+// Decode buffered input for up to budgetMs milliseconds
+// Args: budgetMs
+// Returns: nil while decoding, then true once the image is drawn on the page,
+// or false if it couldn't be read
+static int stepImage(lua_State* L) {
+    (void)L;
+
+    int budget = pd->lua->getArgInt(1);
+    if (budget < 1) budget = 1;
+
+    char url[IMAGE_URL_SIZE];
+    snprintf(url, sizeof(url), "%s", imageLoad.url);
+    if (imageLoad.active && !stepImageLoad(pd->system->getCurrentTimeMilliseconds() + budget)) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    const CachedImage* cached = url[0] ? findImage(url) : NULL;
+    if (cached && cached->ink) invalidateImageTiles(url);
+    pd->lua->pushBool(cached && cached->ink);
+    return 1;
+}
+
+// Drop the image being loaded, as when leaving its page
+static int cancelImage(lua_State* L) {
+    (void)L;
+    endImageLoad();
+    return 0;
+}
+
+// ============================================================================
+// Find in Page (Lua)
+// ============================================================================
+
+#define FIND_MAX_TERMS 8
+#define FIND_MAX_MATCHES 256
+
+// A query word
+typedef struct {
+    const char* text;
+    int length;
+} FindTerm;
+
+// Where a match starts on the page, and its width on its first line
+typedef struct {
+    int x;
+    int y;
+    int width;
+} FindMatch;
+
+static struct {
+    int count;
+    FindMatch matches[FIND_MAX_MATCHES];
+} findResults;
+
+// Split a query into its words
+static int splitQuery(const char* query, FindTerm* terms) {
+    int len = (int)strlen(query);
+    int count = 0;
+    int pos = 0;
+
+    while (pos < len && count < FIND_MAX_TERMS) {
+        int start = pos;
+        if (!isWordChar(decodeUTF8(query, len, &pos))) continue;
+
+        int end = pos;
+        while (end < len) {
+            int next = end;
+            if (!isWordChar(decodeUTF8(query, len, &next))) break;
+            end = next;
+        }
+        terms[count].text = query + start;
+        terms[count].length = end - start;
+        count++;
+        pos = end;
+    }
+    return count;
+}
+
+// Index of the segment holding an arena offset
+static int segmentAtOffset(const PageLayout* layout, uint32_t offset) {
+    int lo = 0;
+    int hi = layout->segmentCount - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (layout->segments[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Compare the page text at pos, up to end, with a term, ignoring case.
+// A whole term must not run on into more of the word.
+// Returns: 1 and moves pos past the term on a match, 0 otherwise
+static int matchTerm(const char* text, int end, int* pos, const FindTerm* term, int whole) {
+    int p = *pos;
+    int q = 0;
+
+    while (q < term->length) {
+        if (p >= end) return 0;
+        uint32_t a = foldCase(decodeUTF8(text, end, &p));
+        uint32_t b = foldCase(decodeUTF8(term->text, term->length, &q));
+        if (a != b) return 0;
+    }
+    if (whole && p < end) {
+        int next = p;
+        if (isWordChar(decodeUTF8(text, end, &next))) return 0;
+    }
+
+    *pos = p;
+    return 1;
+}
+
+// Match the terms against the words starting at pos in a segment, following
+// the text onto later lines between terms. The last term may be the start of
+// a longer word, so matches show up while the query is still being typed.
+// Returns: 1 with firstEnd set to where the match leaves its first segment,
+// 0 if it doesn't match
+static int matchAt(const PageLayout* layout, int segment, int pos,
+                   const FindTerm* terms, int termCount, int* firstEnd) {
+    const TextSegment* seg = &layout->segments[segment];
+    int end = (int)(seg->offset + seg->length);
+    int inFirst = 1;
+    *firstEnd = end;
+
+    for (int i = 0; i < termCount; i++) {
+        // Skip to the next word
+        while (i > 0) {
+            while (pos < end) {
+                int next = pos;
+                if (isWordChar(decodeUTF8(layout->text, end, &next))) break;
+                pos = next;
+            }
+            if (pos < end) break;
+            if (++segment >= layout->segmentCount) return 0;
+            seg = &layout->segments[segment];
+            pos = (int)seg->offset;
+            end = (int)(seg->offset + seg->length);
+            inFirst = 0;
+        }
+
+        if (!matchTerm(layout->text, end, &pos, &terms[i], i < termCount - 1)) return 0;
+        if (inFirst) *firstEnd = pos;
+    }
+    return 1;
+}
+
+// Find a query on the shown page, ignoring case and punctuation. Only the
+// words whose first letters match the query's are checked, from the word
+// index; short queries and pages still streaming check every word.
+// Args: query
+// Returns: the number of matches, at most FIND_MAX_MATCHES, in page order
+static int findInPage(lua_State* L) {
+    (void)L;
+
+    findResults.count = 0;
+    const char* query = pd->lua->getArgString(1);
+    FindTerm terms[FIND_MAX_TERMS];
+    int termCount = (query && shownPage) ? splitQuery(query, terms) : 0;
+    if (termCount == 0) {
+        pd->lua->pushInt(0);
+        return 1;
+    }
+
+    const Page* page = shownPage;
+    const PageLayout* layout = &page->layout;
+    const WordIndex* index = &page->wordIndex;
+    const uint32_t* candidates = layout->words;
+    int candidateCount = layout->wordCount;
+
+    int chars;
+    uint32_t key = wordKey(terms[0].text, terms[0].length, 0, &chars);
+    if (chars == FIND_KEY_CHARS && index->bucketCount) {
+        int bucket = (int)(key & (index->bucketCount - 1));
+        candidates = index->entries + index->bucketStart[bucket];
+        candidateCount = index->bucketStart[bucket + 1] - index->bucketStart[bucket];
+    }
+
+    for (int i = 0; i < candidateCount && findResults.count < FIND_MAX_MATCHES; i++) {
+        uint32_t offset = candidates[i];
+        int segment = segmentAtOffset(layout, offset);
+        int firstEnd;
+        if (!matchAt(layout, segment, (int)offset, terms, termCount, &firstEnd)) continue;
+
+        const TextSegment* seg = &layout->segments[segment];
+        FindMatch* match = &findResults.matches[findResults.count++];
+        match->x = page->padding + seg->x +
+                   measureText(segmentText(layout, seg), (int)(offset - seg->offset));
+        match->y = page->padding + seg->y;
+        match->width = measureText(layout->text + offset, firstEnd - (int)offset);
+    }
+
+    pd->lua->pushInt(findResults.count);
+    return 1;
+}
+
+// Where a match from the last find is on the page
+// Args: index (1-based)
+// Returns: x, y, width, height, or nil if there is no such match
+static int findMatch(lua_State* L) {
+    (void)L;
+
+    int i = pd->lua->getArgInt(1) - 1;
+    if (i < 0 || i >= findResults.count) {
+        pd->lua->pushNil();
+        return 1;
+    }
+
+    const FindMatch* match = &findResults.matches[i];
+    pd->lua->pushInt(match->x);
+    pd->lua->pushInt(match->y);
+    pd->lua->pushInt(match->width);
+    pd->lua->pushInt(fontCache.fontHeight);
+    return 4;
+}
+
+// ============================================================================
+// Lua Stats API
+// ============================================================================
+
+#define STATS_LOG_FILE "stats.log"
+#define STATS_LOG_MAX_BYTES 65536
+
+static void addStatsMember(json_encoder* encoder, const char* name) {
+    encoder->addTableMember(encoder, name, strlen(name));
+}
+
+static void encodePhases(json_encoder* encoder, const float* seconds) {
+    encoder->startTable(encoder);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        addStatsMember(encoder, phaseNames[i]);
+        encoder->writeInt(encoder, (int)(seconds[i] * 1000.0f + 0.5f));
+    }
+    encoder->endTable(encoder);
+}
+
+// Phase times in milliseconds, heap in bytes, frame counts per bucket
+static void encodeStats(json_encoder* encoder, const char* url) {
+    encoder->startTable(encoder);
+    if (url) {
+        addStatsMember(encoder, "url");
+        encoder->writeString(encoder, url, strlen(url));
+    }
+    addStatsMember(encoder, "page");
+    encodePhases(encoder, stats.page);
+    addStatsMember(encoder, "total");
+    encodePhases(encoder, stats.total);
+    addStatsMember(encoder, "pages");
+    encoder->writeInt(encoder, stats.pages);
+    addStatsMember(encoder, "heap");
+    encoder->writeInt(encoder, (int)stats.heapInUse);
+    addStatsMember(encoder, "heapPeak");
+    encoder->writeInt(encoder, (int)stats.heapPeak);
+
+    addStatsMember(encoder, "frameLimits");
+    encoder->startArray(encoder);
+    for (int i = 0; i < FRAME_BUCKET_COUNT - 1; i++) {
+        encoder->addArrayMember(encoder);
+        encoder->writeInt(encoder, frameBucketLimits[i]);
+    }
+    encoder->endArray(encoder);
+
+    addStatsMember(encoder, "frames");
+    encoder->startArray(encoder);
+    for (int i = 0; i < FRAME_BUCKET_COUNT; i++) {
+        encoder->addArrayMember(encoder);
+        encoder->writeInt(encoder, stats.frames[i]);
+    }
+    encoder->endArray(encoder);
+    encoder->endTable(encoder);
+}
+
+static struct {
+    char text[1024];
+    int length;
+} statsBuffer;
+
+static void writeStatsBuffer(void* userdata, const char* str, int len) {
+    (void)userdata;
+    if (statsBuffer.length + len >= (int)sizeof(statsBuffer.text)) {
+        len = sizeof(statsBuffer.text) - 1 - statsBuffer.length;
+    }
+    memcpy(statsBuffer.text + statsBuffer.length, str, len);
+    statsBuffer.length += len;
+}
+
+static void writeStatsFile(void* userdata, const char* str, int len) {
+    pd->file->write(userdata, str, len);
+}
+
+// Get the current stats
+// Returns: a JSON string (decode it with json.decode): page and total
+// phase times in ms, pages, heap and heapPeak in bytes, and a histogram of
+// frame times (frames[i] counts frames up to frameLimits[i] ms, the last
+// entry the rest)
+static int getStats(lua_State* L) {
+    (void)L;
+
+    json_encoder encoder;
+    statsBuffer.length = 0;
+    pd->json->initEncoder(&encoder, writeStatsBuffer, NULL, 0);
+    encodeStats(&encoder, NULL);
+
+    pd->lua->pushBytes(statsBuffer.text, statsBuffer.length);
+    return 1;
+}
+
+// Count the time since the previous call in the frame time histogram;
+// called once per playdate.update
+static int recordFrame(lua_State* L) {
+    (void)L;
+
+    unsigned int now = pd->system->getCurrentTimeMilliseconds();
+    if (stats.lastFrameTime) {
+        unsigned int frameTime = now - stats.lastFrameTime;
+        int bucket = 0;
+        while (bucket < FRAME_BUCKET_COUNT - 1 && frameTime > frameBucketLimits[bucket]) {
+            bucket++;
+        }
+        stats.frames[bucket]++;
+    }
+    stats.lastFrameTime = now;
+    return 0;
+}
+
+// Append the stats to stats.log in the Data folder, one JSON line per call;
+// a full log is moved to stats.old.log
+// Args: url (the page just loaded)
+static int logStats(lua_State* L) {
+    (void)L;
+
+    FileStat stat;
+    if (pd->file->stat(STATS_LOG_FILE, &stat) == 0 && stat.size > STATS_LOG_MAX_BYTES) {
+        pd->file->unlink("stats.old.log", 0);
+        pd->file->rename(STATS_LOG_FILE, "stats.old.log");
+    }
+
+    SDFile* file = pd->file->open(STATS_LOG_FILE, kFileAppend);
+    if (!file) {
+        pd->system->logToConsole("logStats: %s", pd->file->geterr());
+        return 0;
+    }
+
+    json_encoder encoder;
+    pd->json->initEncoder(&encoder, writeStatsFile, file, 0);
+    encodeStats(&encoder, pd->lua->getArgString(1));
+    pd->file->write(file, "\n", 1);
+    pd->file->close(file);
+    return 0;
+}
+
+#ifdef _WINDLL
+__declspec(dllexport)
+#endif
+int eventHandler(PlaydateAPI* playdate, PDSystemEvent event, uint32_t arg) {
+    (void)arg;
+
+    if (event == kEventInitLua) {
+        pd = playdate;
+        lexbor_memory_setup(lexborMalloc, lexborRealloc, lexborCalloc, lexborFree);
+
+        const char* err;
+
+        if (!pd->lua->addFunction(initRenderer, "cmark.initRenderer", &err)) {
+            pd->system->logToConsole("Failed to register cmark.initRenderer: %s", err);
+        }
+
+        if (!pd->lua->addFunction(renderPage, "cmark.render", &err)) {
+            pd->system->logToConsole("Failed to register cmark.render: %s", err);
+        }
+
+        if (!pd->lua->addFunction(renderHTML, "html.render", &err)) {
+            pd->system->logToConsole("Failed to register html.render: %s", err);
+        }
+
+        if (!pd->lua->registerClass(LINK_TABLE_CLASS, linkTableMethods, NULL, 0, &err)) {
+            pd->system->logToConsole("Failed to register %s: %s", LINK_TABLE_CLASS, err);
+        }
+
+        if (!pd->lua->addFunction(drawPage, "orbit.drawPage", &err)) {
+            pd->system->logToConsole("Failed to register orbit.drawPage: %s", err);
+        }
+
+        if (!pd->lua->addFunction(rememberPage, "orbit.rememberPage", &err)) {
+            pd->system->logToConsole("Failed to register orbit.rememberPage: %s", err);
+        }
+
+        if (!pd->lua->addFunction(recallPage, "orbit.recallPage", &err)) {
+            pd->system->logToConsole("Failed to register orbit.recallPage: %s", err);
+        }
+
+        if (!pd->lua->addFunction(forgetPage, "orbit.forgetPage", &err)) {
+            pd->system->logToConsole("Failed to register orbit.forgetPage: %s", err);
+        }
+
+        const struct {
+            lua_CFunction func;
+            const char* name;
+        } statsFunctions[] = {
+            { getStats, "orbit.stats" },
+            { recordFrame, "orbit.recordFrame" },
+            { logStats, "orbit.logStats" },
+        };
+        for (size_t i = 0; i < sizeof(statsFunctions) / sizeof(statsFunctions[0]); i++) {
+            if (!pd->lua->addFunction(statsFunctions[i].func, statsFunctions[i].name, &err)) {
+                pd->system->logToConsole("Failed to register %s: %s", statsFunctions[i].name, err);
+            }
+        }
+
+        const struct {
+            lua_CFunction func;
+            const char* name;
+        } cacheFunctions[] = {
+            { cacheLookup, "cache.lookup" },
+            { cacheTouch, "cache.touch" },
+            { cacheStore, "cache.store" },
+            { cacheLoad, "cache.load" },
+            { cacheSaveLayout, "cache.saveLayout" },
+            { cacheShowLayout, "cache.showLayout" },
+        };
+        for (size_t i = 0; i < sizeof(cacheFunctions) / sizeof(cacheFunctions[0]); i++) {
+            if (!pd->lua->addFunction(cacheFunctions[i].func, cacheFunctions[i].name, &err)) {
+                pd->system->logToConsole("Failed to register %s: %s", cacheFunctions[i].name, err);
+            }
+        }
+
+        const struct {
+            lua_CFunction func;
+            const char* name;
+        } imageFunctions[] = {
+            { nextImage, "orbit.nextImage" },
+            { beginImage, "orbit.beginImage" },
+            { feedImage, "orbit.feedImage" },
+            { endImageInput, "orbit.endImageInput" },
+            { stepImage, "orbit.stepImage" },
+            { cancelImage, "orbit.cancelImage" },
+        };
+        for (size_t i = 0; i < sizeof(imageFunctions) / sizeof(imageFunctions[0]); i++) {
+            if (!pd->lua->addFunction(imageFunctions[i].func, imageFunctions[i].name, &err)) {
+                pd->system->logToConsole("Failed to register %s: %s", imageFunctions[i].name, err);
+            }
+        }
+
+        const struct {
+            lua_CFunction func;
+            const char* name;
+        } findFunctions[] = {
+            { findInPage, "orbit.find" },
+            { findMatch, "orbit.findMatch" },
+        };
+        for (size_t i = 0; i < sizeof(findFunctions) / sizeof(findFunctions[0]); i++) {
+            if (!pd->lua->addFunction(findFunctions[i].func, findFunctions[i].name, &err)) {
+                pd->system->logToConsole("Failed to register %s: %s", findFunctions[i].name, err);
+            }
+        }
+
+        // Streaming variants; feed/step/preview/finish act on whichever stream is open
+        const struct {
+            lua_CFunction func;
+            const char* name;
+        } streamFunctions[] = {
+            { startMarkdownStream, "cmark.beginStream" },
+            { setPageEncoding, "cmark.setEncoding" },
+            { feedPage, "cmark.feed" },
+            { stepPage, "cmark.step" },
+            { endPageInput, "cmark.endInput" },
+            { previewPage, "cmark.preview" },
+            { finishPage, "cmark.finish" },
+            { cancelPage, "cmark.cancel" },
+            { canRenderHTML, "html.canRender" },
+            { startHTMLStream, "html.beginStream" },
+            { setPageEncoding, "html.setEncoding" },
+            { feedPage, "html.feed" },
+            { stepPage, "html.step" },
+            { endPageInput, "html.endInput" },
+            { previewPage, "html.preview" },
+            { finishPage, "html.finish" },
+            { cancelPage, "html.cancel" },
+        };
+        for (size_t i = 0; i < sizeof(streamFunctions) / sizeof(streamFunctions[0]); i++) {
+            if (!pd->lua->addFunction(streamFunctions[i].func, streamFunctions[i].name, &err)) {
+                pd->system->logToConsole("Failed to register %s: %s", streamFunctions[i].name, err);
+            }
         }
 
         pd->system->logToConsole("cmark and html functions registered");